@@ -0,0 +1,40 @@
+#!/usr/bin/env bash
+#
+# Compares pipelines of built-ins run on threads of the shell with the same
+# pipelines run as forked stages.
+#
+# A pipeline of built-ins without redirections runs on threads; redirecting
+# the input of its first stage from /dev/null makes it fork, at the cost of
+# one open(2). The shell is run on a script of RUNS copies of each pipeline
+# and timed as a whole.
+#
+# Usage: bench/pipeline.sh [RUNS]
+#
+# SHELL_BIN selects the shell to measure (default: ./shell). The default
+# build has sanitizers, so build an optimized one for representative
+# numbers:
+#
+#     gcc -O2 -o /tmp/shell-O2 shell.c -ldl -lpthread -lz
+#     SHELL_BIN=/tmp/shell-O2 bench/pipeline.sh
+
+set -eu
+
+runs=${1:-500}
+shell_bin=${SHELL_BIN:-./shell}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+for i in $(seq "$runs"); do echo 'count -l | count -l'; done >"$work/threaded"
+for i in $(seq "$runs"); do
+  echo 'count -l < /dev/null | count -l'
+done >"$work/forked"
+
+# Commands come from `source`, so that the first stage reads the shell's
+# standard input, which is empty, rather than the script
+measure() {
+  TIMEFORMAT="$(printf '%-10s %6d runs' "$1" "$runs")  %3R s"
+  time (echo "source $work/$1" | "$shell_bin" >/dev/null 2>&1)
+}
+
+measure threaded
+measure forked
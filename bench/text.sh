@@ -0,0 +1,68 @@
+#!/usr/bin/env bash
+#
+# Compares the text built-ins with the tools they stand in for: `fields 2`
+# with awk '{print $2}', `match` with grep -F, and `count -l` with wc -l.
+#
+# Each is timed on a large generated file, run once, and on a small file,
+# run RUNS times, where starting a process dominates. Both sides run from
+# the shell under test, which is timed as a whole, and their outputs are
+# compared.
+#
+# Usage: bench/text.sh [LINES] [RUNS]
+#
+# SHELL_BIN selects the shell to measure (default: ./shell). The default
+# build has sanitizers, so build an optimized one for representative
+# numbers:
+#
+#     gcc -O2 -o /tmp/shell-O2 shell.c -ldl -lpthread -lz
+#     SHELL_BIN=/tmp/shell-O2 bench/text.sh
+
+set -eu
+
+lines=${1:-2000000}
+runs=${2:-300}
+shell_bin=${SHELL_BIN:-./shell}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+awk -v n="$lines" 'BEGIN {
+  srand(1)
+  for (i = 0; i < n; i++) {
+    printf "%d  user%d\t%s %.3f\n", i, int(rand() * 1000),
+           (rand() < 0.1 ? "needle" : "hay"), rand() * 100
+  }
+}' >"$work/large"
+head -n 4 "$work/large" >"$work/small"
+echo '{print $2}' >"$work/field.awk"
+
+# The shell has no quoting, so each command is a line of a sourced script
+run() {
+  local name=$1 input=$2 count=$3 cmd=$4
+  for i in $(seq "$count"); do
+    echo "$cmd < $work/$input > $work/$name.out"
+  done >"$work/$name.sh"
+  TIMEFORMAT="$(printf '%-24s' "$name")  %3R s"
+  # grep fails when nothing matches, which ends the shell with its status
+  time (echo "source $work/$name.sh" | "$shell_bin" >/dev/null 2>&1 || true)
+}
+
+compare() {
+  local size=$1 count=$2
+  echo "$size input ($(wc -l <"$work/$size") lines, $count runs)"
+  run "fields-$size" "$size" "$count" 'fields 2'
+  run "awk-$size" "$size" "$count" "awk -f $work/field.awk"
+  run "match-$size" "$size" "$count" 'match needle'
+  run "grep-$size" "$size" "$count" 'grep -F needle'
+  run "count-$size" "$size" "$count" 'count -l'
+  run "wc-$size" "$size" "$count" 'wc -l'
+  cmp -s "$work/fields-$size.out" "$work/awk-$size.out" ||
+    echo "fields and awk differ" >&2
+  cmp -s "$work/match-$size.out" "$work/grep-$size.out" ||
+    echo "match and grep differ" >&2
+  [ "$(tr -d ' ' <"$work/count-$size.out")" = \
+    "$(tr -d ' ' <"$work/wc-$size.out")" ] ||
+    echo "count and wc differ" >&2
+}
+
+compare large 1
+compare small "$runs"
@@ -10,13 +10,67 @@
  *   standard input, output, error streams, and appending to files. Redirection
  *   symbols are expected to be surrounded by whitespace and can appear
  *   anywhere in the command.
+ *   Targets named `gz:FILE` are compressed by threads of the shell, one
+ *   block per CPU at a time, or decompressed for input.
+ * - Line Editor: with `set -o highlight`, lines typed on a terminal are
+ *   edited in place and highlighted by a lexer that restarts from
+ *   checkpoints and stops once its state matches the previous pass.
+ * - Completion: Tab completes command and file names, and arguments of
+ *   commands with `complete -F` specs, which are loaded on first use through
+ *   an index of the completion directory.
+ * - Continuation Lines: a line ending with `|` or a backslash continues on
+ *   the next one, read with the `PS2` prompt, in interactive input and in
+ *   scripts alike.
  * - Environment: Utilizes a customizable prompt string, defaulting to a simple
  *   format but can be overridden by the `PS1` environment variable. Special
  *   characters in the prompt string are treated as normal text.
+ * - Command Cache: the last resolution of each command name, to a built-in
+ *   or a path, is kept until built-ins are loaded or `PATH` changes.
  * - Built-in Commands: Supports basic navigation via `cd` and exiting the
- *   shell using `exit`.
- * - Shell Variable `$?`: Captures the exit status of the last executed command
- *   or the signal number (with bit 7 set) if the process terminated due to a
+ *   shell using `exit`. Built-ins run in the shell process and honor
+ *   redirections.
+ * - Scripts: `source` runs commands from a file. With `set -o autopar`,
+ *   commands with non-conflicting file effects overlap while their output is
+ *   replayed in order.
+ *   Each sourced file has a scope for variables declared with `local`,
+ *   kept in persistent hash maps so that entering a scope copies nothing.
+ * - Memoization: `memo` replays the cached output and exit status of a
+ *   command whose arguments, environment and input files are unchanged.
+ * - Statistics: the run times of external commands are recorded in a shared
+ *   histogram file, and `stats` reports their percentiles.
+ * - Time Limits: `timeout` bounds the run time of a command by waiting on a
+ *   pidfd and a timerfd, without a helper process.
+ * - Spawn Attributes: `spawn` applies niceness, I/O priority, CPU affinity,
+ *   umask, resource limits and working directory right before exec.
+ * - Pipelines and Jobs: commands can be chained with `|` and run in the
+ *   background with `&`, with `jobs` and `wait` to manage them. The
+ *   `placement` option pins jobs and pipeline stages to CPUs according to
+ *   the CPU topology. The `admit` option queues jobs until memory, pressure
+ *   and load allow them, based on the peak memory of earlier runs.
+ *   In a delegated cgroup v2 subtree, each job runs in its own cgroup,
+ *   which `jobs -l` reports on, `limit` constrains and `kill` signals.
+ *   With `set -o pipeprof`, stages are linked by splice relays, and a table
+ *   of the flow through each stage names the one limiting the pipeline.
+ *   With `set -o capture`, job output is kept in memory ring buffers, filled
+ *   by an epoll event loop while the shell waits for input or children.
+ *   With `set -o uring`, that loop runs on io_uring instead, and the
+ *   redirection targets of a pipeline are opened in one submission.
+ * - Loadable Built-ins: `enable -f` loads built-ins from shared objects
+ *   through the stable interface of shell_builtin.h.
+ *   Pipelines of such built-ins and `read`, `fields`, `match` and `count`
+ *   run on threads of the shell, and the `lastpipe` option runs a final
+ *   built-in stage in the shell.
+ * - State Snapshots: options and loaded built-ins reach child shells as a
+ *   sealed memfd that they map read-only at startup.
+ * - Dependency Graphs: `dag` runs a set of tasks with dependencies in
+ *   parallel and reports the critical path.
+ * - Conditional Expressions: `[[ ]]`, `test` and `[` test strings and
+ *   files, and `[[ ]]` glob patterns and regular expressions, whose
+ *   compiled forms are kept in an LRU cache. With `set -o statcache`, file
+ *   tests share `stat` results until a command that may change files runs.
+ * - Shell Variables: `$NAME` and `${NAME}` expand to variable values, and
+ *   `$?` captures the exit status of the last executed command or the
+ *   signal number (with bit 7 set) if the process terminated due to a
  *   signal.
  * - Signal Handling: Ignores `^C` (SIGINT) at the shell level, allowing
  *   interruption of child processes without exiting the shell.
@@ -27,6 +81,103 @@
 
 #include "shell.h"
 
+// Disposition of SIGINT inherited by the shell, restored in child processes
+static struct sigaction default_sigint;
+// Number of SIGINTs received, so that waits can tell they were interrupted
+static volatile sig_atomic_t sigint_count;
+
+// Current state of the options controlled by `set -o`
+static int shell_options[kOptionCount];
+
+// Background jobs that have not been reported as finished yet
+static DynamicArray *job_table;
+
+// Warning about the last command being unusually slow, shown before the
+// next prompt
+static char outlier_note[256];
+static JobLimits default_limits;  // applied to new background jobs
+// Leaf cgroup the shell moved itself into so that its jobs get controllers,
+// and the controllers it enabled, both undone when the shell exits
+static char cgroup_leaf[32];
+static char cgroup_enabled[64];
+static pid_t cgroup_owner;
+// Redirection targets opened in one io_uring submission, for the command
+// or pipeline being started
+static DynamicArray *preopened;
+
+// Built-ins loaded from shared objects with `enable -f`
+static DynamicArray *loaded_builtins;
+
+// Guards the environment, which holds the shell variables, against stages
+// of in-process pipelines
+static pthread_mutex_t variables_lock = PTHREAD_MUTEX_INITIALIZER;
+// Set on the threads running stages of in-process pipelines but the last
+static __thread int in_pipeline_thread;
+
+// Local variables seen by the shell thread, and the number of `source`
+// scopes it is in
+static ScopeNode *shell_scope;
+static int scope_depth;
+// Snapshot of the local variables on which a pipeline stage thread works
+static __thread ScopeNode *stage_scope;
+// Tags the bindings a thread may change in place, 0 on the shell thread
+static __thread unsigned scope_owner;
+static unsigned last_scope_owner;
+// Generation of the stage snapshots of the running in-process pipeline, or
+// 0 when none runs
+static unsigned snapshot_generation;
+static unsigned last_snapshot_generation;
+// Values replaced since the last command line, which built-ins may still use
+static DynamicArray *retired_values;
+
+// Open-addressing table of interned strings, a power of two in size
+static InternSlot *intern_slots;
+static size_t intern_capacity;
+static size_t intern_count;
+
+// Last resolution of each command name, valid while the generations of the
+// built-in table and of `PATH` it was made in are current
+static CommandCacheEntry command_cache[kCommandCacheSize];
+static unsigned builtin_generation = 1;
+static unsigned path_generation = 1;
+
+// Patterns compiled for `[[ =~ ]]`, the least recently used one replaced
+// when all slots are taken
+static RegexCacheEntry regex_cache[kRegexCacheSize];
+static uint64_t regex_clock;
+
+// Results of `stat` for the `statcache` option, valid while their
+// generation is current
+static StatCacheEntry stat_cache[kStatCacheSize];
+static unsigned stat_generation = 1;
+
+// Whether the line being read continues a command, and gets PS2
+static int reading_continuation;
+// Keys read by the line editor but not applied yet, kept for the next line
+static unsigned char edit_keys[kLineBufferSize];
+static size_t edit_nkeys, edit_applied;
+
+// Completion specs by command name, those loaded from the completion
+// directory included, and the spec file being sourced for one
+static DynamicArray *completion_specs;
+static const char *loading_spec_file;
+
+// Index of the completion directory, mapped from the cache directory
+static const CompletionIndexHeader *completion_index;
+static size_t completion_index_size;
+
+// Compressors and decompressors of `gz:` redirections not joined yet
+static DynamicArray *streams;
+
+// Relays of the pipeline being started, whose descriptors children close
+static PipeRelay *active_relays;
+static size_t nactive_relays;
+
+// Sealed memfd holding the state passed to child shells, and whether that
+// state changed since it was written
+static int snapshot_fd = -1;
+static int snapshot_stale = 1;
+
 /**
  * @brief Entry point of the shell program.
  *
@@ -38,124 +189,9499 @@
  */
 int main(void) {
   char cmdline[kInputMax];
-  char *ps1 = getenv("PS1");
 
   int status = 0;
 
-  struct sigaction act, oldact;
+  struct sigaction act;
   act.sa_handler = sigint_handler;
   sigemptyset(&act.sa_mask);
   act.sa_flags = 0;
-  if (sigaction(SIGINT, &act, &oldact) < 0) {
+  if (sigaction(SIGINT, &act, &default_sigint) < 0) {
     perror("sigaction");
     exit(EXIT_FAILURE);
   }
+  LoadSnapshot();
 
+  CommandBuffer command = {NULL, 0, 0, kContinueNone};
   while (1) {
-    ps1 ? printf("%s ", ps1) : ExpandPromptString();
+    reading_continuation = command.pending != kContinueNone;
+    if (!reading_continuation) {
+      ReapJobs();
+      if (outlier_note[0]) {
+        fprintf(stderr, "shell: %s", outlier_note);
+        outlier_note[0] = '\0';
+      }
+    }
+    PrintPrompt();
+    int ret = ReadCommandLine(cmdline, kInputMax);
+    if (ret == 0) {
+      if (command.pending == kContinuePipe) {
+        PrintError("syntax error: unexpected end of file\n");
+        status = 2;
+      } else if (command.len > 0) {
+        status = ExecuteCommandLine(command.text, status);
+      }
+      exit(status);
+    }
+    if (ret < 0) {
+      if (errno != EINTR) {
+        PrintError("%s\n", strerror(errno));
+      }
+      ResetCommandBuffer(&command);
+      continue;
+    }
+
+    int complete = AppendCommandLine(&command, cmdline);
+    if (complete < 0) {
+      PrintError("%s\n", strerror(errno));
+      ResetCommandBuffer(&command);
+      continue;
+    }
+    if (!complete) {
+      continue;
+    }
+
+    if (*command.text != '\0') {
+      status = ExecuteCommandLine(command.text, status);
+    }
+    ResetCommandBuffer(&command);
+  }
+}
+
+/**
+ * @brief Executes a single command line.
+ *
+ * The command line is a pipeline of one or more commands separated by `|`,
+ * optionally followed by `&` to run it in the background. A single built-in
+ * command runs inside the shell process, as do pipelines made only of
+ * built-ins that take their descriptors from a context, one thread per
+ * stage. Anything else is executed in child processes.
+ *
+ * @param cmdline The command line to execute. It is modified in place by
+ *                tokenization.
+ * @param status  The exit status of the last executed command.
+ *
+ * @return The exit status of the command, or of the last command of the
+ *         pipeline. Starting a background job returns 0.
+ */
+int ExecuteCommandLine(char *cmdline, int status) {
+  FreeRetiredValues();
+  DynamicArray *da_args = TokenizeCommandLine(cmdline);
+  if (!da_args) {
+    PrintError("failed to tokenize command line: %s\n", strerror(errno));
+    return status;
+  }
+  DynamicArray *expanded = NULL;
+  if (ExpandVariables(da_args, status, &expanded) < 0) {
+    PrintError("failed to expand variables: %s\n", strerror(errno));
+    FreePathList(expanded);
+    FreeDynamicArray(da_args);
+    return 1;
+  }
+
+  char **args = (char **)da_args->data;
+  int background = 0;
+  if (da_args->len > 0 && args[da_args->len - 1] == kWordBackground) {
+    background = 1;
+    args[--da_args->len] = NULL;
+  }
+  if (da_args->len == 0) {
+    FreePathList(expanded);
+    FreeDynamicArray(da_args);
+    return status;
+  }
+  if (!PreservesStatCache(da_args, background)) {
+    stat_generation++;
+  }
+
+  DynamicArray *da_stages = SplitPipeline(da_args);
+  if (!da_stages) {
+    PrintError("syntax error: empty command in pipeline\n");
+    FreePathList(expanded);
+    FreeDynamicArray(da_args);
+    return 2;
+  }
+
+  DynamicArray **stages = (DynamicArray **)da_stages->data;
+  const Builtin *builtin = FindBuiltin(args[0]);
+  if (builtin && da_stages->len == 1 && !background) {
+    status = RunBuiltin(builtin, stages[0], status);
+  } else if (!background && IsThreadablePipeline(da_stages)) {
+    status = RunThreadedPipeline(da_stages, status);
+  } else {
+    status = RunPipeline(da_stages, status, background);
+  }
+  FinishStreams(0);
+
+  FreePipeline(da_stages);
+  FreePathList(expanded);
+  FreeDynamicArray(da_args);
+  return status;
+}
+
+/**
+ * @brief Splits a tokenized command line into pipeline stages at `|`.
+ *
+ * @param da_args Pointer to the DynamicArray containing the tokenized command
+ *                line.
+ *
+ * @return A DynamicArray of DynamicArray pointers, one per stage, each holding
+ *         the tokens of that stage, or NULL if a stage is empty or memory runs
+ *         out.
+ */
+DynamicArray *SplitPipeline(DynamicArray *da_args) {
+  char **args = (char **)da_args->data;
+  DynamicArray *da_stages = InitDynamicArray(kDefaultArraySize,
+                                             sizeof(DynamicArray *));
+  DynamicArray *da_stage = NULL;
+  if (!da_stages) {
+    return NULL;
+  }
+
+  for (size_t i = 0; i <= da_args->len; i++) {
+    if (i < da_args->len && args[i] != kWordPipe) {
+      if ((!da_stage &&
+           !(da_stage = InitDynamicArray(kDefaultArraySize, sizeof(char *)))) ||
+          AppendElement(da_stage, &args[i]) < 0) {
+        goto split_error;
+      }
+      continue;
+    }
+
+    // End of a stage: terminate its argument vector
+    char *null = NULL;
+    if (!da_stage || AppendElement(da_stage, &null) < 0 ||
+        AppendElement(da_stages, &da_stage) < 0) {
+      goto split_error;
+    }
+    da_stage->len--;
+    da_stage = NULL;
+  }
+  return da_stages;
+
+split_error:
+  FreeDynamicArray(da_stage);
+  FreePipeline(da_stages);
+  return NULL;
+}
+
+/**
+ * @brief Frees the stages created by `SplitPipeline()`.
+ */
+void FreePipeline(DynamicArray *da_stages) {
+  DynamicArray **stages = (DynamicArray **)da_stages->data;
+  for (size_t i = 0; i < da_stages->len; i++) {
+    FreeDynamicArray(stages[i]);
+  }
+  FreeDynamicArray(da_stages);
+}
+
+/**
+ * @brief Runs a pipeline in the foreground, or starts it as a background job.
+ *
+ * In the foreground, the shell waits for every stage and records its run
+ * time. With the `lastpipe` option, a final built-in stage runs in the shell
+ * process, so that its effects such as variable assignments persist. In the
+ * background, see `StartBackgroundJob()`.
+ *
+ * @param da_stages  Pointer to the DynamicArray of stages.
+ * @param status     The exit status of the last executed command.
+ * @param background Whether to run the pipeline in the background.
+ *
+ * @return The exit status of the last stage, 0 for a background job, or 1 if
+ *         the pipeline could not be started.
+ */
+int RunPipeline(DynamicArray *da_stages, int status, int background) {
+  if (background) {
+    return StartBackgroundJob(da_stages, status);
+  }
+
+  DynamicArray **stages = (DynamicArray **)da_stages->data;
+  size_t nstages = da_stages->len;
+  pid_t *pids = calloc(nstages, sizeof(pid_t));
+  if (!pids) {
+    PrintError("%s\n", strerror(errno));
+    return 1;
+  }
+
+  // With `lastpipe`, a final built-in runs in the shell, reading the pipe
+  char **last = (char **)stages[nstages - 1]->data;
+  const Builtin *builtin = nstages > 1 && shell_options[kOptionLastpipe]
+                               ? FindBuiltin(last[0])
+                               : NULL;
+  int fds[2] = {-1, -1};
+  if (builtin && pipe2(fds, O_CLOEXEC) < 0) {
+    PrintError("pipe failed: %s\n", strerror(errno));
+    builtin = NULL;
+  }
+
+  // With `pipeprof`, relays between the stages measure the flow through
+  PipeRelay *relays = NULL;
+  struct rusage *usage = NULL;
+  if (shell_options[kOptionPipeprof] && nstages > 1 && !builtin) {
+    relays = calloc(nstages - 1, sizeof(PipeRelay));
+    usage = calloc(nstages, sizeof(struct rusage));
+    if (!relays || !usage) {
+      free(relays);
+      free(usage);
+      relays = NULL;
+      usage = NULL;
+    }
+    for (size_t i = 0; relays && i + 1 < nstages; i++) {
+      relays[i].in_fd = -1;
+      relays[i].out_fd = -1;
+    }
+  }
+
+  int ret = 1;
+  double start = MonotonicSeconds();
+  SpawnAttributes attrs = kDefaultSpawnAttributes;
+  attrs.stdout_fd = fds[1];
+  da_stages->len -= builtin != NULL;
+  size_t started =
+      LaunchPipeline(da_stages, status, &attrs, relays, pids, NULL);
+  da_stages->len = nstages;
+  if (relays) {
+    StartPipeRelays(relays, nstages - 1);
+  }
+
+  if (builtin) {
+    close(fds[1]);
+    int saved_stdin = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+    if (saved_stdin < 0 || dup2(fds[0], STDIN_FILENO) < 0) {
+      PrintError("failed to redirect stdin: %s\n", strerror(errno));
+    } else if (started == nstages - 1) {
+      ret = RunBuiltin(builtin, stages[nstages - 1], status);
+    }
+    // Restoring stdin closes the pipe, so that writers still left stop
+    if (saved_stdin >= 0) {
+      dup2(saved_stdin, STDIN_FILENO);
+      close(saved_stdin);
+    }
+    close(fds[0]);
+  }
+
+  for (size_t i = 0; i < started; i++) {
+    int wstatus;
+    struct rusage ru;
+    char **args = (char **)stages[i]->data;
+    while (WaitForChild(P_PID, (id_t)pids[i]) < 0 ||
+           wait4(pids[i], &wstatus, 0, &ru) < 0) {
+      if (errno != EINTR) {
+        PrintError("wait failed: %s\n", strerror(errno));
+        goto cleanup;
+      }
+    }
+    if (i + 1 == nstages) {
+      ret = DecodeWaitStatus(wstatus);
+    }
+    RecordStageStats(args[0], start, &ru);
+    if (usage) {
+      usage[i] = ru;
+    }
+  }
+
+cleanup:
+  if (relays) {
+    StopPipeRelays(relays, nstages - 1);
+    if (started == nstages) {
+      PrintPipelineProfile(da_stages, relays, usage,
+                           MonotonicSeconds() - start);
+    }
+    for (size_t i = 0; i + 1 < nstages; i++) {
+      FreeDynamicArray(relays[i].slices);
+    }
+  }
+  free(relays);
+  free(usage);
+  free(pids);
+  return ret;
+}
+
+/**
+ * @brief Tells whether a pipeline can run on threads of the shell process.
+ *
+ * That is the case when it has several stages, each a built-in that takes
+ * its descriptors from a context, and none of them redirects its streams.
+ */
+int IsThreadablePipeline(DynamicArray *da_stages) {
+  DynamicArray **stages = (DynamicArray **)da_stages->data;
+  if (da_stages->len < 2) {
+    return 0;
+  }
+  for (size_t i = 0; i < da_stages->len; i++) {
+    char **args = (char **)stages[i]->data;
+    const Builtin *builtin = FindBuiltin(args[0]);
+    if (!builtin || !builtin->stream_func) {
+      return 0;
+    }
+    for (size_t j = SkipConditionalOperands(args, stages[i]->len);
+         j < stages[i]->len; j++) {
+      if (GetRedirectType(args[j]) != kNone) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/**
+ * @brief Thread body running one stage of an in-process pipeline.
+ *
+ * Closing the descriptors of the stage once it returns signals end of file
+ * to the next stage, and a broken pipe to the previous one.
+ */
+void *RunStageThread(void *arg) {
+  ThreadStage *stage = arg;
+  in_pipeline_thread = 1;
+  stage_scope = stage->scope;
+  do {
+    scope_owner = __atomic_add_fetch(&last_scope_owner, 1, __ATOMIC_RELAXED);
+  } while (scope_owner == 0);
+  stage->ret = stage->builtin->stream_func(
+      (int)stage->args->len, (char **)stage->args->data, &stage->ctx);
+  pthread_mutex_lock(&variables_lock);
+  ReleaseScope(stage_scope);
+  pthread_mutex_unlock(&variables_lock);
+  if (stage->ctx.stdin_fd != STDIN_FILENO) {
+    close(stage->ctx.stdin_fd);
+  }
+  if (stage->ctx.stdout_fd != STDOUT_FILENO) {
+    close(stage->ctx.stdout_fd);
+  }
+  __atomic_store_n(&stage->done, 1, __ATOMIC_RELEASE);
+  if (stage->done_fd >= 0) {
+    eventfd_write(stage->done_fd, 1);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Runs a pipeline of built-ins in the shell process, one thread per
+ *        stage, without forking.
+ *
+ * Stages are connected by pipes, as the built-ins read and write through
+ * descriptors. The last stage runs on the calling thread, so that its
+ * variable assignments persist, as with `lastpipe`. SIGPIPE is blocked on
+ * the other threads, so that writing to a stage that has finished fails
+ * with EPIPE instead of killing the shell, and so is SIGINT, which then
+ * interrupts the last stage. After ^C, the other stages, which may be
+ * blocked reading the terminal, are interrupted with `kStageCancelSignal`
+ * until they return.
+ *
+ * @param da_stages Pointer to the DynamicArray of stages, all of which pass
+ *                  `IsThreadablePipeline()`.
+ * @param status    The exit status of the last executed command.
+ *
+ * @return The exit status of the last stage.
+ */
+int RunThreadedPipeline(DynamicArray *da_stages, int status) {
+  DynamicArray **stages = (DynamicArray **)da_stages->data;
+  size_t nstages = da_stages->len;
+  ThreadStage *threads = calloc(nstages, sizeof(ThreadStage));
+  if (!threads) {
+    PrintError("%s\n", strerror(errno));
+    return 1;
+  }
+
+  // Without SA_RESTART, so that the signal interrupts blocking reads
+  static int cancel_installed;
+  if (!cancel_installed) {
+    struct sigaction act = {0};
+    act.sa_handler = stage_cancel_handler;
+    sigemptyset(&act.sa_mask);
+    cancel_installed = sigaction(kStageCancelSignal, &act, NULL) == 0;
+  }
+  int done_fd = eventfd(0, EFD_CLOEXEC);
+  sig_atomic_t sigints = sigint_count;
+
+  // Until the stages are joined, the shell thread keeps the values their
+  // snapshots were taken with (see AssignVariable())
+  pthread_mutex_lock(&variables_lock);
+  do {
+    snapshot_generation = ++last_snapshot_generation;
+  } while (snapshot_generation == 0);
+  pthread_mutex_unlock(&variables_lock);
+
+  sigset_t block, saved_mask;
+  sigemptyset(&block);
+  sigaddset(&block, SIGINT);
+  sigaddset(&block, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &block, &saved_mask);
+  fflush(stdout);
+  fflush(stderr);
+
+  int in_fd = STDIN_FILENO;
+  for (size_t i = 0; i < nstages; i++) {
+    char **args = (char **)stages[i]->data;
+    ThreadStage *stage = &threads[i];
+    int fds[2] = {-1, STDOUT_FILENO};
+    if (i + 1 < nstages && pipe2(fds, O_CLOEXEC) < 0) {
+      PrintError("pipe failed: %s\n", strerror(errno));
+      fds[1] = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    }
+
+    stage->builtin = FindBuiltin(args[0]);
+    stage->args = stages[i];
+    stage->ctx = (ShellBuiltinContext){&kShellApi, in_fd, fds[1],
+                                       STDERR_FILENO, status};
+    stage->ret = 1;
+    stage->done_fd = done_fd;
+    in_fd = fds[0];
+    if (i + 1 == nstages) {
+      break;
+    }
+
+    pthread_mutex_lock(&variables_lock);
+    stage->scope = RetainScope(shell_scope);
+    pthread_mutex_unlock(&variables_lock);
+    int err = pthread_create(&stage->thread, NULL, RunStageThread, stage);
+    if (err != 0) {
+      PrintError("failed to start stage: %s\n", strerror(err));
+      ReleaseScope(stage->scope);
+      if (stage->ctx.stdin_fd != STDIN_FILENO) {
+        close(stage->ctx.stdin_fd);
+      }
+      close(stage->ctx.stdout_fd);
+      continue;
+    }
+    stage->started = 1;
+  }
+  pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+
+  // The last stage runs here
+  ThreadStage *last = &threads[nstages - 1];
+  int ret = last->builtin->stream_func((int)last->args->len,
+                                       (char **)last->args->data, &last->ctx);
+  if (last->ctx.stdin_fd >= 0) {
+    close(last->ctx.stdin_fd);
+  }
+  for (size_t i = 0; i + 1 < nstages; i++) {
+    if (!threads[i].started) {
+      continue;
+    }
+    while (!__atomic_load_n(&threads[i].done, __ATOMIC_ACQUIRE)) {
+      int cancelling = cancel_installed && sigint_count != sigints;
+      if (cancelling) {
+        pthread_kill(threads[i].thread, kStageCancelSignal);
+      }
+      struct pollfd pfd = {.fd = done_fd, .events = POLLIN};
+      eventfd_t count;
+      if (poll(&pfd, 1, cancelling || done_fd < 0 ? kStageCancelRetryMs : -1) >
+          0) {
+        eventfd_read(done_fd, &count);
+      }
+    }
+    pthread_join(threads[i].thread, NULL);
+  }
+  pthread_mutex_lock(&variables_lock);
+  snapshot_generation = 0;
+  pthread_mutex_unlock(&variables_lock);
+  if (done_fd >= 0) {
+    close(done_fd);
+  }
+
+  free(threads);
+  return ret;
+}
+
+/**
+ * @brief Starts every stage of a pipeline, connecting them with pipes.
+ *
+ * A background job is requested with a `pgid` of 0 in the base attributes.
+ * Its stages then share a new process group and read their standard input
+ * from `/dev/null` unless redirected. Background jobs and multi-stage
+ * pipelines are pinned to CPUs according to the `placement` option.
+ *
+ * @param da_stages Pointer to the DynamicArray of stages.
+ * @param status    The exit status of the last executed command.
+ * @param base      Attributes shared by all stages. Standard output applies
+ *                  to the last stage only.
+ * @param relays    Array receiving, for each pair of adjacent stages, the
+ *                  ends of two pipes for a relay to connect, or NULL to
+ *                  connect the stages directly.
+ * @param pids      Array receiving the process ID of each started stage.
+ * @param pgid      Receives the process group of a background job, or NULL.
+ *
+ * @return The number of stages started. Fewer than all stages are started
+ *         only on error.
+ */
+size_t LaunchPipeline(DynamicArray *da_stages, int status,
+                      const SpawnAttributes *base, PipeRelay *relays,
+                      pid_t *pids, pid_t *pgid) {
+  DynamicArray **stages = (DynamicArray **)da_stages->data;
+  size_t nstages = da_stages->len;
+  int background = base->pgid == 0;
+  int in_fd = -1;
+  pid_t group = -1;
+  size_t started = 0;
+
+  cpu_set_t *placement = calloc(nstages, sizeof(cpu_set_t));
+  if (!placement) {
+    PrintError("%s\n", strerror(errno));
+    return 0;
+  }
+  int placed = (background || nstages > 1) &&
+               PlaceJob(nstages, placement) == 0;
+  PreopenRedirections(stages, nstages);
+  size_t first_stream = streams ? streams->len : 0;
+  if (StartStreamRedirections(stages, nstages) < 0) {
+    PrintError("%s\n", strerror(errno));
+  }
+
+  if (background && (in_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+    PrintError("/dev/null: %s\n", strerror(errno));
+    ClosePreopened();
+    free(placement);
+    return 0;
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+  active_relays = relays;
+  nactive_relays = relays ? nstages - 1 : 0;
+  for (; started < nstages; started++) {
+    int fds[2] = {-1, -1};
+    int link[2] = {-1, -1};
+    if (started + 1 < nstages &&
+        (pipe2(fds, O_CLOEXEC) < 0 ||
+         (relays && pipe2(link, O_CLOEXEC) < 0))) {
+      PrintError("pipe failed: %s\n", strerror(errno));
+      if (fds[0] >= 0) {
+        close(fds[0]);
+        close(fds[1]);
+      }
+      break;
+    }
+    if (relays && started + 1 < nstages) {
+      relays[started].in_fd = fds[0];
+      relays[started].out_fd = link[1];
+      fds[0] = link[0];
+    }
+
+    SpawnAttributes attrs = *base;
+    attrs.stdin_fd = in_fd;
+    if (fds[1] >= 0) {
+      attrs.stdout_fd = fds[1];
+    }
+    if (background) {
+      attrs.pgid = started == 0 ? 0 : group;
+    }
+    if (placed) {
+      attrs.set_affinity = 1;
+      attrs.affinity = placement[started];
+    }
+
+    pids[started] = LaunchProcess(stages[started], status, &attrs);
+    if (in_fd >= 0) {
+      close(in_fd);
+    }
+    if (fds[1] >= 0) {
+      close(fds[1]);
+    }
+    in_fd = fds[0];
+    if (pids[started] < 0) {
+      PrintError("fork failed: %s\n", strerror(errno));
+      break;
+    }
+
+    if (background) {
+      // Also done by the child; whichever runs first wins
+      group = started == 0 ? pids[0] : group;
+      setpgid(pids[started], group);
+    }
+  }
+  if (in_fd >= 0) {
+    close(in_fd);
+  }
+  ClosePreopened();
+  RedirectStream **list = streams ? (RedirectStream **)streams->data : NULL;
+  for (size_t i = first_stream; background && list && i < streams->len; i++) {
+    list[i]->pgid = group;
+  }
+
+  if (pgid) {
+    *pgid = group;
+  }
+  free(placement);
+  return started;
+}
+
+/**
+ * @brief Records the run time and memory use of a finished command.
+ *
+ * With the `statwarn` option set, unusually slow runs leave a note to be
+ * shown before the next prompt.
+ *
+ * @param cmd   Name of the command.
+ * @param start Monotonic time at which the command started.
+ * @param ru    Resource usage of the command.
+ */
+void RecordStageStats(const char *cmd, double start, const struct rusage *ru) {
+  uint64_t wall_us = (uint64_t)((MonotonicSeconds() - start) * 1e6);
+  uint64_t cpu_us = TimevalMicroseconds(&ru->ru_utime) +
+                    TimevalMicroseconds(&ru->ru_stime);
+  if (RecordCommandStats(cmd, wall_us, cpu_us, (uint64_t)ru->ru_maxrss) &&
+      shell_options[kOptionStatwarn]) {
+    char took[16];
+    FormatMicroseconds(took, sizeof(took), wall_us);
+    snprintf(outlier_note, sizeof(outlier_note),
+             "note: %s took %s, slower than 99%% of its previous runs\n", cmd,
+             took);
+  }
+}
+
+/**
+ * @brief Relays a pipe between two profiled pipeline stages.
+ *
+ * Data moves with `splice`, without being copied to user space. The relay
+ * counts the bytes moved per time slice, and the time spent waiting on an
+ * empty pipe from the upstream stage or on a full one to the downstream
+ * stage. Both ends are closed at end of file, or once the downstream stage
+ * stops reading.
+ *
+ * @param arg Pointer to the PipeRelay.
+ * @return NULL.
+ */
+void *RunPipeRelay(void *arg) {
+  PipeRelay *relay = (PipeRelay *)arg;
+  for (;;) {
+    ssize_t n = splice(relay->in_fd, NULL, relay->out_fd, NULL, kRelayChunk,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+      size_t slice = (size_t)((MonotonicSeconds() - relay->start) /
+                              kProfileSliceSeconds);
+      uint64_t zero = 0;
+      while (relay->slices && relay->slices->len <= slice &&
+             AppendElement(relay->slices, &zero) == 0) {
+      }
+      if (relay->slices && slice < relay->slices->len) {
+        ((uint64_t *)relay->slices->data)[slice] += (uint64_t)n;
+      }
+      relay->bytes += (uint64_t)n;
+      continue;
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+      break;  // End of file, or EPIPE once the downstream stage exited
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+
+    // Tell which side stalled before waiting on it
+    struct pollfd in = {relay->in_fd, POLLIN, 0};
+    struct pollfd out = {relay->out_fd, POLLOUT, 0};
+    int empty = poll(&in, 1, 0) == 0;
+    double waited = MonotonicSeconds();
+    poll(empty ? &in : &out, 1, -1);
+    waited = MonotonicSeconds() - waited;
+    if (empty) {
+      relay->wait_in += waited;
+    } else {
+      relay->wait_out += waited;
+    }
+  }
+  CloseStreamEnd(&relay->in_fd);
+  CloseStreamEnd(&relay->out_fd);
+  return NULL;
+}
+
+/**
+ * @brief Starts a thread for each relay of a profiled pipeline.
+ *
+ * Relays whose pipes could not be created are skipped. A relay that fails
+ * to start closes its pipes, so that its stages see end of file.
+ *
+ * @param relays  Relays filled in by LaunchPipeline.
+ * @param nrelays Number of relays, one less than the number of stages.
+ */
+void StartPipeRelays(PipeRelay *relays, size_t nrelays) {
+  // Writes to a closed pipe fail with EPIPE rather than raise SIGPIPE
+  sigset_t block, saved;
+  sigemptyset(&block);
+  sigaddset(&block, SIGPIPE);
+  sigaddset(&block, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &block, &saved);
+  for (size_t i = 0; i < nrelays; i++) {
+    if (relays[i].in_fd < 0 || relays[i].out_fd < 0) {
+      CloseStreamEnd(&relays[i].in_fd);
+      CloseStreamEnd(&relays[i].out_fd);
+      continue;
+    }
+    relays[i].start = MonotonicSeconds();
+    relays[i].slices = InitDynamicArray(16, sizeof(uint64_t));
+    errno = pthread_create(&relays[i].thread, NULL, RunPipeRelay, &relays[i]);
+    relays[i].started = errno == 0;
+    if (!relays[i].started) {
+      PrintError("pipeprof: %s\n", strerror(errno));
+      CloseStreamEnd(&relays[i].in_fd);
+      CloseStreamEnd(&relays[i].out_fd);
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+/**
+ * @brief Waits for the relays of a profiled pipeline to finish.
+ *
+ * @param relays  Relays started by StartPipeRelays.
+ * @param nrelays Number of relays.
+ */
+void StopPipeRelays(PipeRelay *relays, size_t nrelays) {
+  for (size_t i = 0; i < nrelays; i++) {
+    if (relays[i].started) {
+      pthread_join(relays[i].thread, NULL);
+      relays[i].started = 0;
+    }
+  }
+  active_relays = NULL;
+  nactive_relays = 0;
+}
+
+/**
+ * @brief Prints the profile of a pipeline run with `set -o pipeprof`.
+ *
+ * For each stage, the table gives the bytes read and written, the output
+ * rate, the time the stage left the relays waiting for input (STARVED
+ * counts it against the next stage, which had nothing to read) or for room
+ * to write (BLOCKED counts it against the stage writing into a full pipe),
+ * and its resource usage. A graph of the throughput over time follows for
+ * each pipe. The limiting stage is the one that was busy the longest, that
+ * is neither starved nor blocked.
+ *
+ * @param da_stages Stages of the pipeline.
+ * @param relays    Relays between the stages, one less than the stages.
+ * @param usage     Resource usage of each stage.
+ * @param wall      Wall-clock time of the pipeline in seconds.
+ */
+void PrintPipelineProfile(DynamicArray *da_stages, PipeRelay *relays,
+                          const struct rusage *usage, double wall) {
+  static const char kLevels[] = " .:-=+*#%@";
+  DynamicArray **stages = (DynamicArray **)da_stages->data;
+  size_t nstages = da_stages->len;
+  size_t limiting = 0;
+  double most_busy = -1;
+  uint64_t most_cpu = 0;
+
+  fprintf(stderr, "%-3s %-16s %9s %9s %9s %9s %9s %9s %9s\n", "#", "COMMAND",
+          "IN", "OUT", "RATE", "STARVED", "BLOCKED", "CPU", "MAXRSS");
+  for (size_t i = 0; i < nstages; i++) {
+    char **args = (char **)stages[i]->data;
+    char in[16] = "-", out[16] = "-", rate[24] = "-", starved[16] = "-",
+         blocked[16] = "-", cpu[16], rss[16];
+    double idle = 0;
+    if (i > 0) {
+      FormatBytes(in, sizeof(in), (long long)relays[i - 1].bytes);
+      FormatMicroseconds(starved, sizeof(starved),
+                         (uint64_t)(relays[i - 1].wait_in * 1e6));
+      idle += relays[i - 1].wait_in;
+    }
+    if (i + 1 < nstages) {
+      FormatBytes(out, sizeof(out), (long long)relays[i].bytes);
+      FormatBytes(rate, sizeof(rate) - 2,
+                  wall > 0 ? (long long)(relays[i].bytes / wall) : 0);
+      strcat(rate, "/s");
+      FormatMicroseconds(blocked, sizeof(blocked),
+                         (uint64_t)(relays[i].wait_out * 1e6));
+      idle += relays[i].wait_out;
+    }
+    uint64_t cpu_us = TimevalMicroseconds(&usage[i].ru_utime) +
+                      TimevalMicroseconds(&usage[i].ru_stime);
+    FormatMicroseconds(cpu, sizeof(cpu), cpu_us);
+    FormatBytes(rss, sizeof(rss), (long long)usage[i].ru_maxrss * 1024);
+    fprintf(stderr, "%-3zu %-16.16s %9s %9s %9s %9s %9s %9s %9s\n", i + 1,
+            args[0], in, out, rate, starved, blocked, cpu, rss);
+
+    double busy = wall - idle;
+    if (busy > most_busy || (busy == most_busy && cpu_us > most_cpu)) {
+      limiting = i;
+      most_busy = busy;
+      most_cpu = cpu_us;
+    }
+  }
+
+  for (size_t i = 0; i + 1 < nstages; i++) {
+    DynamicArray *slices = relays[i].slices;
+    size_t len = slices ? slices->len : 0;
+    uint64_t *bytes = slices ? (uint64_t *)slices->data : NULL;
+    uint64_t peak = 0;
+    for (size_t s = 0; s < len; s++) {
+      peak = bytes[s] > peak ? bytes[s] : peak;
+    }
+
+    // Each column covers an equal share of the slices
+    char graph[kProfileGraphWidth + 1];
+    size_t width =
+        len < (size_t)kProfileGraphWidth ? len : (size_t)kProfileGraphWidth;
+    for (size_t c = 0; c < width; c++) {
+      size_t from = c * len / width, to = (c + 1) * len / width;
+      uint64_t total = 0;
+      for (size_t s = from; s < to; s++) {
+        total += bytes[s];
+      }
+      uint64_t mean = to > from ? total / (to - from) : 0;
+      size_t level = peak ? (size_t)(mean * (sizeof(kLevels) - 2) / peak) : 0;
+      graph[c] = kLevels[level == 0 && mean > 0 ? 1 : level];
+    }
+    graph[width] = '\0';
+    char top[24];
+    FormatBytes(top, sizeof(top) - 2,
+                (long long)(peak / kProfileSliceSeconds));
+    strcat(top, "/s");
+    fprintf(stderr, "%zu->%zu |%-*s| peak %s\n", i + 1, i + 2,
+            kProfileGraphWidth, graph, top);
+  }
+
+  char **args = (char **)stages[limiting]->data;
+  fprintf(stderr, "limiting stage: %zu (%s)\n", limiting + 1, args[0]);
+}
+
+/**
+ * @brief Forks a child process that executes the given command.
+ *
+ * The child restores the original SIGINT disposition, applies any
+ * redirections found in the command line and replaces itself with the
+ * command. The parent returns immediately without waiting.
+ *
+ * The child leaves with `_exit()`: `exit()` would move the shared offset of
+ * a file being sourced back to the line the shell has read up to, and make
+ * the shell read the rest again.
+ *
+ * @param da_args Pointer to the DynamicArray containing the tokenized command
+ *                line. Only the child modifies it.
+ * @param status  The exit status of the last executed command, for
+ *                substitution in the command line.
+ * @param attrs   Optional attributes applied in the child before the
+ *                command's own redirections, or NULL.
+ *
+ * @return The process ID of the child, or -1 if fork fails, with errno set
+ *         accordingly.
+ */
+pid_t LaunchProcess(DynamicArray *da_args, int status,
+                    const SpawnAttributes *attrs) {
+  PrepareSnapshot();  // without it, a child shell starts from defaults
+
+  // Resolve the command here, so that the result stays in the cache
+  char **words = (char **)da_args->data;
+  size_t word = 0;
+  while (word + 1 < da_args->len && GetRedirectType(words[word]) != kNone) {
+    word += 2;
+  }
+  const CommandCacheEntry *command =
+      word < da_args->len ? ResolveCommand(words[word], 1) : NULL;
+
+  pid_t pid = fork();
+  if (pid != 0) {
+    stat_generation++;  // the child may change any file
+    return pid;
+  }
+  CloseThreadDescriptors();
+
+  // Restore original disposition for SIGINT
+  if (sigaction(SIGINT, &default_sigint, NULL) < 0) {
+    perror("sigaction");
+    _exit(EXIT_FAILURE);
+  }
+
+  if (attrs && ApplySpawnAttributes(attrs) < 0) {
+    PrintError("failed to set up process: %s\n", strerror(errno));
+    _exit(EXIT_FAILURE);
+  }
+
+  Process *proc = InitProcess();
+  if (!proc) {
+    FreeDynamicArray(da_args);
+    PrintError("failed to initialize process: %s\n", strerror(errno));
+    _exit(EXIT_FAILURE);
+  }
+
+  int parsed = ParseCommand(proc, da_args);
+  ClosePreopened();  // those of the other stages
+  if (parsed < 0) {
+    free(proc);
+    FreeDynamicArray(da_args);
+    _exit(EXIT_FAILURE);
+  }
+
+  // Built-ins in pipelines and background jobs run in the child
+  const Builtin *builtin = FindBuiltin(proc->cmd);
+  if (builtin) {
+    int ret = CallBuiltin(builtin, (int)da_args->len, proc->args, status);
+    fflush(stdout);
+    fflush(stderr);
+    _exit(ret);
+  }
+
+  // Only a child shell gets the snapshot; it stays close-on-exec otherwise
+  const char *path = command && command->path &&
+                             strcmp(command->name, proc->cmd) == 0
+                         ? command->path
+                         : NULL;
+  char snapshot[16];
+  if (snapshot_fd >= 0) {
+    char *found = path || strchr(proc->cmd, '/') ? NULL : SearchPath(proc->cmd);
+    const char *target = path ? path : found ? found : proc->cmd;
+    if (IsShellExecutable(target) && fcntl(snapshot_fd, F_SETFD, 0) == 0) {
+      snprintf(snapshot, sizeof(snapshot), "%d", snapshot_fd);
+      setenv(kSnapshotVariable, snapshot, 1);
+    }
+    free(found);
+  }
+  if (path) {
+    execv(path, proc->args);
+  }
+  execvp(proc->cmd, proc->args);  // also if the cached path went away
+  int exec_errno = errno;
+  if (exec_errno == ENOENT) {
+    PrintError("unrecognized command: %s\n", proc->cmd);
+  } else {
+    fprintf(stderr, "exec: %s\n", strerror(exec_errno));
+  }
+
+  // exec failed
+  FreeDynamicArray(da_args);
+  CleanupRedirection(proc);
+  free(proc);
+  _exit(exec_errno == ENOENT ? kExitNotFound : kExitNotExecutable);
+}
+
+/**
+ * @brief Applies spawn attributes in a freshly forked child.
+ *
+ * @param attrs Pointer to the attributes to apply.
+ *
+ * @return 0 on success, or -1 on error with errno set accordingly.
+ */
+int ApplySpawnAttributes(const SpawnAttributes *attrs) {
+  if (attrs->cgroup_fd >= 0 &&
+      WriteFileAt(attrs->cgroup_fd, "cgroup.procs", "0") < 0) {
+    return -1;
+  }
+  if (attrs->pgid >= 0 && setpgid(0, attrs->pgid) < 0) {
+    return -1;
+  }
+  if (attrs->stdin_fd >= 0 && dup2(attrs->stdin_fd, STDIN_FILENO) < 0) {
+    return -1;
+  }
+  if (attrs->stdout_fd >= 0 && dup2(attrs->stdout_fd, STDOUT_FILENO) < 0) {
+    return -1;
+  }
+  if (attrs->stderr_fd >= 0 && dup2(attrs->stderr_fd, STDERR_FILENO) < 0) {
+    return -1;
+  }
+  if (attrs->umask >= 0) {
+    umask((mode_t)attrs->umask);
+  }
+  if (attrs->dir_fd >= 0 && fchdir(attrs->dir_fd) < 0) {
+    return -1;
+  }
+  for (size_t i = 0; i < attrs->nlimits; i++) {
+    const ResourceLimit *limit = &attrs->limits[i];
+    if (prlimit(0, limit->resource, &limit->lim, NULL) < 0) {
+      return -1;
+    }
+  }
+  if (attrs->set_nice) {
+    errno = 0;
+    int prio = getpriority(PRIO_PROCESS, 0);
+    if ((prio == -1 && errno != 0) ||
+        setpriority(PRIO_PROCESS, 0, prio + attrs->nice_inc) < 0) {
+      return -1;
+    }
+  }
+  if (attrs->ioprio >= 0 &&
+      syscall(SYS_ioprio_set, kIoPrioWhoProcess, 0, attrs->ioprio) < 0) {
+    return -1;
+  }
+  if (attrs->set_affinity &&
+      sched_setaffinity(0, sizeof(cpu_set_t), &attrs->affinity) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Converts a status reported by `waitpid` into a shell exit status.
+ *
+ * @param wstatus The status value filled in by `waitpid`.
+ *
+ * @return The exit code of the process, or 128 plus the signal number if the
+ *         process was terminated by a signal.
+ */
+int DecodeWaitStatus(int wstatus) {
+  if (WIFEXITED(wstatus)) {
+    return WEXITSTATUS(wstatus);
+  }
+  if (WIFSIGNALED(wstatus)) {
+    return 128 + WTERMSIG(wstatus);
+  }
+  return wstatus;
+}
+
+/**
+ * @brief Looks up a built-in command by name, through the command cache.
+ *
+ * @param name The command name, as typed by the user.
+ *
+ * @return A pointer to the matching entry of the built-in table or of the
+ *         loaded built-ins, or NULL if the command is not a built-in. Entries
+ *         of loaded built-ins move when another one is loaded or unloaded.
+ */
+const Builtin *FindBuiltin(const char *name) {
+  const CommandCacheEntry *entry = ResolveCommand(name, 0);
+  return entry ? entry->builtin : LookupBuiltin(name);
+}
+
+/**
+ * @brief Looks up a built-in command by name in the built-in table and the
+ *        loaded built-ins.
+ *
+ * @return A pointer to the matching entry, or NULL if the command is not a
+ *         built-in.
+ */
+const Builtin *LookupBuiltin(const char *name) {
+  for (const Builtin *b = kBuiltins; b->name; b++) {
+    if (strcmp(name, b->name) == 0) {
+      return b;
+    }
+  }
+
+  LoadedBuiltin *loaded = FindLoadedBuiltin(name);
+  return loaded ? &loaded->builtin : NULL;
+}
+
+/**
+ * @brief Resolves a command name through the command cache.
+ *
+ * Each slot of the cache keeps the last resolution of one name: the
+ * built-in it runs, and optionally the absolute path it was found at in
+ * `PATH`. Resolutions are tagged with the generations of the built-in
+ * table and of `PATH`, so that a hit costs a hash and a comparison and
+ * loading a built-in or changing `PATH` invalidates them all at once. Only
+ * paths found in absolute directories of `PATH` are kept, as others depend
+ * on the working directory. Used on the shell thread only.
+ *
+ * @param name   The command name, as typed by the user.
+ * @param search Whether to search `PATH` when the name is no built-in.
+ *
+ * @return The cache entry, or NULL on allocation failure.
+ */
+const CommandCacheEntry *ResolveCommand(const char *name, int search) {
+  size_t len = strlen(name);
+  uint64_t hash = HashBytes(kFnvOffsetBasis, name, len);
+  CommandCacheEntry *entry = &command_cache[hash % kCommandCacheSize];
+  if (entry->name != name &&
+      (!entry->name || entry->hash != hash || strcmp(entry->name, name) != 0)) {
+    // Interned, so that the tokens of later command lines match by pointer
+    const char *word = InternString(name, 1);
+    if (!word) {
+      return NULL;
+    }
+    free(entry->path);
+    *entry = (CommandCacheEntry){word, NULL, NULL, hash, 0, 0, 0};
+  }
+
+  if (entry->builtin_generation != builtin_generation) {
+    entry->builtin = LookupBuiltin(name);
+    entry->builtin_generation = builtin_generation;
+  }
+  if (search && !entry->builtin && entry->path_generation != path_generation) {
+    free(entry->path);
+    entry->path = SearchPath(name);
+    entry->path_generation = entry->path ? path_generation : 0;
+    entry->hits = 0;
+  }
+  entry->hits += search;
+  return entry;
+}
+
+/**
+ * @brief Searches the absolute directories of `PATH` for an executable.
+ *
+ * @return The path of the executable, to be freed by the caller, or NULL if
+ *         the name contains a slash or no absolute directory holds it.
+ */
+char *SearchPath(const char *name) {
+  const char *path = getenv("PATH");
+  if (!path || strchr(name, '/')) {
+    return NULL;
+  }
+
+  char candidate[kPathMax];
+  while (*path) {
+    size_t len = strcspn(path, ":");
+    struct stat st;
+    if (path[0] == '/' &&
+        snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)len, path,
+                 name) < (int)sizeof(candidate) &&
+        stat(candidate, &st) == 0 && S_ISREG(st.st_mode) &&
+        access(candidate, X_OK) == 0) {
+      return strdup(candidate);
+    }
+    if (path[0] != '/') {
+      return NULL;  // a relative or empty directory comes first
+    }
+    path += len + (path[len] == ':');
+  }
+  return NULL;
+}
+
+/**
+ * @brief Built-in `hash`: shows or clears the command cache.
+ *
+ * Usage: `hash` lists the commands resolved to a path, with the number of
+ * times each was looked up since; `hash -r` forgets every path.
+ *
+ * @return 0 on success, or 2 on a usage error.
+ */
+int BuiltinHash(int argc, char **argv, int status __attribute__((unused))) {
+  if (argc == 2 && strcmp(argv[1], "-r") == 0) {
+    path_generation++;
+    return 0;
+  }
+  if (argc != 1) {
+    fprintf(stderr, "usage: hash [-r]\n");
+    return 2;
+  }
+
+  printf("%-6s %s\n", "HITS", "COMMAND");
+  for (size_t i = 0; i < kCommandCacheSize; i++) {
+    const CommandCacheEntry *entry = &command_cache[i];
+    if (entry->path && entry->path_generation == path_generation) {
+      printf("%6u %s\n", entry->hits, entry->path);
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Calls a built-in with the standard streams of the process.
+ *
+ * @return The exit status of the built-in.
+ */
+int CallBuiltin(const Builtin *builtin, int argc, char **argv, int status) {
+  if (builtin->func) {
+    return builtin->func(argc, argv, status);
+  }
+
+  ShellBuiltinContext ctx = {&kShellApi, STDIN_FILENO, STDOUT_FILENO,
+                             STDERR_FILENO, status};
+  // The built-in writes to the descriptors directly
+  fflush(stdout);
+  fflush(stderr);
+  return builtin->stream_func(argc, argv, &ctx);
+}
+
+/**
+ * @brief Runs a built-in command inside the shell process.
+ *
+ * Redirections are applied to the shell's own standard streams for the
+ * duration of the built-in and restored afterwards.
+ *
+ * @param builtin Pointer to the built-in to run.
+ * @param da_args Pointer to the DynamicArray containing the tokenized command
+ *                line.
+ * @param status  The exit status of the last executed command.
+ *
+ * @return The exit status of the built-in.
+ */
+int RunBuiltin(const Builtin *builtin, DynamicArray *da_args, int status) {
+  Process *proc = InitProcess();
+  if (!proc) {
+    PrintError("failed to initialize process: %s\n", strerror(errno));
+    return 1;
+  }
+
+  PreopenRedirections(&da_args, 1);
+  if (StartStreamRedirections(&da_args, 1) < 0) {
+    PrintError("%s\n", strerror(errno));
+  }
+  int parsed = ParseCommand(proc, da_args);
+  ClosePreopened();
+  if (parsed < 0) {
+    CleanupRedirection(proc);
+    free(proc);
+    return 1;
+  }
+
+  int ret = CallBuiltin(builtin, (int)da_args->len, proc->args, status);
+
+  fflush(stdout);
+  fflush(stderr);
+  if (CleanupRedirection(proc) < 0) {
+    PrintError("failed to cleanup redirection: %s\n", strerror(errno));
+  }
+  free(proc);
+  return ret;
+}
+
+/**
+ * @brief Built-in `cd`: changes the current working directory.
+ *
+ * @return 0 on success, or 1 if the operand is missing or invalid.
+ */
+int BuiltinCd(int argc, char **argv, int status __attribute__((unused))) {
+  if (argc < 2) {
+    fprintf(stderr, "cd: missing operand\n");
+    return 1;
+  }
+
+  char *pathname = argv[1];
+  if (chdir(pathname) < 0) {
+    fprintf(stderr, "cd: %s: %s\n", strerror(errno), pathname);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Built-in `exit`: terminates the shell with the last exit status.
+ */
+int BuiltinExit(int argc __attribute__((unused)),
+                char **argv __attribute__((unused)), int status) {
+  exit(status);
+}
+
+/**
+ * @brief Built-in `set`: changes shell options.
+ *
+ * Usage: `set -o NAME` enables an option, `set +o NAME` disables it, and
+ * `set -o` with no name lists every option with its current state. Options
+ * that take a value are set with `set -o NAME=VALUE` and reset to their
+ * first value with `set +o NAME`.
+ *
+ * @return 0 on success, or 2 if the option or its value is unknown.
+ */
+int BuiltinSet(int argc, char **argv, int status __attribute__((unused))) {
+  if (argc == 1 || (argc == 2 && strcmp(argv[1], "-o") == 0)) {
+    for (int i = 0; i < kOptionCount; i++) {
+      const char *const *values = kOptionValues[i];
+      printf("%-12s %s\n", kOptionNames[i],
+             values ? values[shell_options[i]]
+                    : (shell_options[i] ? "on" : "off"));
+    }
+    return 0;
+  }
+
+  if (argc != 3 || (strcmp(argv[1], "-o") != 0 && strcmp(argv[1], "+o") != 0)) {
+    fprintf(stderr, "usage: set [-o|+o] [NAME[=VALUE]]\n");
+    return 2;
+  }
+
+  int enable = (argv[1][0] == '-');
+  char *value = strchr(argv[2], '=');
+  size_t len = value ? (size_t)(value++ - argv[2]) : strlen(argv[2]);
+  for (int i = 0; i < kOptionCount; i++) {
+    if (strlen(kOptionNames[i]) != len ||
+        strncmp(argv[2], kOptionNames[i], len) != 0) {
+      continue;
+    }
+
+    const char *const *values = kOptionValues[i];
+    if ((!values || !enable) && !value) {
+      shell_options[i] = enable;
+      snapshot_stale = 1;
+      return 0;
+    }
+    for (int v = 0; values && enable && value && values[v]; v++) {
+      if (strcmp(value, values[v]) == 0) {
+        shell_options[i] = v;
+        snapshot_stale = 1;
+        return 0;
+      }
+    }
+    fprintf(stderr, "set: %s: invalid value\n", argv[2]);
+    return 2;
+  }
+  fprintf(stderr, "set: %s: invalid option name\n", argv[2]);
+  return 2;
+}
+
+/**
+ * @brief Built-in `source` (also `.`): executes commands from a file.
+ *
+ * Each line of the file is executed as if it had been typed at the prompt.
+ * Lines starting with `#` are comments. When the `autopar` option is set,
+ * independent commands are run concurrently (see `ScheduleParallel()`).
+ * The file runs in a scope of its own, where `local` declares variables.
+ *
+ * @return The exit status of the last command executed from the file, or 1
+ *         if the file cannot be opened.
+ */
+int BuiltinSource(int argc, char **argv, int status) {
+  if (argc < 2) {
+    fprintf(stderr, "%s: missing file operand\n", argv[0]);
+    return 2;
+  }
+
+  FILE *fp = fopen(argv[1], "r");
+  if (!fp) {
+    fprintf(stderr, "%s: %s: %s\n", argv[0], argv[1], strerror(errno));
+    return 1;
+  }
+
+  Autopar ap = {0};
+  if (shell_options[kOptionAutopar] && InitAutopar(&ap) < 0) {
+    PrintError("%s\n", strerror(errno));
+    fclose(fp);
+    return 1;
+  }
+
+  ScopeNode *saved = PushScope();
+  CommandBuffer command = {NULL, 0, 0, kContinueNone};
+  char *line = NULL;
+  size_t linecap = 0;
+  while (getline(&line, &linecap, fp) >= 0) {
+    line[strcspn(line, "\n")] = '\0';
+
+    // Indentation after a backslash is part of the command
+    char *cmdline = command.pending == kContinueBackslash
+                        ? line
+                        : line + strspn(line, " \t");
+    if (command.pending != kContinueBackslash && *cmdline == '\0') {
+      continue;
+    }
+    if (command.pending != kContinueBackslash && *cmdline == '#') {
+      if (ap.in_flight && strncmp(cmdline, "#@", 2) == 0) {
+        ParseEffectAnnotation(&ap, cmdline + 2);
+      }
+      continue;
+    }
+
+    int complete = AppendCommandLine(&command, cmdline);
+    if (complete < 0) {
+      fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+      ResetCommandBuffer(&command);
+    }
+    if (complete > 0) {
+      status = ap.in_flight ? ScheduleParallel(&ap, command.text, status)
+                            : ExecuteCommandLine(command.text, status);
+      ResetCommandBuffer(&command);
+    }
+  }
+  if (command.pending == kContinuePipe) {
+    fprintf(stderr, "%s: %s: syntax error: unexpected end of file\n",
+            argv[0], argv[1]);
+    status = 2;
+  } else if (command.len > 0) {
+    status = ap.in_flight ? ScheduleParallel(&ap, command.text, status)
+                          : ExecuteCommandLine(command.text, status);
+  }
+  free(command.text);
+  free(line);
+  fclose(fp);
+
+  if (ap.in_flight) {
+    status = DrainParallel(&ap, status);
+    FreeAutopar(&ap);
+  }
+  PopScope(saved);
+  return status;
+}
+
+/**
+ * @brief Initializes the state used to overlap commands of a script.
+ *
+ * @return 0 on success, or -1 on allocation failure with errno set.
+ */
+int InitAutopar(Autopar *ap) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  ap->max_jobs = cpus > 2 ? (size_t)cpus : 2;
+  ap->in_flight = InitDynamicArray(kDefaultArraySize, sizeof(ParallelCommand));
+  ap->pending.reads = InitDynamicArray(kDefaultArraySize, sizeof(char *));
+  ap->pending.writes = InitDynamicArray(kDefaultArraySize, sizeof(char *));
+  ap->null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  if (!ap->in_flight || !ap->pending.reads || !ap->pending.writes ||
+      ap->null_fd < 0) {
+    FreeAutopar(ap);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Frees the state created by `InitAutopar()`.
+ */
+void FreeAutopar(Autopar *ap) {
+  FreeDynamicArray(ap->in_flight);
+  FreePathList(ap->pending.reads);
+  FreePathList(ap->pending.writes);
+  ap->in_flight = ap->pending.reads = ap->pending.writes = NULL;
+  if (ap->null_fd >= 0) {
+    close(ap->null_fd);
+  }
+  ap->null_fd = -1;
+}
+
+/**
+ * @brief Records a `#@ reads PATH...` or `#@ writes PATH...` annotation.
+ *
+ * Annotations accumulate until the next command, which then counts as having
+ * declared its effects. A bare `#@ writes` declares a command that writes no
+ * files at all.
+ *
+ * @param ap   Pointer to the scheduler state.
+ * @param text Text of the annotation following the `#@` marker.
+ */
+void ParseEffectAnnotation(Autopar *ap, char *text) {
+  char *saveptr;
+  char *kind = strtok_r(text, " \t", &saveptr);
+  DynamicArray *da_paths;
+  if (kind && strcmp(kind, "reads") == 0) {
+    da_paths = ap->pending.reads;
+  } else if (kind && strcmp(kind, "writes") == 0) {
+    da_paths = ap->pending.writes;
+  } else {
+    PrintError("unknown annotation: #@ %s\n", kind ? kind : "");
+    return;
+  }
+
+  ap->annotated = 1;
+  for (char *path = strtok_r(NULL, " \t", &saveptr); path;
+       path = strtok_r(NULL, " \t", &saveptr)) {
+    AppendPath(da_paths, path);
+  }
+}
+
+/**
+ * @brief Runs a script command, overlapping it with earlier ones if it is safe.
+ *
+ * A command is only started in the background when its write set is known:
+ * either it was annotated with `#@` effects, or it redirects its output, in
+ * which case the redirection targets and its non-option arguments are taken
+ * as its writes, since any of them may be a file it changes. Its reads are
+ * its input redirections, any annotated reads and, for annotated commands,
+ * its non-option arguments. Before it starts, every in-flight command whose
+ * effects conflict with it (write/write or read/write on the same path) is
+ * waited for.
+ *
+ * Built-ins, commands with undeclared effects and commands that use `$?` act
+ * as barriers: everything in flight is drained and the command runs in the
+ * foreground.
+ *
+ * Background commands read their standard input from /dev/null, and have
+ * their standard output and error captured in memory files, which are
+ * replayed strictly in script order, so the output looks the same as a
+ * sequential run.
+ *
+ * @param ap      Pointer to the scheduler state.
+ * @param cmdline The command line to run.
+ * @param status  Exit status of the last command that completed in order.
+ *
+ * @return The exit status of the last command that completed in order.
+ */
+int ScheduleParallel(Autopar *ap, char *cmdline, int status) {
+  FileEffects effects = {ap->pending.reads, ap->pending.writes};
+  int annotated = ap->annotated;
+
+  ap->annotated = 0;
+  ap->pending.reads = InitDynamicArray(kDefaultArraySize, sizeof(char *));
+  ap->pending.writes = InitDynamicArray(kDefaultArraySize, sizeof(char *));
+
+  char *copy = strdup(cmdline);
+  DynamicArray *da_args = copy ? TokenizeCommandLine(copy) : NULL;
+  if (!ap->pending.reads || !ap->pending.writes || !da_args) {
+    PrintError("%s\n", strerror(errno));
+    goto schedule_barrier;
+  }
+
+  if (da_args->len == 0 || !CollectFileEffects(da_args, &effects, annotated)) {
+    goto schedule_barrier;
+  }
+
+  // Wait for conflicting commands, for a free slot and, with the `admit`
+  // option, for the memory and capacity to run one more command
+  char **args = (char **)da_args->data;
+  for (;;) {
+    ParallelCommand *cmds = (ParallelCommand *)ap->in_flight->data;
+    size_t busy = 0;
+    int conflict = 0;
+    uint64_t committed = 0;
+    for (size_t i = 0; i < ap->in_flight->len; i++) {
+      if (cmds[i].done) {
+        continue;
+      }
+      busy++;
+      conflict |= EffectsConflict(&cmds[i].effects, &effects);
+      committed += PendingGrowth(cmds[i].pid, cmds[i].name);
+    }
+    if (!conflict && busy < ap->max_jobs &&
+        (busy == 0 || !shell_options[kOptionAdmit] ||
+         AdmitJob(EstimateMemory(args[0]),
+                  committed + JobsPendingGrowth()))) {
+      break;
+    }
+    if (WaitParallel(ap, &status) < 0) {
+      goto schedule_barrier;
+    }
+  }
+
+  ParallelCommand cmd = {0};
+  cmd.effects = effects;
+  cmd.name = strdup(args[0]);
+  cmd.out_fd = memfd_create("stdout", MFD_CLOEXEC);
+  cmd.err_fd = memfd_create("stderr", MFD_CLOEXEC);
+  if (!cmd.name || cmd.out_fd < 0 || cmd.err_fd < 0) {
+    PrintError("memfd_create failed: %s\n", strerror(errno));
+    CloseCapture(&cmd);
+    goto schedule_barrier;
+  }
+
+  SpawnAttributes attrs = kDefaultSpawnAttributes;
+  attrs.stdin_fd = ap->null_fd;
+  attrs.stdout_fd = cmd.out_fd;
+  attrs.stderr_fd = cmd.err_fd;
+  fflush(stdout);
+  fflush(stderr);
+  cmd.start = MonotonicSeconds();
+  if ((cmd.pid = LaunchProcess(da_args, status, &attrs)) < 0 ||
+      AppendElement(ap->in_flight, &cmd) < 0) {
+    PrintError("failed to start command: %s\n", strerror(errno));
+    if (cmd.pid > 0) {
+      waitpid(cmd.pid, NULL, 0);
+    }
+    CloseCapture(&cmd);
+    goto schedule_barrier;
+  }
+
+  FreeDynamicArray(da_args);
+  free(copy);
+  return status;
+
+schedule_barrier:
+  FreeDynamicArray(da_args);
+  free(copy);
+  FreePathList(effects.reads);
+  FreePathList(effects.writes);
+  status = DrainParallel(ap, status);
+  return ExecuteCommandLine(cmdline, status);
+}
+
+/**
+ * @brief Derives the file effects of a command from its redirections and
+ *        arguments.
+ *
+ * @param da_args   Pointer to the DynamicArray containing the tokenized
+ *                  command line.
+ * @param effects   Pointer to the effects to extend.
+ * @param annotated Whether the command's effects were declared explicitly.
+ *
+ * @return 1 if the command may run concurrently, or 0 if it must act as a
+ *         barrier.
+ */
+int CollectFileEffects(DynamicArray *da_args, FileEffects *effects,
+                       int annotated) {
+  char **args = (char **)da_args->data;
+  int redirects_output = 0;
+
+  if (FindBuiltin(args[0]) || strchr(args[0], '$')) {
+    return 0;
+  }
+
+  for (size_t i = 1; i < da_args->len; i++) {
+    if (strchr(args[i], '$') || args[i] == kWordPipe ||
+        args[i] == kWordBackground) {
+      return 0;
+    }
+
+    RedirectType rtype = GetRedirectType(args[i]);
+    if (rtype == kNone) {
+      // Without an annotation, an operand may as well be written
+      if (args[i][0] != '-') {
+        AppendPath(annotated ? effects->reads : effects->writes, args[i]);
+      }
+      continue;
+    }
+
+    if (i + 1 >= da_args->len) {
+      return 0;  // Let the sequential path report the error
+    }
+    if (rtype == kRedirectIn) {
+      AppendPath(effects->reads, args[++i]);
+    } else {
+      AppendPath(effects->writes, args[++i]);
+      redirects_output = 1;
+    }
+  }
+
+  return annotated || redirects_output;
+}
+
+/**
+ * @brief Checks whether two commands touch the same file with at least one
+ *        of them writing it.
+ *
+ * @return 1 if the commands conflict, 0 otherwise.
+ */
+int EffectsConflict(const FileEffects *a, const FileEffects *b) {
+  return PathListsIntersect(a->writes, b->writes) ||
+         PathListsIntersect(a->writes, b->reads) ||
+         PathListsIntersect(a->reads, b->writes);
+}
+
+/**
+ * @brief Checks whether two lists of normalized paths share an entry.
+ */
+int PathListsIntersect(DynamicArray *da_a, DynamicArray *da_b) {
+  char **a = (char **)da_a->data;
+  char **b = (char **)da_b->data;
+  for (size_t i = 0; i < da_a->len; i++) {
+    for (size_t j = 0; j < da_b->len; j++) {
+      if (strcmp(a[i], b[j]) == 0) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Waits for one in-flight command and retires every command that has
+ *        now completed in script order.
+ *
+ * @param ap     Pointer to the scheduler state.
+ * @param status Pointer to the exit status of the last retired command,
+ *               updated as commands retire.
+ *
+ * @return 0 on success, or -1 if there was nothing to wait for or waiting
+ *         failed.
+ */
+int WaitParallel(Autopar *ap, int *status) {
+  int wstatus;
+  struct rusage ru;
+  pid_t pid = wait4(-1, &wstatus, 0, &ru);
+  if (pid < 0) {
+    return -1;
+  }
+
+  ParallelCommand *cmds = (ParallelCommand *)ap->in_flight->data;
+  size_t i = 0;
+  while (i < ap->in_flight->len && !(!cmds[i].done && cmds[i].pid == pid)) {
+    i++;
+  }
+  if (i < ap->in_flight->len) {
+    cmds[i].done = 1;
+    cmds[i].status = DecodeWaitStatus(wstatus);
+    RecordStageStats(cmds[i].name, cmds[i].start, &ru);
+  } else {
+    NoteJobExit(pid, wstatus, &ru);  // A background job finished meanwhile
+  }
+
+  // Retire the completed prefix, replaying output in script order
+  size_t retired = 0;
+  while (retired < ap->in_flight->len && cmds[retired].done) {
+    ParallelCommand *cmd = &cmds[retired++];
+    fflush(stdout);
+    fflush(stderr);
+    CopyFd(cmd->out_fd, STDOUT_FILENO);
+    CopyFd(cmd->err_fd, STDERR_FILENO);
+    CloseCapture(cmd);
+    FreePathList(cmd->effects.reads);
+    FreePathList(cmd->effects.writes);
+    *status = cmd->status;
+  }
+  memmove(cmds, cmds + retired,
+          (ap->in_flight->len - retired) * sizeof(ParallelCommand));
+  ap->in_flight->len -= retired;
+
+  return 0;
+}
+
+/**
+ * @brief Waits for every in-flight command and replays its output.
+ *
+ * @return The exit status of the last retired command.
+ */
+int DrainParallel(Autopar *ap, int status) {
+  while (ap->in_flight->len > 0) {
+    if (WaitParallel(ap, &status) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      PrintError("wait failed: %s\n", strerror(errno));
+      break;
+    }
+  }
+  return status;
+}
+
+/**
+ * @brief Closes the output capture files of a command and releases its
+ *        name.
+ */
+void CloseCapture(ParallelCommand *cmd) {
+  free(cmd->name);
+  cmd->name = NULL;
+  if (cmd->out_fd >= 0) {
+    close(cmd->out_fd);
+  }
+  if (cmd->err_fd >= 0) {
+    close(cmd->err_fd);
+  }
+  cmd->out_fd = cmd->err_fd = -1;
+}
+
+/**
+ * @brief Copies the whole content of a file to another file descriptor.
+ *
+ * Reading starts at the beginning of `from` regardless of its offset.
+ *
+ * @return 0 on success, or -1 on error with errno set accordingly.
+ */
+int CopyFd(int from, int to) {
+  char buf[BUFSIZ];
+  ssize_t nread;
+
+  if (lseek(from, 0, SEEK_SET) < 0) {
+    return -1;
+  }
+  while ((nread = read(from, buf, sizeof(buf))) != 0) {
+    if (nread < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    for (ssize_t off = 0; off < nread;) {
+      ssize_t nwritten = write(to, buf + off, nread - off);
+      if (nwritten < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return -1;
+      }
+      off += nwritten;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Appends the normalized form of a path to a list of paths.
+ *
+ * @return 0 on success, or -1 on allocation failure with errno set.
+ */
+int AppendPath(DynamicArray *da_paths, const char *path) {
+  char *normalized = NormalizePath(path);
+  if (!normalized) {
+    return -1;
+  }
+  if (AppendElement(da_paths, &normalized) < 0) {
+    free(normalized);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Frees a DynamicArray of heap-allocated strings.
+ */
+void FreePathList(DynamicArray *da_paths) {
+  if (!da_paths) {
+    return;
+  }
+  char **paths = (char **)da_paths->data;
+  for (size_t i = 0; i < da_paths->len; i++) {
+    free(paths[i]);
+  }
+  FreeDynamicArray(da_paths);
+}
+
+/**
+ * @brief Makes a path absolute and removes `.`, `..` and repeated slashes.
+ *
+ * The normalization is purely lexical: symbolic links are not resolved and
+ * the path does not need to exist.
+ *
+ * @param path The path to normalize, relative to the current directory.
+ *
+ * @return A newly allocated normalized path, or NULL on error with errno set.
+ */
+char *NormalizePath(const char *path) {
+  char cwd[kPathMax];
+  if (path[0] != '/' && !getcwd(cwd, sizeof(cwd))) {
+    return NULL;
+  }
+
+  size_t cap = strlen(path) + (path[0] == '/' ? 0 : strlen(cwd)) + 3;
+  char *joined = malloc(cap);
+  char *out = malloc(cap);
+  if (!joined || !out) {
+    free(joined);
+    free(out);
+    return NULL;
+  }
+  snprintf(joined, cap, "%s/%s", path[0] == '/' ? "" : cwd, path);
+
+  size_t len = 0;
+  char *saveptr;
+  for (char *comp = strtok_r(joined, "/", &saveptr); comp;
+       comp = strtok_r(NULL, "/", &saveptr)) {
+    if (strcmp(comp, ".") == 0) {
+      continue;
+    }
+    if (strcmp(comp, "..") == 0) {
+      while (len > 0 && out[--len] != '/') {
+      }
+      continue;
+    }
+    out[len++] = '/';
+    strcpy(out + len, comp);
+    len += strlen(comp);
+  }
+  if (len == 0) {
+    out[len++] = '/';
+  }
+  out[len] = '\0';
+
+  free(joined);
+  return out;
+}
+
+/**
+ * @brief Built-in `memo`: caches the output of deterministic commands.
+ *
+ * Usage: `memo [--env NAME]... [--inputs FILE... --] command [args...]`.
+ *
+ * The command is identified by its arguments, the current directory, the
+ * values of the environment variables selected with `--env` and the content
+ * of the files listed after `--inputs`. If the same command was run before,
+ * its standard output, standard error and exit status are replayed from the
+ * cache without running it. Otherwise the command runs with its output
+ * captured, and the result is added to the cache.
+ *
+ * Input files are hashed by content, but the hash is reused as long as the
+ * file's size, modification time and inode are unchanged. Once the cache
+ * exceeds `kMemoMaxBytes`, the least recently used entries are evicted. The
+ * cache lives in `$XDG_CACHE_HOME/shell-memo` (or `~/.cache/shell-memo`).
+ *
+ * @return The exit status of the command, or 125 if memo itself failed.
+ */
+int BuiltinMemo(int argc, char **argv, int status) {
+  uint64_t key = kFnvOffsetBasis;
+  DynamicArray *da_inputs = InitDynamicArray(kDefaultArraySize, sizeof(char *));
+  DynamicArray *da_env = InitDynamicArray(kDefaultArraySize, sizeof(char *));
+  DynamicArray *da_index = InitDynamicArray(kDefaultArraySize,
+                                            sizeof(MemoIndexEntry));
+  DynamicArray *da_args = NULL;
+  char store[kPathMax], entry[kPathMax], cwd[kPathMax];
+  int ret = 125;
+
+  if (!da_inputs || !da_env || !da_index) {
+    PrintError("%s\n", strerror(errno));
+    goto memo_done;
+  }
+
+  int i = 1;
+  for (; i < argc; i++) {
+    if (strcmp(argv[i], "--env") == 0 && i + 1 < argc) {
+      AppendElement(da_env, &argv[++i]);
+    } else if (strcmp(argv[i], "--inputs") == 0) {
+      while (++i < argc && strcmp(argv[i], "--") != 0) {
+        AppendElement(da_inputs, &argv[i]);
+      }
+    } else {
+      break;
+    }
+  }
+  if (i >= argc) {
+    fprintf(stderr,
+            "usage: memo [--env NAME]... [--inputs FILE... --] command...\n");
+    goto memo_done;
+  }
+
+  if (GetMemoStore(store, sizeof(store)) < 0 || !getcwd(cwd, sizeof(cwd))) {
+    fprintf(stderr, "memo: cannot access cache: %s\n", strerror(errno));
+    goto memo_done;
+  }
+  LoadMemoIndex(store, da_index);
+
+  // Key: arguments, working directory, environment and input contents
+  for (int j = i; j < argc; j++) {
+    key = HashBytes(key, argv[j], strlen(argv[j]) + 1);
+  }
+  key = HashBytes(key, cwd, strlen(cwd) + 1);
+  char **env = (char **)da_env->data;
+  for (size_t j = 0; j < da_env->len; j++) {
+    // An unset variable contributes its name only, unlike an empty one
+    const char *value = getenv(env[j]);
+    key = HashBytes(key, env[j], strlen(env[j]) + 1);
+    if (value) {
+      key = HashBytes(key, value, strlen(value) + 1);
+    }
+  }
+  char **inputs = (char **)da_inputs->data;
+  int index_dirty = 0;
+  for (size_t j = 0; j < da_inputs->len; j++) {
+    uint64_t content;
+    int ret_hash = HashInputFile(da_index, inputs[j], &content);
+    if (ret_hash < 0) {
+      fprintf(stderr, "memo: %s: %s\n", inputs[j], strerror(errno));
+      goto memo_done;
+    }
+    index_dirty |= ret_hash;
+    key = HashBytes(key, inputs[j], strlen(inputs[j]) + 1);
+    key = HashBytes(key, &content, sizeof(content));
+  }
+  if (index_dirty) {
+    SaveMemoIndex(store, da_index);
+  }
+
+  snprintf(entry, sizeof(entry), "%s/%016llx", store, (unsigned long long)key);
+  if ((ret = ReplayMemoEntry(entry)) >= 0) {
+    // Mark the entry as recently used
+    utimensat(AT_FDCWD, entry, NULL, 0);
+    goto memo_done;
+  }
+
+  da_args = InitDynamicArray(argc - i + 1, sizeof(char *));
+  if (!da_args) {
+    PrintError("%s\n", strerror(errno));
+    ret = 125;
+    goto memo_done;
+  }
+  for (int j = i; j < argc; j++) {
+    AppendElement(da_args, &argv[j]);
+  }
+  ret = RecordMemoEntry(store, entry, da_args, status);
+  EvictMemoEntries(store, kMemoMaxBytes);
+
+memo_done:
+  FreeDynamicArray(da_args);
+  FreeDynamicArray(da_inputs);
+  FreeDynamicArray(da_env);
+  FreeMemoIndex(da_index);
+  return ret;
+}
+
+/**
+ * @brief Resolves the cache directory, creating it if needed.
+ *
+ * @return 0 on success, or -1 on error with errno set accordingly.
+ */
+int GetMemoStore(char *buf, size_t size) {
+  if (GetCachePath("shell-memo", buf, size) < 0) {
+    return -1;
+  }
+  if (mkdir(buf, 0755) < 0 && errno != EEXIST) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Runs a command with its output captured into a new cache entry.
+ *
+ * The entry is assembled in a temporary directory and renamed into place
+ * once complete, so concurrent shells never observe partial entries. The
+ * captured output is then replayed to the shell's own streams.
+ *
+ * @return The exit status of the command, or 125 if it could not be run.
+ */
+int RecordMemoEntry(const char *store, const char *entry,
+                    DynamicArray *da_args, int status) {
+  char tmp[kPathMax], path[kPathMax];
+  int ret = 125;
+
+  // A unique name, as other runs may be staging into the same store
+  snprintf(tmp, sizeof(tmp), "%s/.tmp.XXXXXX", store);
+  if (!mkdtemp(tmp)) {
+    fprintf(stderr, "memo: %s: %s\n", tmp, strerror(errno));
+    return 125;
+  }
+  if (chmod(tmp, 0755) < 0) {
+    fprintf(stderr, "memo: %s: %s\n", tmp, strerror(errno));
+    rmdir(tmp);
+    return 125;
+  }
+
+  snprintf(path, sizeof(path), "%s/stdout", tmp);
+  int out_fd = open(path, O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC, 0644);
+  snprintf(path, sizeof(path), "%s/stderr", tmp);
+  int err_fd = open(path, O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC, 0644);
+  if (out_fd < 0 || err_fd < 0) {
+    fprintf(stderr, "memo: %s: %s\n", path, strerror(errno));
+    goto record_done;
+  }
+
+  SpawnAttributes attrs = kDefaultSpawnAttributes;
+  attrs.stdout_fd = out_fd;
+  attrs.stderr_fd = err_fd;
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = LaunchProcess(da_args, status, &attrs);
+  int wstatus;
+  if (pid < 0 || waitpid(pid, &wstatus, 0) < 0) {
+    PrintError("failed to run command: %s\n", strerror(errno));
+    goto record_done;
+  }
+  ret = DecodeWaitStatus(wstatus);
+
+  CopyFd(out_fd, STDOUT_FILENO);
+  CopyFd(err_fd, STDERR_FILENO);
+
+  // Commands killed by a signal are not worth remembering
+  if (WIFEXITED(wstatus)) {
+    snprintf(path, sizeof(path), "%s/status", tmp);
+    FILE *fp = fopen(path, "w");
+    if (fp) {
+      fprintf(fp, "%d\n", ret);
+      if (fclose(fp) == 0 && rename(tmp, entry) == 0) {
+        tmp[0] = '\0';
+      }
+    }
+  }
+
+record_done:
+  if (out_fd >= 0) {
+    close(out_fd);
+  }
+  if (err_fd >= 0) {
+    close(err_fd);
+  }
+  if (tmp[0]) {
+    RemoveMemoEntry(tmp);
+  }
+  return ret;
+}
+
+/**
+ * @brief Replays the output and exit status stored in a cache entry.
+ *
+ * @return The recorded exit status, or -1 if the entry does not exist.
+ */
+int ReplayMemoEntry(const char *entry) {
+  char path[kPathMax];
+  int status;
+
+  snprintf(path, sizeof(path), "%s/status", entry);
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    return -1;
+  }
+  int matched = fscanf(fp, "%d", &status);
+  fclose(fp);
+  if (matched != 1) {
+    return -1;
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+  const char *streams[] = {"stdout", "stderr"};
+  for (int i = 0; i < 2; i++) {
+    snprintf(path, sizeof(path), "%s/%s", entry, streams[i]);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return -1;
+    }
+    CopyFd(fd, i == 0 ? STDOUT_FILENO : STDERR_FILENO);
+    close(fd);
+  }
+  return status;
+}
+
+/**
+ * @brief Removes a cache entry directory and the files inside it.
+ */
+void RemoveMemoEntry(const char *entry) {
+  const char *files[] = {"stdout", "stderr", "status"};
+  char path[kPathMax];
+  for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+    snprintf(path, sizeof(path), "%s/%s", entry, files[i]);
+    unlink(path);
+  }
+  rmdir(entry);
+}
+
+/**
+ * @brief Evicts least recently used entries until the cache fits its budget.
+ *
+ * Entries are ordered by the modification time of their directory, which is
+ * refreshed on every hit.
+ */
+void EvictMemoEntries(const char *store, off_t max_bytes) {
+  DIR *dir = opendir(store);
+  if (!dir) {
+    return;
+  }
+
+  DynamicArray *da_entries = InitDynamicArray(kDefaultArraySize,
+                                              sizeof(MemoEntry));
+  off_t total = 0;
+  struct dirent *de;
+  while (da_entries && (de = readdir(dir))) {
+    if (de->d_name[0] == '.' || strlen(de->d_name) != 16) {
+      continue;
+    }
+
+    MemoEntry e = {0};
+    char path[kPathMax];
+    memcpy(e.name, de->d_name, sizeof(e.name));  // 16 digits and NUL
+    snprintf(path, sizeof(path), "%s/%s", store, e.name);
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+      continue;
+    }
+    e.used = st.st_mtim;
+
+    const char *files[] = {"stdout", "stderr", "status"};
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+      snprintf(path, sizeof(path), "%s/%s/%s", store, e.name, files[i]);
+      if (stat(path, &st) == 0) {
+        e.size += st.st_size;
+      }
+    }
+    total += e.size;
+    AppendElement(da_entries, &e);
+  }
+  closedir(dir);
+  if (!da_entries) {
+    return;
+  }
+
+  MemoEntry *entries = (MemoEntry *)da_entries->data;
+  qsort(entries, da_entries->len, sizeof(MemoEntry), CompareMemoEntries);
+  for (size_t i = 0; i < da_entries->len && total > max_bytes; i++) {
+    char path[kPathMax];
+    snprintf(path, sizeof(path), "%s/%s", store, entries[i].name);
+    RemoveMemoEntry(path);
+    total -= entries[i].size;
+  }
+  FreeDynamicArray(da_entries);
+}
+
+/**
+ * @brief Orders cache entries from least to most recently used.
+ */
+int CompareMemoEntries(const void *a, const void *b) {
+  const struct timespec *ta = &((const MemoEntry *)a)->used;
+  const struct timespec *tb = &((const MemoEntry *)b)->used;
+  if (ta->tv_sec != tb->tv_sec) {
+    return ta->tv_sec < tb->tv_sec ? -1 : 1;
+  }
+  if (ta->tv_nsec != tb->tv_nsec) {
+    return ta->tv_nsec < tb->tv_nsec ? -1 : 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Hashes the content of an input file, reusing earlier results.
+ *
+ * If the index has an entry for the file with the same inode, size and
+ * modification time, its hash is reused without reading the file. Files
+ * modified within the last second are always rehashed and never indexed,
+ * since another write could follow without changing the timestamp.
+ *
+ * @param da_index Pointer to the DynamicArray of MemoIndexEntry.
+ * @param path     Path of the input file.
+ * @param hash     Where to store the content hash.
+ *
+ * @return 1 if the index was updated, 0 if it was not, or -1 on error with
+ *         errno set accordingly.
+ */
+int HashInputFile(DynamicArray *da_index, const char *path, uint64_t *hash) {
+  struct stat st;
+  char *abspath = NormalizePath(path);
+  if (!abspath || stat(path, &st) < 0) {
+    free(abspath);
+    return -1;
+  }
+
+  MemoIndexEntry *index = (MemoIndexEntry *)da_index->data;
+  MemoIndexEntry *cached = NULL;
+  for (size_t i = 0; i < da_index->len; i++) {
+    if (strcmp(index[i].path, abspath) == 0) {
+      cached = &index[i];
+      break;
+    }
+  }
+  if (cached && cached->ino == st.st_ino && cached->size == st.st_size &&
+      cached->mtime.tv_sec == st.st_mtim.tv_sec &&
+      cached->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+    *hash = cached->hash;
+    free(abspath);
+    return 0;
+  }
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    free(abspath);
+    return -1;
+  }
+  char buf[BUFSIZ];
+  ssize_t nread;
+  *hash = kFnvOffsetBasis;
+  while ((nread = read(fd, buf, sizeof(buf))) > 0) {
+    *hash = HashBytes(*hash, buf, nread);
+  }
+  close(fd);
+  if (nread < 0 || time(NULL) - st.st_mtim.tv_sec < 1) {
+    free(abspath);
+    return nread < 0 ? -1 : 0;
+  }
+
+  if (!cached) {
+    MemoIndexEntry e = {.path = abspath};
+    if (AppendElement(da_index, &e) < 0) {
+      free(abspath);
+      return 0;
+    }
+    abspath = NULL;
+    cached = &((MemoIndexEntry *)da_index->data)[da_index->len - 1];
+  }
+  cached->ino = st.st_ino;
+  cached->size = st.st_size;
+  cached->mtime = st.st_mtim;
+  cached->hash = *hash;
+  free(abspath);
+  return 1;
+}
+
+/**
+ * @brief Loads the input file index of the cache.
+ *
+ * Each line of the index holds the hash, inode, size, modification time and
+ * normalized absolute path of one input file.
+ */
+void LoadMemoIndex(const char *store, DynamicArray *da_index) {
+  char path[kPathMax];
+  snprintf(path, sizeof(path), "%s/index", store);
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    return;
+  }
+
+  char *line = NULL;
+  size_t linecap = 0;
+  while (getline(&line, &linecap, fp) >= 0) {
+    MemoIndexEntry e = {0};
+    unsigned long long hash, ino;
+    long long size, sec;
+    long nsec;
+    int offset;
+    line[strcspn(line, "\n")] = '\0';
+    if (sscanf(line, "%llx %llu %lld %lld %ld %n", &hash, &ino, &size, &sec,
+               &nsec, &offset) != 5) {
+      continue;
+    }
+    e.hash = hash;
+    e.ino = ino;
+    e.size = size;
+    e.mtime.tv_sec = sec;
+    e.mtime.tv_nsec = nsec;
+    if (!(e.path = strdup(line + offset)) ||
+        AppendElement(da_index, &e) < 0) {
+      free(e.path);
+      break;
+    }
+  }
+  free(line);
+  fclose(fp);
+}
+
+/**
+ * @brief Atomically rewrites the input file index of the cache.
+ */
+void SaveMemoIndex(const char *store, DynamicArray *da_index) {
+  char path[kPathMax], tmp[kPathMax];
+  snprintf(path, sizeof(path), "%s/index", store);
+  snprintf(tmp, sizeof(tmp), "%s/.index.%d", store, (int)getpid());
+
+  FILE *fp = fopen(tmp, "w");
+  if (!fp) {
+    return;
+  }
+  MemoIndexEntry *index = (MemoIndexEntry *)da_index->data;
+  for (size_t i = 0; i < da_index->len; i++) {
+    fprintf(fp, "%016llx %llu %lld %lld %ld %s\n",
+            (unsigned long long)index[i].hash,
+            (unsigned long long)index[i].ino, (long long)index[i].size,
+            (long long)index[i].mtime.tv_sec, (long)index[i].mtime.tv_nsec,
+            index[i].path);
+  }
+  if (fclose(fp) != 0 || rename(tmp, path) < 0) {
+    unlink(tmp);
+  }
+}
+
+/**
+ * @brief Frees a DynamicArray of MemoIndexEntry.
+ */
+void FreeMemoIndex(DynamicArray *da_index) {
+  if (!da_index) {
+    return;
+  }
+  MemoIndexEntry *index = (MemoIndexEntry *)da_index->data;
+  for (size_t i = 0; i < da_index->len; i++) {
+    free(index[i].path);
+  }
+  FreeDynamicArray(da_index);
+}
+
+/**
+ * @brief Folds a block of bytes into a 64-bit FNV-1a hash.
+ *
+ * @param hash The hash so far, `kFnvOffsetBasis` for a new hash.
+ * @param data Pointer to the bytes to hash.
+ * @param len  Number of bytes to hash.
+ *
+ * @return The updated hash.
+ */
+uint64_t HashBytes(uint64_t hash, const void *data, size_t len) {
+  const unsigned char *p = data;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= kFnvPrime;
+  }
+  return hash;
+}
+
+/**
+ * @brief Built-in `stats`: reports run time percentiles of past commands.
+ *
+ * Usage: `stats [-c] [COMMAND]`. Shows how many times each command (or only
+ * COMMAND) ran, together with the 50th, 90th and 99th percentile and the
+ * maximum of its wall-clock time, or of its CPU time with `-c`, and the
+ * memory estimate used for admission control.
+ *
+ * @return 0 on success, or 1 if no statistics are available.
+ */
+int BuiltinStats(int argc, char **argv, int status __attribute__((unused))) {
+  int cpu = 0;
+  const char *name = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-c") == 0) {
+      cpu = 1;
+    } else {
+      name = argv[i];
+    }
+  }
+
+  StatsFile *sf = OpenStatsFile();
+  if (!sf) {
+    fprintf(stderr, "stats: no statistics available\n");
+    return 1;
+  }
+
+  int found = 0;
+  for (size_t i = 0; i < kStatsSlots; i++) {
+    CommandStats *cs = &sf->slots[i];
+    if (__atomic_load_n(&cs->state, __ATOMIC_ACQUIRE) != kStatsSlotReady ||
+        (name && strcmp(cs->name, name) != 0)) {
+      continue;
+    }
+    if (!found++) {
+      printf("%-24s %8s %9s %9s %9s %9s %9s\n",
+             cpu ? "COMMAND (CPU)" : "COMMAND", "COUNT", "P50", "P90", "P99",
+             "MAX", "RSS");
+    }
+
+    // Percentiles are bucket upper bounds, which may exceed the maximum
+    const uint32_t *hist = cpu ? cs->cpu_hist : cs->wall_hist;
+    uint64_t max = cpu ? cs->cpu_max : cs->wall_max;
+    double percentiles[] = {50.0, 90.0, 99.0};
+    char cols[4][16];
+    for (size_t p = 0; p < 3; p++) {
+      uint64_t value = HistogramPercentile(hist, percentiles[p]);
+      FormatMicroseconds(cols[p], sizeof(cols[p]), value < max ? value : max);
+    }
+    FormatMicroseconds(cols[3], sizeof(cols[3]), max);
+    printf("%-24s %8u %9s %9s %9s %9s %8lluM\n", cs->name, cs->count,
+           cols[0], cols[1], cols[2], cols[3],
+           (unsigned long long)(cs->rss_kb + 1023) / 1024);
+  }
+
+  if (name && !found) {
+    fprintf(stderr, "stats: %s: no statistics recorded\n", name);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Maps the command statistics file into memory.
+ *
+ * The file lives in the cache directory and is shared by every shell of the
+ * user, which update it in place. It is created on first use, under a lock
+ * on the file, and mapped once per shell.
+ *
+ * @return A pointer to the mapped file, or NULL if it cannot be opened.
+ */
+StatsFile *OpenStatsFile(void) {
+  static StatsFile *sf;
+  if (sf) {
+    return sf;
+  }
+
+  char path[kPathMax];
+  if (GetCachePath("shell-stats", path, sizeof(path)) < 0) {
+    return NULL;
+  }
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  // Shells setting up the file at the same time take turns, so that none
+  // clears slots another has claimed already
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (flock(fd, LOCK_EX) == 0 && fstat(fd, &st) == 0 &&
+      (st.st_size == sizeof(StatsFile) ||
+       (ftruncate(fd, 0) == 0 && ftruncate(fd, sizeof(StatsFile)) == 0))) {
+    map = mmap(NULL, sizeof(StatsFile), PROT_READ | PROT_WRITE, MAP_SHARED,
+               fd, 0);
+  }
+  if (map != MAP_FAILED && ((StatsFile *)map)->magic != kStatsMagic) {
+    memset(map, 0, sizeof(StatsFile));
+    ((StatsFile *)map)->magic = kStatsMagic;
+  }
+  close(fd);  // releases the lock
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+
+  sf = map;
+  return sf;
+}
+
+/**
+ * @brief Records the run time and memory use of a finished command.
+ *
+ * @param cmd     Name or path of the command, as typed.
+ * @param wall_us Wall-clock time, in microseconds.
+ * @param cpu_us  User plus system CPU time, in microseconds.
+ * @param rss_kb  Maximum resident set size, in kilobytes.
+ *
+ * @return 1 if the run was slower than 99% of the earlier runs of the same
+ *         command, 0 otherwise.
+ */
+int RecordCommandStats(const char *cmd, uint64_t wall_us, uint64_t cpu_us,
+                       uint64_t rss_kb) {
+  StatsFile *sf = OpenStatsFile();
+  CommandStats *cs = sf ? LookupCommandStats(sf, cmd, 1) : NULL;
+  if (!cs) {
+    return 0;
+  }
+
+  int outlier = cs->count >= kStatsOutlierMinRuns &&
+                wall_us > HistogramPercentile(cs->wall_hist, 99.0);
+
+  __atomic_fetch_add(&cs->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&cs->wall_hist[HistogramBucket(wall_us)], 1,
+                     __ATOMIC_RELAXED);
+  __atomic_fetch_add(&cs->cpu_hist[HistogramBucket(cpu_us)], 1,
+                     __ATOMIC_RELAXED);
+  AtomicMax(&cs->wall_max, wall_us);
+  AtomicMax(&cs->cpu_max, cpu_us);
+
+  // Peak memory decays by 1/8 per run, so estimates follow shrinking inputs
+  uint64_t old = __atomic_load_n(&cs->rss_kb, __ATOMIC_RELAXED);
+  uint64_t decayed;
+  do {
+    decayed = old - old / 8;
+    decayed = rss_kb > decayed ? rss_kb : decayed;
+  } while (!__atomic_compare_exchange_n(&cs->rss_kb, &old, decayed, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return outlier;
+}
+
+/**
+ * @brief Raises a value shared with other processes to at least `value`.
+ */
+void AtomicMax(uint64_t *target, uint64_t value) {
+  uint64_t old = __atomic_load_n(target, __ATOMIC_RELAXED);
+  while (value > old &&
+         !__atomic_compare_exchange_n(target, &old, value, 1, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+  }
+}
+
+/**
+ * @brief Finds the statistics slot of a command.
+ *
+ * @param sf     Pointer to the mapped statistics file.
+ * @param cmd    Name or path of the command, as typed.
+ * @param create Whether to claim a free slot if the command has none yet.
+ *
+ * @return A pointer to the slot, or NULL if there is none.
+ */
+CommandStats *LookupCommandStats(StatsFile *sf, const char *cmd, int create) {
+  const char *name = strrchr(cmd, '/') ? strrchr(cmd, '/') + 1 : cmd;
+  if (*name == '\0' || strlen(name) >= sizeof(sf->slots[0].name)) {
+    return NULL;
+  }
+
+  // Open addressing with linear probing; a full table drops new commands.
+  // Other shells may claim slots concurrently: a free slot is taken with a
+  // compare-and-swap, and its name is published once written.
+  size_t start = HashBytes(kFnvOffsetBasis, name, strlen(name)) % kStatsSlots;
+  for (size_t i = 0; i < kStatsSlots; i++) {
+    CommandStats *slot = &sf->slots[(start + i) % kStatsSlots];
+    uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    if (state == kStatsSlotFree) {
+      if (!create) {
+        return NULL;
+      }
+      if (__atomic_compare_exchange_n(&slot->state, &state, kStatsSlotClaimed,
+                                      0, __ATOMIC_ACQUIRE,
+                                      __ATOMIC_ACQUIRE)) {
+        strcpy(slot->name, name);
+        __atomic_store_n(&slot->state, kStatsSlotReady, __ATOMIC_RELEASE);
+        return slot;
+      }
+    }
+
+    // A slot being claimed is skipped if its owner takes too long, as when
+    // it died halfway; at worst the command then gets a second slot
+    for (int spins = 0; state == kStatsSlotClaimed && spins < kStatsClaimSpins;
+         spins++) {
+      sched_yield();
+      state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    }
+    if (state == kStatsSlotReady && strcmp(slot->name, name) == 0) {
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Maps a value to its bucket of a log-linear (HDR) histogram.
+ *
+ * Values below `kHistSubBuckets` get a bucket each. Above that, every power
+ * of two is split into `kHistSubBuckets` equal buckets, which bounds the
+ * relative error of any reported value to 1/`kHistSubBuckets`.
+ *
+ * @param value The value to record, in microseconds.
+ *
+ * @return The index of the bucket holding `value`.
+ */
+size_t HistogramBucket(uint64_t value) {
+  if (value < kHistSubBuckets) {
+    return value;
+  }
+
+  // Position of the highest set bit, at least log2(kHistSubBuckets)
+  size_t msb = 63 - __builtin_clzll(value);
+  size_t shift = msb - kHistSubBucketBits;
+  size_t index = kHistSubBuckets * (shift + 1) +
+                 ((value >> shift) - kHistSubBuckets);
+  return index < kHistBuckets ? index : kHistBuckets - 1;
+}
+
+/**
+ * @brief Returns the highest value that falls into a histogram bucket.
+ */
+uint64_t HistogramBucketValue(size_t index) {
+  if (index < kHistSubBuckets) {
+    return index;
+  }
+  size_t shift = index / kHistSubBuckets - 1;
+  uint64_t sub = index % kHistSubBuckets + kHistSubBuckets;
+  return ((sub + 1) << shift) - 1;
+}
+
+/**
+ * @brief Computes a percentile of the values recorded in a histogram.
+ *
+ * @param hist       The histogram buckets.
+ * @param percentile The percentile to compute, between 0 and 100.
+ *
+ * @return The highest value of the bucket holding the percentile, or 0 if
+ *         the histogram is empty.
+ */
+uint64_t HistogramPercentile(const uint32_t *hist, double percentile) {
+  uint64_t total = 0;
+  for (size_t i = 0; i < kHistBuckets; i++) {
+    total += hist[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+
+  uint64_t rank = (uint64_t)(percentile / 100.0 * (double)total + 0.5);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kHistBuckets; i++) {
+    seen += hist[i];
+    if (seen >= rank && seen > 0) {
+      return HistogramBucketValue(i);
+    }
+  }
+  return HistogramBucketValue(kHistBuckets - 1);
+}
+
+/**
+ * @brief Formats a duration given in microseconds for display.
+ */
+void FormatMicroseconds(char *buf, size_t size, uint64_t us) {
+  if (us < 1000) {
+    snprintf(buf, size, "%lluus", (unsigned long long)us);
+  } else if (us < 1000000) {
+    snprintf(buf, size, "%.1fms", (double)us / 1e3);
+  } else {
+    snprintf(buf, size, "%.2fs", (double)us / 1e6);
+  }
+}
+
+/**
+ * @brief Built-in `timeout`: runs a command with a time limit.
+ *
+ * Usage: `timeout [-s SIG] [-k KILLAFTER] DURATION command [args...]`. The
+ * options may also follow DURATION. DURATION and KILLAFTER are numbers with
+ * an optional `s`, `m`, `h` or `d` suffix.
+ *
+ * The command runs in its own process group. The shell waits on a pidfd of
+ * the child together with a timerfd, so no helper process is involved. When
+ * the timer expires, SIG (default: TERM) is sent to the process group and,
+ * if KILLAFTER was given, KILL is sent once that much more time has passed.
+ *
+ * @return The exit status of the command, or, as with coreutils' timeout:
+ *         124 if the command timed out, 125 if timeout itself failed, 126 if
+ *         the command could not be executed, 127 if it was not found, and
+ *         137 if it was killed with KILL, as SIG or after KILLAFTER.
+ */
+int BuiltinTimeout(int argc, char **argv, int status) {
+  int sig = SIGTERM;
+  double duration = -1.0, kill_after = 0.0;
+  int i = 1;
+
+  for (; i < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      if ((sig = ParseSignal(argv[++i])) < 0) {
+        fprintf(stderr, "timeout: %s: invalid signal\n", argv[i]);
+        return 125;
+      }
+    } else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+      if ((kill_after = ParseDuration(argv[++i])) < 0) {
+        fprintf(stderr, "timeout: %s: invalid time interval\n", argv[i]);
+        return 125;
+      }
+    } else if (duration < 0) {
+      if ((duration = ParseDuration(argv[i])) < 0) {
+        fprintf(stderr, "timeout: %s: invalid time interval\n", argv[i]);
+        return 125;
+      }
+    } else {
+      break;
+    }
+  }
+  if (duration < 0 || i >= argc) {
+    fprintf(stderr,
+            "usage: timeout [-s SIG] [-k KILLAFTER] DURATION command...\n");
+    return 125;
+  }
+
+  DynamicArray *da_args = InitDynamicArray(argc - i + 1, sizeof(char *));
+  if (!da_args) {
+    PrintError("%s\n", strerror(errno));
+    return 125;
+  }
+  for (int j = i; j < argc; j++) {
+    AppendElement(da_args, &argv[j]);
+  }
+
+  SpawnAttributes attrs = kDefaultSpawnAttributes;
+  attrs.pgid = 0;
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = LaunchProcess(da_args, status, &attrs);
+  FreeDynamicArray(da_args);
+  if (pid < 0) {
+    PrintError("fork failed: %s\n", strerror(errno));
+    return 125;
+  }
+  setpgid(pid, pid);  // Also done by the child; whichever runs first wins
+  SetForegroundGroup(pid);
+
+  int timed_out = 0, killed = 0;
+  int wstatus = WaitWithTimeout(pid, duration, kill_after, sig, &timed_out,
+                                &killed);
+  SetForegroundGroup(getpgrp());
+  if (wstatus < 0) {
+    PrintError("wait failed: %s\n", strerror(errno));
+    return 125;
+  }
+
+  // As in coreutils, a command that had to be killed reports KILL
+  if (killed || (timed_out && sig == SIGKILL)) {
+    return 128 + SIGKILL;
+  }
+  return timed_out ? 124 : DecodeWaitStatus(wstatus);
+}
+
+/**
+ * @brief Waits for a child, signalling its process group when time runs out.
+ *
+ * @param pid        Process ID of the child, which leads its process group.
+ * @param duration   Seconds before `sig` is sent.
+ * @param kill_after Seconds after `sig` before KILL is sent, or 0 to never
+ *                   send KILL.
+ * @param sig        Signal sent when `duration` expires.
+ * @param timed_out  Set to 1 if `duration` expired.
+ * @param killed     Set to 1 if KILL had to be sent.
+ *
+ * @return The wait status of the child, or -1 on error with errno set. The
+ *         child is killed if waiting for it fails.
+ */
+int WaitWithTimeout(pid_t pid, double duration, double kill_after, int sig,
+                    int *timed_out, int *killed) {
+  int wstatus, ret = -1;
+  int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+  int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (timerfd < 0) {
+    if (pidfd >= 0) {
+      close(pidfd);
+    }
+    kill(-pid, SIGKILL);
+    waitpid(pid, &wstatus, 0);
+    return -1;
+  }
+  if (pidfd >= 0) {
+    fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+  }
+  ArmTimer(timerfd, duration);
+
+  for (;;) {
+    // Without pidfd support, fall back to checking on the child periodically
+    struct pollfd fds[2] = {{.fd = timerfd, .events = POLLIN},
+                            {.fd = pidfd, .events = POLLIN}};
+    int ready = poll(fds, pidfd >= 0 ? 2 : 1, pidfd >= 0 ? -1 : 50);
+    if (ready < 0 && errno != EINTR) {
+      int poll_errno = errno;
+      kill(-pid, SIGKILL);
+      waitpid(pid, NULL, 0);
+      errno = poll_errno;
+      break;
+    }
+
+    pid_t done = waitpid(pid, &wstatus, WNOHANG);
+    if (done == pid) {
+      ret = wstatus;
+      break;
+    }
+    if (done < 0 && errno != EINTR) {
+      break;
+    }
+
+    if (ready > 0 && (fds[0].revents & POLLIN)) {
+      uint64_t expirations;
+      if (read(timerfd, &expirations, sizeof(expirations)) < 0) {
+        continue;
+      }
+      if (!*timed_out) {
+        *timed_out = 1;
+        kill(-pid, sig);
+        if (sig != SIGKILL && sig != SIGCONT) {
+          kill(-pid, SIGCONT);  // Let stopped processes act on the signal
+        }
+        if (kill_after > 0) {
+          ArmTimer(timerfd, kill_after);
+        }
+      } else {
+        *killed = 1;
+        kill(-pid, SIGKILL);
+      }
+    }
+  }
+
+  int wait_errno = errno;
+  close(timerfd);
+  if (pidfd >= 0) {
+    close(pidfd);
+  }
+  errno = wait_errno;
+  return ret;
+}
+
+/**
+ * @brief Arms a one-shot timerfd.
+ *
+ * @param timerfd The timer file descriptor.
+ * @param seconds Time until expiry. A zero duration disarms the timer.
+ */
+void ArmTimer(int timerfd, double seconds) {
+  struct itimerspec its = {0};
+  its.it_value.tv_sec = (time_t)seconds;
+  its.it_value.tv_nsec = (long)((seconds - (double)its.it_value.tv_sec) * 1e9);
+  timerfd_settime(timerfd, 0, &its, NULL);
+}
+
+/**
+ * @brief Parses a duration such as `10`, `1.5s`, `2m`, `1h` or `1d`.
+ *
+ * @return The duration in seconds, or -1 if the string is invalid.
+ */
+double ParseDuration(const char *str) {
+  char *end;
+  double value = strtod(str, &end);
+  if (end == str || value < 0) {
+    return -1.0;
+  }
+
+  switch (*end) {
+    case '\0':
+    case 's':
+      break;
+    case 'm':
+      value *= 60;
+      break;
+    case 'h':
+      value *= 60 * 60;
+      break;
+    case 'd':
+      value *= 24 * 60 * 60;
+      break;
+    default:
+      return -1.0;
+  }
+  return (*end == '\0' || end[1] == '\0') ? value : -1.0;
+}
+
+/**
+ * @brief Parses a signal given by number or by name, with or without the
+ *        `SIG` prefix.
+ *
+ * @return The signal number, or -1 if the string names no signal.
+ */
+int ParseSignal(const char *str) {
+  char *end;
+  long num = strtol(str, &end, 10);
+  if (end != str && *end == '\0') {
+    return (num >= 0 && num < NSIG) ? (int)num : -1;
+  }
+
+  if (strncasecmp(str, "SIG", 3) == 0) {
+    str += 3;
+  }
+  for (int sig = 1; sig < NSIG; sig++) {
+    const char *name = sigabbrev_np(sig);
+    if (name && strcasecmp(str, name) == 0) {
+      return sig;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Hands the controlling terminal to a process group.
+ *
+ * Does nothing when standard input is not a terminal. SIGTTOU is ignored
+ * while doing so, since the shell may itself be in the background by then.
+ *
+ * @param pgid The process group to move to the foreground.
+ */
+void SetForegroundGroup(pid_t pgid) {
+  if (!isatty(STDIN_FILENO)) {
+    return;
+  }
+
+  struct sigaction ign = {0}, old;
+  ign.sa_handler = SIG_IGN;
+  sigemptyset(&ign.sa_mask);
+  sigaction(SIGTTOU, &ign, &old);
+  tcsetpgrp(STDIN_FILENO, pgid);
+  sigaction(SIGTTOU, &old, NULL);
+}
+
+/**
+ * @brief Built-in `spawn`: runs a command with process attributes applied by
+ *        the shell itself.
+ *
+ * Usage: `spawn [options] command [args...]`, where the options replace the
+ * usual wrapper commands:
+ *
+ *     -n INC          like `nice -n INC`
+ *     -i CLASS[:LVL]  like `ionice -c CLASS -n LVL`; CLASS is a number or
+ *                     one of realtime, best-effort and idle
+ *     -c CPUS         like `taskset -c CPUS`, e.g. `0-3,8`
+ *     -u MASK         sets the file mode creation mask (octal)
+ *     -l RES=SOFT[:HARD]
+ *                     like `prlimit --RES=SOFT:HARD`; may be repeated
+ *     -C DIR          like `env -C DIR`
+ *
+ * The attributes are applied in the forked child right before it executes
+ * the command, so no wrapper process is executed.
+ *
+ * @return The exit status of the command, or 125 if an option is invalid.
+ */
+int BuiltinSpawn(int argc, char **argv, int status) {
+  SpawnAttributes attrs = kDefaultSpawnAttributes;
+  int ret = 125;
+  int i = 1;
+
+  for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+    const char *opt = argv[i];
+    const char *arg = argv[i + 1];
+    if (strcmp(opt, "-n") == 0) {
+      char *end;
+      attrs.nice_inc = (int)strtol(arg, &end, 10);
+      attrs.set_nice = 1;
+      if (*end != '\0') {
+        goto spawn_invalid;
+      }
+    } else if (strcmp(opt, "-i") == 0) {
+      if ((attrs.ioprio = ParseIoPriority(arg)) < 0) {
+        goto spawn_invalid;
+      }
+    } else if (strcmp(opt, "-c") == 0) {
+      if (ParseCpuList(arg, &attrs.affinity) < 0) {
+        goto spawn_invalid;
+      }
+      attrs.set_affinity = 1;
+    } else if (strcmp(opt, "-u") == 0) {
+      char *end;
+      long mask = strtol(arg, &end, 8);
+      if (*end != '\0' || mask < 0 || mask > 0777) {
+        goto spawn_invalid;
+      }
+      attrs.umask = (mode_t)mask;
+    } else if (strcmp(opt, "-l") == 0) {
+      if (attrs.nlimits >= kMaxSpawnLimits ||
+          ParseResourceLimit(arg, &attrs.limits[attrs.nlimits]) < 0) {
+        goto spawn_invalid;
+      }
+      attrs.nlimits++;
+    } else if (strcmp(opt, "-C") == 0) {
+      if (attrs.dir_fd >= 0) {
+        close(attrs.dir_fd);
+      }
+      if ((attrs.dir_fd = open(arg, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "spawn: %s: %s\n", arg, strerror(errno));
+        goto spawn_done;
+      }
+    } else {
+      goto spawn_invalid;
+    }
+  }
+  if (i >= argc) {
+    fprintf(stderr, "usage: spawn [-n INC] [-i CLASS[:LEVEL]] [-c CPUS] "
+                    "[-u MASK] [-l RES=SOFT[:HARD]] [-C DIR] command...\n");
+    goto spawn_done;
+  }
+
+  DynamicArray *da_args = InitDynamicArray(argc - i + 1, sizeof(char *));
+  if (!da_args) {
+    PrintError("%s\n", strerror(errno));
+    goto spawn_done;
+  }
+  for (int j = i; j < argc; j++) {
+    AppendElement(da_args, &argv[j]);
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = LaunchProcess(da_args, status, &attrs);
+  FreeDynamicArray(da_args);
+  int wstatus;
+  if (pid < 0 || waitpid(pid, &wstatus, 0) < 0) {
+    PrintError("failed to run command: %s\n", strerror(errno));
+    goto spawn_done;
+  }
+  ret = DecodeWaitStatus(wstatus);
+  goto spawn_done;
+
+spawn_invalid:
+  fprintf(stderr, "spawn: invalid argument for %s: %s\n", argv[i],
+          argv[i + 1]);
+
+spawn_done:
+  if (attrs.dir_fd >= 0) {
+    close(attrs.dir_fd);
+  }
+  return ret;
+}
+
+/**
+ * @brief Parses an I/O scheduling class with an optional priority level.
+ *
+ * @param str A class given as a number or as `realtime`, `best-effort` or
+ *            `idle`, optionally followed by `:LEVEL` (0-7, default 4).
+ *
+ * @return The value for `ioprio_set`, or -1 if the string is invalid.
+ */
+int ParseIoPriority(const char *str) {
+  static const char *const kClasses[] = {"none", "realtime", "best-effort",
+                                         "idle"};
+  size_t len = strcspn(str, ":");
+  long ioclass = -1;
+
+  for (long c = 0; c < 4; c++) {
+    if (strlen(kClasses[c]) == len && strncmp(str, kClasses[c], len) == 0) {
+      ioclass = c;
+    }
+  }
+  if (ioclass < 0) {
+    char *end;
+    ioclass = strtol(str, &end, 10);
+    if (end != str + len || ioclass < 0 || ioclass > 3) {
+      return -1;
+    }
+  }
+
+  long level = 4;
+  if (str[len] == ':') {
+    char *end;
+    level = strtol(str + len + 1, &end, 10);
+    if (*end != '\0' || level < 0 || level > 7) {
+      return -1;
+    }
+  }
+  if (ioclass == 3) {
+    level = 0;  // The idle class has no levels
+  }
+  return (int)((ioclass << kIoPrioClassShift) | level);
+}
+
+/**
+ * @brief Parses a list of CPUs such as `0-3,8,10-11` into a CPU set.
+ *
+ * @return 0 on success, or -1 if the list is invalid.
+ */
+int ParseCpuList(const char *str, cpu_set_t *set) {
+  CPU_ZERO(set);
+  while (*str) {
+    char *end;
+    long first = strtol(str, &end, 10);
+    long last = first;
+    if (end == str || first < 0) {
+      return -1;
+    }
+    if (*end == '-') {
+      str = end + 1;
+      last = strtol(str, &end, 10);
+      if (end == str || last < first) {
+        return -1;
+      }
+    }
+    if (last >= CPU_SETSIZE) {
+      return -1;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      CPU_SET(cpu, set);
+    }
+
+    if (*end == ',') {
+      end++;
+    } else if (*end != '\0') {
+      return -1;
+    }
+    str = end;
+  }
+  return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+/**
+ * @brief Parses a resource limit of the form `RES=SOFT[:HARD]`.
+ *
+ * RES is the lowercase `prlimit` name of the resource, such as `nofile` or
+ * `as`. Limits are numbers or `unlimited`; a missing HARD equals SOFT.
+ *
+ * @return 0 on success, or -1 if the limit is invalid.
+ */
+int ParseResourceLimit(const char *str, ResourceLimit *limit) {
+  static const struct {
+    const char *name;
+    int resource;
+  } kResources[] = {
+      {"as", RLIMIT_AS},
+      {"core", RLIMIT_CORE},
+      {"cpu", RLIMIT_CPU},
+      {"data", RLIMIT_DATA},
+      {"fsize", RLIMIT_FSIZE},
+      {"locks", RLIMIT_LOCKS},
+      {"memlock", RLIMIT_MEMLOCK},
+      {"msgqueue", RLIMIT_MSGQUEUE},
+      {"nice", RLIMIT_NICE},
+      {"nofile", RLIMIT_NOFILE},
+      {"nproc", RLIMIT_NPROC},
+      {"rss", RLIMIT_RSS},
+      {"rtprio", RLIMIT_RTPRIO},
+      {"rttime", RLIMIT_RTTIME},
+      {"sigpending", RLIMIT_SIGPENDING},
+      {"stack", RLIMIT_STACK},
+  };
+
+  const char *eq = strchr(str, '=');
+  if (!eq) {
+    return -1;
+  }
+
+  limit->resource = -1;
+  for (size_t i = 0; i < sizeof(kResources) / sizeof(kResources[0]); i++) {
+    if (strlen(kResources[i].name) == (size_t)(eq - str) &&
+        strncmp(str, kResources[i].name, eq - str) == 0) {
+      limit->resource = kResources[i].resource;
+    }
+  }
+  if (limit->resource < 0) {
+    return -1;
+  }
+
+  const char *value = eq + 1;
+  for (int i = 0; i < 2; i++) {
+    rlim_t *target = i == 0 ? &limit->lim.rlim_cur : &limit->lim.rlim_max;
+    char *end;
+    if (strncmp(value, "unlimited", 9) == 0) {
+      *target = RLIM_INFINITY;
+      end = (char *)value + 9;
+    } else {
+      unsigned long long num = strtoull(value, &end, 10);
+      if (end == value) {
+        return -1;
+      }
+      *target = (rlim_t)num;
+    }
+
+    if (i == 0 && *end == '\0') {
+      limit->lim.rlim_max = limit->lim.rlim_cur;
+      return 0;
+    }
+    if (*end != (i == 0 ? ':' : '\0')) {
+      return -1;
+    }
+    value = end + 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Built-in `jobs`: lists background jobs.
+ *
+ * Usage: `jobs [-l]`. With `-l`, the process group of each job is shown too,
+ * along with its CPU time, memory and I/O so far. These come from the job's
+ * cgroup when the shell has one to manage, and otherwise from the live
+ * processes of its process group.
+ *
+ * With the `capture` option, `jobs -o %N [LINES]` shows the last lines of
+ * the output of a job, and `jobs -w FILE %N` writes all of its retained
+ * output to FILE. A finished job is forgotten once its output was shown.
+ *
+ * @return Always 0.
+ */
+int BuiltinJobs(int argc, char **argv, int status __attribute__((unused))) {
+  int long_format = argc > 1 && strcmp(argv[1], "-l") == 0;
+  if (argc > 1 && (strcmp(argv[1], "-o") == 0 || strcmp(argv[1], "-w") == 0)) {
+    return ShowJobOutput(argc, argv);
+  }
+  if (!job_table) {
+    return 0;
+  }
+
+  PollJobs();
+  Job *jobs = (Job *)job_table->data;
+  if (long_format && job_table->len > 0) {
+    printf("%-4s %7s  %-10s %9s %9s %9s  %s\n", "JOB", "PGID", "STATE", "CPU",
+           "MEM", "IO", "COMMAND");
+  }
+  for (size_t i = 0; i < job_table->len; i++) {
+    char state[16];
+    FormatJobState(&jobs[i], state, sizeof(state));
+    if (long_format) {
+      JobUsage usage;
+      ReadJobUsage(&jobs[i], &usage);
+      char id[8], cpu[16] = "-", memory[16], io[16];
+      snprintf(id, sizeof(id), "[%d]", jobs[i].id);
+      if (usage.cpu_us >= 0) {
+        FormatMicroseconds(cpu, sizeof(cpu), (uint64_t)usage.cpu_us);
+      }
+      FormatBytes(memory, sizeof(memory), usage.memory_bytes);
+      FormatBytes(io, sizeof(io), usage.io_bytes);
+      printf("%-4s %7d  %-10s %9s %9s %9s  %s\n", id, (int)jobs[i].pgid, state,
+             cpu, memory, io, jobs[i].cmdline);
+    } else {
+      printf("[%d]  %-10s %s\n", jobs[i].id, state, jobs[i].cmdline);
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Built-in `wait`: waits for background jobs to finish.
+ *
+ * Usage: `wait [%N|PID]...`. Without operands, waits for every job. Jobs
+ * that finish this way are not reported again before the next prompt.
+ * Queued jobs are started as admission allows, and regardless of it once
+ * no job is left running.
+ *
+ * @return The exit status of the last job waited for, or 127 if a job does
+ *         not exist.
+ */
+int BuiltinWait(int argc, char **argv, int status __attribute__((unused))) {
+  int ret = 0;
+  if (!job_table) {
+    return argc > 1 ? kExitNotFound : 0;
+  }
+
+  for (int i = 1; i < argc || (argc == 1 && i == 1); i++) {
+    int id = 0;
+    if (argc > 1) {
+      Job *job = FindJob(argv[i]);
+      if (!job) {
+        fprintf(stderr, "wait: %s: no such job\n", argv[i]);
+        ret = kExitNotFound;
+        continue;
+      }
+      id = job->id;
+    }
+
+    // Wait until the job (or every job) has no running process left
+    for (;;) {
+      Job *jobs = (Job *)job_table->data;
+      Job *pending = NULL;
+      for (size_t j = 0; j < job_table->len && !pending; j++) {
+        if ((jobs[j].running > 0 || jobs[j].queued) &&
+            (id == 0 || jobs[j].id == id)) {
+          pending = &jobs[j];
+        }
+      }
+      if (!pending) {
+        break;
+      }
+
+      // Captured output keeps being stored while waiting
+      if (pending->queued) {
+        // Queued behind other jobs, whose exits make room for it
+        StartQueuedJobs();
+        if (pending->queued) {
+          int wstatus;
+          struct rusage ru;
+          pid_t pid = WaitForChild(P_ALL, 0) < 0
+                          ? -1
+                          : wait4(-1, &wstatus, 0, &ru);
+          if (pid > 0) {
+            NoteJobExit(pid, wstatus, &ru);
+          } else if (errno == ECHILD) {
+            // Reaped elsewhere; nothing runs that the job could wait on
+            for (size_t j = 0; j < job_table->len; j++) {
+              jobs[j].running = 0;
+            }
+          }
+        }
+        continue;
+      }
+
+      int wstatus;
+      struct rusage ru;
+      pid_t pid = WaitForChild(P_PGID, (id_t)pending->pgid) < 0
+                      ? -1
+                      : wait4(-pending->pgid, &wstatus, 0, &ru);
+      if (pid < 0 && errno == EINTR) {
+        continue;
+      }
+      if (pid < 0) {
+        pending->running = 0;  // Reaped elsewhere
+        continue;
+      }
+      NoteJobExit(pid, wstatus, &ru);
+    }
+
+    Job *jobs = (Job *)job_table->data;
+    for (size_t j = 0; j < job_table->len;) {
+      if (jobs[j].running == 0 && !jobs[j].queued &&
+          (id == 0 || jobs[j].id == id)) {
+        ret = jobs[j].status;
+        FinishStreams(jobs[j].pgid);  // Compressed output is complete
+        j = RetireJob(j);
+      } else {
+        j++;
+      }
+    }
+  }
+  return ret;
+}
+
+/**
+ * @brief Registers a background pipeline in the job table, queued until
+ *        `StartJob()` starts it.
+ *
+ * @param da_stages Pointer to the DynamicArray of stages, used to build the
+ *                  command line shown by `jobs`.
+ * @param status    The exit status of the last executed command.
+ *
+ * @return A pointer to the new job, valid until the job table changes, or
+ *         NULL on allocation failure.
+ */
+Job *AddJob(DynamicArray *da_stages, int status) {
+  if (!job_table &&
+      !(job_table = InitDynamicArray(kDefaultArraySize, sizeof(Job)))) {
+    return NULL;
+  }
+
+  DynamicArray **stages = (DynamicArray **)da_stages->data;
+  Job job = {0};
+  job.npids = da_stages->len;
+  job.queued = 1;
+  job.limits = default_limits;
+  job.cgroup_fd = -1;
+  job.last_status = status;
+  job.pids = malloc(job.npids * sizeof(pid_t));
+  job.names = calloc(job.npids, sizeof(char *));
+  job.cmdline = JoinPipeline(da_stages);
+  if (!job.pids || !job.names || !job.cmdline) {
+    goto add_job_failed;
+  }
+  for (size_t i = 0; i < job.npids; i++) {
+    job.pids[i] = -1;
+    if (!(job.names[i] = strdup(((char **)stages[i]->data)[0]))) {
+      goto add_job_failed;
+    }
+  }
+
+  // Reuse the lowest free job number
+  Job *jobs = (Job *)job_table->data;
+  for (job.id = 1;; job.id++) {
+    size_t i = 0;
+    while (i < job_table->len && jobs[i].id != job.id) {
+      i++;
+    }
+    if (i == job_table->len) {
+      break;
+    }
+  }
+
+  if (AppendElement(job_table, &job) < 0) {
+    goto add_job_failed;
+  }
+  return &((Job *)job_table->data)[job_table->len - 1];
+
+add_job_failed:
+  for (size_t i = 0; job.names && i < job.npids; i++) {
+    free(job.names[i]);
+  }
+  free(job.names);
+  free(job.pids);
+  free(job.cmdline);
+  return NULL;
+}
+
+/**
+ * @brief Starts a background pipeline, or queues it when the `admit` option
+ *        is on and the host lacks the memory or capacity to take it now.
+ *
+ * @param da_stages Pointer to the DynamicArray of stages.
+ * @param status    The exit status of the last executed command.
+ *
+ * @return 0 if the job was started or queued, 1 otherwise.
+ */
+int StartBackgroundJob(DynamicArray *da_stages, int status) {
+  Job *job = AddJob(da_stages, status);
+  if (!job) {
+    PrintError("%s\n", strerror(errno));
+    return 1;
+  }
+
+  // Jobs queued earlier go first
+  int ahead = 0;
+  Job *jobs = (Job *)job_table->data;
+  for (size_t i = 0; i + 1 < job_table->len; i++) {
+    ahead |= jobs[i].queued;
+  }
+
+  if (shell_options[kOptionAdmit] && (ahead || !AdmitQueuedJob(job))) {
+    printf("[%d] queued\n", job->id);
+    fflush(stdout);
+    return 0;
+  }
+  if (StartJob(job) < 0) {
+    RemoveJob(job_table->len - 1);
+    return 1;
+  }
+  printf("[%d] %d\n", job->id, (int)job->pgid);
+  fflush(stdout);
+  return 0;
+}
+
+/**
+ * @brief Starts a queued job.
+ *
+ * The command line of the job is parsed again, so a job started late sees
+ * the working directory and files of the moment it starts.
+ *
+ * @return 0 on success, -1 if no stage could be started.
+ */
+int StartJob(Job *job) {
+  char *cmdline = strdup(job->cmdline);
+  DynamicArray *da_args = cmdline ? TokenizeCommandLine(cmdline) : NULL;
+  DynamicArray *expanded = NULL;
+  DynamicArray *da_stages =
+      (da_args && ExpandVariables(da_args, job->last_status, &expanded) == 0)
+          ? SplitPipeline(da_args)
+          : NULL;
+  size_t started = 0;
+  if (da_stages) {
+    // Without a delegated cgroup, the job is accounted by process group
+    CreateJobCgroup(job);
+    SpawnAttributes attrs = kDefaultSpawnAttributes;
+    attrs.pgid = 0;
+    attrs.cgroup_fd = job->cgroup_fd;
+    if (shell_options[kOptionCapture] &&
+        (job->output = CreateOutputRing(kCaptureBytes, &attrs.stdout_fd))) {
+      attrs.stderr_fd = attrs.stdout_fd;
+    }
+    job->start = MonotonicSeconds();
+    started = LaunchPipeline(da_stages, job->last_status, &attrs, NULL,
+                             job->pids,
+                             &job->pgid);
+    if (attrs.stdout_fd >= 0) {
+      close(attrs.stdout_fd);
+    }
+    FreePipeline(da_stages);
+  }
+  FreePathList(expanded);
+  if (da_args) {
+    FreeDynamicArray(da_args);
+  }
+  free(cmdline);
+
+  if (started == 0) {
+    RemoveJobCgroup(job);
+    FreeOutputRing(job->output);
+    job->output = NULL;
+    return -1;
+  }
+  for (size_t i = started; i < job->npids; i++) {
+    free(job->names[i]);
+  }
+  job->queued = 0;
+  job->npids = job->running = started;
+  return 0;
+}
+
+/**
+ * @brief Starts queued jobs, oldest first, for as long as they are admitted.
+ *
+ * A job is always admitted when no other job is running, so the queue
+ * cannot stall.
+ */
+void StartQueuedJobs(void) {
+  if (!job_table) {
+    return;
+  }
+
+  Job *jobs = (Job *)job_table->data;
+  for (size_t i = 0; i < job_table->len; i++) {
+    if (!jobs[i].queued) {
+      continue;
+    }
+    if (!AdmitQueuedJob(&jobs[i])) {
+      return;
+    }
+    if (StartJob(&jobs[i]) < 0) {
+      jobs[i].queued = 0;
+      jobs[i].status = 1;
+      continue;
+    }
+    printf("[%d] %d\n", jobs[i].id, (int)jobs[i].pgid);
+  }
+  fflush(stdout);
+}
+
+/**
+ * @brief Records that a process of a background job has terminated.
+ *
+ * @param pid     Process ID reported by `wait4`.
+ * @param wstatus Wait status reported by `wait4`.
+ * @param ru      Resource usage reported by `wait4`, or NULL. When given, it
+ *                is recorded in the command statistics.
+ */
+void NoteJobExit(pid_t pid, int wstatus, const struct rusage *ru) {
+  if (!job_table || (!WIFEXITED(wstatus) && !WIFSIGNALED(wstatus))) {
+    return;
+  }
+
+  Job *jobs = (Job *)job_table->data;
+  for (size_t i = 0; i < job_table->len; i++) {
+    for (size_t j = 0; j < jobs[i].npids; j++) {
+      if (jobs[i].pids[j] != pid) {
+        continue;
+      }
+      jobs[i].pids[j] = -1;
+      jobs[i].running--;
+      if (j + 1 == jobs[i].npids) {
+        jobs[i].status = DecodeWaitStatus(wstatus);
+      }
+      if (ru) {
+        RecordStageStats(jobs[i].names[j], jobs[i].start, ru);
+      }
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Collects the exit status of every terminated background process
+ *        without blocking.
+ */
+void PollJobs(void) {
+  int wstatus;
+  struct rusage ru;
+  pid_t pid;
+  while ((pid = wait4(-1, &wstatus, WNOHANG, &ru)) > 0) {
+    NoteJobExit(pid, wstatus, &ru);
+  }
+  StartQueuedJobs();
+}
+
+/**
+ * @brief Reports and forgets background jobs that have finished.
+ */
+void ReapJobs(void) {
+  FinishStreams(-1);
+  if (!job_table) {
+    return;
+  }
+
+  PollJobs();
+  Job *jobs = (Job *)job_table->data;
+  for (size_t i = 0; i < job_table->len;) {
+    if (jobs[i].running > 0 || jobs[i].queued || jobs[i].reported) {
+      i++;
+      continue;
+    }
+    char state[16];
+    FormatJobState(&jobs[i], state, sizeof(state));
+    printf("[%d]  %-10s %s\n", jobs[i].id, state, jobs[i].cmdline);
+    i = RetireJob(i);
+  }
+  fflush(stdout);
+}
+
+/**
+ * @brief Forgets a finished job, unless it has captured output, which is
+ *        kept until shown with `jobs -o` or `jobs -w`.
+ *
+ * @param index Index of the job in the job table.
+ *
+ * @return The index of the next job.
+ */
+size_t RetireJob(size_t index) {
+  Job *job = &((Job *)job_table->data)[index];
+  if (job->output) {
+    DrainOutputRing(job->output);
+  }
+  if (job->output && job->output->head > 0) {
+    job->reported = 1;
+    return index + 1;
+  }
+  RemoveJob(index);
+  return index;
+}
+
+/**
+ * @brief Removes a job from the job table.
+ *
+ * @param index Index of the job in the job table.
+ */
+void RemoveJob(size_t index) {
+  Job *jobs = (Job *)job_table->data;
+  for (size_t i = 0; i < jobs[index].npids; i++) {
+    free(jobs[index].names[i]);
+  }
+  free(jobs[index].names);
+  free(jobs[index].pids);
+  free(jobs[index].cmdline);
+  RemoveJobCgroup(&jobs[index]);
+  FreeOutputRing(jobs[index].output);
+  memmove(&jobs[index], &jobs[index + 1],
+          (job_table->len - index - 1) * sizeof(Job));
+  job_table->len--;
+}
+
+/**
+ * @brief Finds a job given as `%N` or by the process ID of one of its
+ *        processes.
+ *
+ * @return A pointer to the job, or NULL if there is no such job.
+ */
+Job *FindJob(const char *spec) {
+  if (!job_table) {
+    return NULL;
+  }
+
+  char *end;
+  long num = strtol(spec + (spec[0] == '%'), &end, 10);
+  if (*end != '\0' || end == spec + (spec[0] == '%')) {
+    return NULL;
+  }
+
+  Job *jobs = (Job *)job_table->data;
+  for (size_t i = 0; i < job_table->len; i++) {
+    if (spec[0] == '%' && jobs[i].id == num) {
+      return &jobs[i];
+    }
+    for (size_t j = 0; spec[0] != '%' && j < jobs[i].npids; j++) {
+      if (jobs[i].pids[j] == num || jobs[i].pgid == num) {
+        return &jobs[i];
+      }
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Describes the state of a job as shown by `jobs`.
+ */
+void FormatJobState(const Job *job, char *buf, size_t size) {
+  if (job->queued) {
+    snprintf(buf, size, "Queued");
+  } else if (job->running > 0) {
+    snprintf(buf, size, "Running");
+  } else if (job->status == 0) {
+    snprintf(buf, size, "Done");
+  } else {
+    snprintf(buf, size, "Exit %d", job->status);
+  }
+}
+
+/**
+ * @brief Rebuilds the text of a pipeline from its stages.
+ *
+ * @return A newly allocated string, or NULL on allocation failure.
+ */
+char *JoinPipeline(DynamicArray *da_stages) {
+  DynamicArray **stages = (DynamicArray **)da_stages->data;
+  size_t len = 1;
+  for (size_t i = 0; i < da_stages->len; i++) {
+    char **args = (char **)stages[i]->data;
+    for (size_t j = 0; j < stages[i]->len; j++) {
+      len += strlen(args[j]) + 3;
+    }
+  }
+
+  char *text = malloc(len);
+  if (!text) {
+    return NULL;
+  }
+  text[0] = '\0';
+  for (size_t i = 0; i < da_stages->len; i++) {
+    char **args = (char **)stages[i]->data;
+    if (i > 0) {
+      strcat(text, " | ");
+    }
+    for (size_t j = 0; j < stages[i]->len; j++) {
+      if (j > 0) {
+        strcat(text, " ");
+      }
+      strcat(text, args[j]);
+    }
+  }
+  return text;
+}
+
+/**
+ * @brief Chooses the CPUs of a new job according to the `placement` option.
+ *
+ * - `spread` pins each job to a different core, visiting NUMA nodes first,
+ *   then last-level caches, then cores, and SMT siblings last.
+ * - `compact` packs consecutive jobs and stages onto neighbouring CPUs.
+ * - `numa` confines each job to all CPUs of one NUMA node, round-robin.
+ *
+ * The stages of a pipeline are placed on distinct CPUs sharing the last-level
+ * cache, so data passed through the pipes stays in cache.
+ *
+ * @param nstages Number of processes in the job.
+ * @param sets    Array of `nstages` CPU sets to fill in.
+ *
+ * @return 0 if the job was placed, or -1 if placement is disabled or the CPU
+ *         topology is unknown.
+ */
+int PlaceJob(size_t nstages, cpu_set_t *sets) {
+  int policy = shell_options[kOptionPlacement];
+  CpuTopology *topo = LoadCpuTopology();
+  if (policy == kPlacementNone || !topo || topo->ncpus == 0) {
+    return -1;
+  }
+
+  size_t next = topo->next;
+  for (size_t i = 0; i < nstages; i++) {
+    CPU_ZERO(&sets[i]);
+  }
+
+  if (policy == kPlacementNuma) {
+    int node = topo->nodes[next++ % topo->nnodes];
+    for (size_t c = 0; c < topo->ncpus; c++) {
+      for (size_t i = 0; topo->cpus[c].node == node && i < nstages; i++) {
+        CPU_SET(topo->cpus[c].cpu, &sets[i]);
+      }
+    }
+  } else if (policy == kPlacementCompact) {
+    for (size_t i = 0; i < nstages; i++) {
+      CPU_SET(topo->cpus[topo->compact[next++ % topo->ncpus]].cpu, &sets[i]);
+    }
+  } else {
+    // The first stage takes the next CPU in spread order; later stages take
+    // the other CPUs of the same last-level cache in the same order, and
+    // share CPUs only once the cache domain has run out of them.
+    const CpuInfo *anchor = &topo->cpus[topo->spread[next++ % topo->ncpus]];
+    CPU_SET(anchor->cpu, &sets[0]);
+    for (size_t stage = 1, pass = 0; stage < nstages; pass++) {
+      for (size_t k = 0; k < topo->ncpus && stage < nstages; k++) {
+        const CpuInfo *cpu = &topo->cpus[topo->spread[k]];
+        if (cpu->llc == anchor->llc && (cpu != anchor || pass > 0)) {
+          CPU_SET(cpu->cpu, &sets[stage++]);
+        }
+      }
+    }
+  }
+
+  topo->next = next;
+  return 0;
+}
+
+/**
+ * @brief Reads the CPU topology from sysfs, once.
+ *
+ * For every online CPU the shell may run on, records its NUMA node, its
+ * physical core (the lowest numbered such SMT sibling) and its last-level
+ * cache domain (the lowest numbered such CPU sharing the highest-level
+ * cache), then derives the CPU orders used by the `compact` and `spread`
+ * placement policies.
+ *
+ * @return A pointer to the topology, or NULL if it cannot be read.
+ */
+CpuTopology *LoadCpuTopology(void) {
+  static CpuTopology topo;
+  static int loaded;
+  if (loaded) {
+    return topo.cpus ? &topo : NULL;
+  }
+  loaded = 1;
+
+  char path[kPathMax], buf[kInputMax];
+  cpu_set_t usable, allowed;
+  if (ReadSysfsFile(kSysfsCpuRoot "/online", buf, sizeof(buf)) < 0 ||
+      ParseCpuList(buf, &usable) < 0) {
+    return NULL;
+  }
+  // Under `taskset` or a cpuset, jobs may only be placed where the shell
+  // itself may run
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    CPU_AND(&usable, &usable, &allowed);
+  }
+  if (CPU_COUNT(&usable) == 0) {
+    return NULL;
+  }
+
+  topo.ncpus = CPU_COUNT(&usable);
+  topo.cpus = calloc(topo.ncpus, sizeof(CpuInfo));
+  topo.compact = calloc(topo.ncpus, sizeof(size_t));
+  topo.spread = calloc(topo.ncpus, sizeof(size_t));
+  topo.nodes = calloc(topo.ncpus, sizeof(int));
+  if (!topo.cpus || !topo.compact || !topo.spread || !topo.nodes) {
+    free(topo.cpus);
+    free(topo.compact);
+    free(topo.spread);
+    free(topo.nodes);
+    topo.cpus = NULL;
+    return NULL;
+  }
+
+  size_t n = 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE && n < topo.ncpus; cpu++) {
+    if (!CPU_ISSET(cpu, &usable)) {
+      continue;
+    }
+    CpuInfo *info = &topo.cpus[n++];
+    cpu_set_t set;
+    info->cpu = info->core = info->llc = cpu;
+
+    snprintf(path, sizeof(path),
+             kSysfsCpuRoot "/cpu%d/topology/thread_siblings_list", cpu);
+    if (ReadSysfsFile(path, buf, sizeof(buf)) == 0 &&
+        ParseCpuList(buf, &set) == 0) {
+      CPU_AND(&set, &set, &usable);
+      info->core = LowestCpu(&set);
+      for (int sibling = info->core; sibling < cpu; sibling++) {
+        info->thread += CPU_ISSET(sibling, &set) ? 1 : 0;
+      }
+    }
+
+    int max_level = 0;
+    for (int index = 0;; index++) {
+      snprintf(path, sizeof(path), kSysfsCpuRoot "/cpu%d/cache/index%d/level",
+               cpu, index);
+      if (ReadSysfsFile(path, buf, sizeof(buf)) < 0) {
+        break;
+      }
+      int level = atoi(buf);
+      snprintf(path, sizeof(path),
+               kSysfsCpuRoot "/cpu%d/cache/index%d/shared_cpu_list", cpu,
+               index);
+      if (level > max_level && ReadSysfsFile(path, buf, sizeof(buf)) == 0 &&
+          ParseCpuList(buf, &set) == 0) {
+        CPU_AND(&set, &set, &usable);
+        max_level = level;
+        info->llc = LowestCpu(&set);
+      }
+    }
+
+    for (int node = 0; node < CPU_SETSIZE; node++) {
+      snprintf(path, sizeof(path), kSysfsNodeRoot "/node%d/cpulist", node);
+      if (ReadSysfsFile(path, buf, sizeof(buf)) < 0) {
+        if (errno == ENOENT && node > 0) {
+          break;
+        }
+        continue;
+      }
+      if (ParseCpuList(buf, &set) == 0 && CPU_ISSET(cpu, &set)) {
+        info->node = node;
+        break;
+      }
+    }
+  }
+  topo.ncpus = n;
+
+  // Rank cores within their cache domain and cache domains within their
+  // node, and collect the distinct nodes
+  for (size_t i = 0; i < n; i++) {
+    CpuInfo *info = &topo.cpus[i];
+    int new_node = 1;
+    for (size_t j = 0; j < n; j++) {
+      const CpuInfo *other = &topo.cpus[j];
+      if (other->cpu == other->core && other->llc == info->llc &&
+          other->core < info->core) {
+        info->core_rank++;
+      }
+      if (other->cpu == other->llc && other->node == info->node &&
+          other->llc < info->llc) {
+        info->llc_rank++;
+      }
+      if (j < i && other->node == info->node) {
+        new_node = 0;
+      }
+    }
+    if (new_node) {
+      topo.nodes[topo.nnodes++] = info->node;
+    }
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    topo.compact[i] = topo.spread[i] = i;
+  }
+  qsort_r(topo.compact, n, sizeof(size_t), CompareCompact, topo.cpus);
+  qsort_r(topo.spread, n, sizeof(size_t), CompareSpread, topo.cpus);
+  return &topo;
+}
+
+/**
+ * @brief Orders CPUs so that neighbours share a node, cache and core.
+ */
+int CompareCompact(const void *a, const void *b, void *arg) {
+  const CpuInfo *cpus = arg;
+  const CpuInfo *x = &cpus[*(const size_t *)a];
+  const CpuInfo *y = &cpus[*(const size_t *)b];
+  int keys[][2] = {{x->node, y->node},
+                   {x->llc, y->llc},
+                   {x->core, y->core},
+                   {x->cpu, y->cpu}};
+  for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+    if (keys[i][0] != keys[i][1]) {
+      return keys[i][0] < keys[i][1] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Orders CPUs so that neighbours are as far apart as possible.
+ */
+int CompareSpread(const void *a, const void *b, void *arg) {
+  const CpuInfo *cpus = arg;
+  const CpuInfo *x = &cpus[*(const size_t *)a];
+  const CpuInfo *y = &cpus[*(const size_t *)b];
+  int keys[][2] = {{x->thread, y->thread},
+                   {x->core_rank, y->core_rank},
+                   {x->llc_rank, y->llc_rank},
+                   {x->node, y->node},
+                   {x->cpu, y->cpu}};
+  for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+    if (keys[i][0] != keys[i][1]) {
+      return keys[i][0] < keys[i][1] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Returns the lowest CPU number in a CPU set, or 0 if it is empty.
+ */
+int LowestCpu(const cpu_set_t *set) {
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, set)) {
+      return cpu;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Reads a small sysfs file, without its trailing newline.
+ *
+ * @return 0 on success, or -1 on error with errno set accordingly.
+ */
+int ReadSysfsFile(const char *path, char *buf, size_t size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  ssize_t nread = read(fd, buf, size - 1);
+  close(fd);
+  if (nread < 0) {
+    return -1;
+  }
+  buf[nread] = '\0';
+  buf[strcspn(buf, "\n")] = '\0';
+  return 0;
+}
+
+/**
+ * @brief Decides whether a queued background job may start now.
+ *
+ * @return 1 if the job is admitted, 0 if it must stay queued.
+ */
+int AdmitQueuedJob(const Job *job) {
+  Job *jobs = (Job *)job_table->data;
+  size_t running = 0;
+  for (size_t i = 0; i < job_table->len; i++) {
+    running += jobs[i].running;
+  }
+  if (running == 0) {
+    return 1;
+  }
+
+  uint64_t need_kb = 0;
+  for (size_t i = 0; i < job->npids; i++) {
+    need_kb += EstimateMemory(job->names[i]);
+  }
+  return AdmitJob(need_kb, JobsPendingGrowth());
+}
+
+/**
+ * @brief Decides whether the host can take on one more job.
+ *
+ * A job is admitted when the memory available exceeds its estimated need,
+ * plus what running jobs are still expected to allocate, plus a reserve of
+ * `kAdmitReservePercent` of the total memory; when memory and I/O pressure
+ * are low; and when the load average does not exceed the number of CPUs.
+ * Measurements the kernel does not provide are not checked.
+ *
+ * @param need_kb      Estimated peak memory of the job, in kilobytes.
+ * @param committed_kb Memory that running jobs are expected to allocate
+ *                     before they finish, in kilobytes.
+ *
+ * @return 1 if the job is admitted, 0 otherwise.
+ */
+int AdmitJob(uint64_t need_kb, uint64_t committed_kb) {
+  SystemLoad load;
+  if (ReadSystemLoad(&load) < 0) {
+    return 1;
+  }
+
+  uint64_t reserve_kb = load.mem_total_kb * kAdmitReservePercent / 100;
+  if (load.mem_total_kb > 0 &&
+      load.mem_available_kb < need_kb + committed_kb + reserve_kb) {
+    return 0;
+  }
+  if (load.mem_pressure > kAdmitMaxMemPressure ||
+      load.io_pressure > kAdmitMaxIoPressure) {
+    return 0;
+  }
+  return load.loadavg < 0 || load.loadavg <= kAdmitMaxLoadPerCpu * load.ncpus;
+}
+
+/**
+ * @brief Reads the memory, pressure and load figures used for admission.
+ *
+ * Figures that cannot be read are left at 0 (memory) or negative (pressure
+ * and load).
+ *
+ * @return 0 on success, or -1 if nothing could be read.
+ */
+int ReadSystemLoad(SystemLoad *load) {
+  load->mem_total_kb = load->mem_available_kb = 0;
+  load->mem_pressure = load->io_pressure = load->loadavg = -1;
+  load->ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int found = 0;
+
+  char line[256];
+  FILE *fp = fopen("/proc/meminfo", "re");
+  while (fp && fgets(line, sizeof(line), fp)) {
+    unsigned long long kb;
+    if (sscanf(line, "MemTotal: %llu kB", &kb) == 1) {
+      load->mem_total_kb = kb;
+      found = 1;
+    } else if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+      load->mem_available_kb = kb;
+    }
+  }
+  if (fp) {
+    fclose(fp);
+  }
+
+  // Pressure stall information: share of time some task waited on memory
+  // or I/O over the last ten seconds
+  const char *pressure_files[] = {"/proc/pressure/memory", "/proc/pressure/io"};
+  double *pressures[] = {&load->mem_pressure, &load->io_pressure};
+  for (size_t i = 0; i < 2; i++) {
+    if ((fp = fopen(pressure_files[i], "re"))) {
+      if (fgets(line, sizeof(line), fp) &&
+          sscanf(line, "some avg10=%lf", pressures[i]) == 1) {
+        found = 1;
+      }
+      fclose(fp);
+    }
+  }
+
+  if (getloadavg(&load->loadavg, 1) == 1) {
+    found = 1;
+  } else {
+    load->loadavg = -1;
+  }
+  return found ? 0 : -1;
+}
+
+/**
+ * @brief Estimates the peak memory of a command from its past runs.
+ *
+ * @param cmd Name or path of the command, as typed.
+ *
+ * @return The decaying peak of its maximum resident set size, in kilobytes,
+ *         or 0 if the command has no recorded runs.
+ */
+uint64_t EstimateMemory(const char *cmd) {
+  StatsFile *sf = OpenStatsFile();
+  CommandStats *cs = sf ? LookupCommandStats(sf, cmd, 0) : NULL;
+  return cs ? cs->rss_kb : 0;
+}
+
+/**
+ * @brief Estimates how much more memory a running process will allocate,
+ *        as its estimated peak minus its current resident set size.
+ *
+ * @param pid Process ID of the running command.
+ * @param cmd Name or path of the command, as typed.
+ *
+ * @return The estimate in kilobytes, 0 if the process is already at or past
+ *         its estimated peak.
+ */
+uint64_t PendingGrowth(pid_t pid, const char *cmd) {
+  uint64_t estimate_kb = EstimateMemory(cmd);
+  if (estimate_kb == 0) {
+    return 0;
+  }
+
+  char path[64];
+  char buf[128];
+  unsigned long long size, resident;
+  snprintf(path, sizeof(path), "/proc/%d/statm", (int)pid);
+  if (ReadSysfsFile(path, buf, sizeof(buf)) < 0 ||
+      sscanf(buf, "%llu %llu", &size, &resident) != 2) {
+    return 0;  // Already gone
+  }
+  uint64_t resident_kb = resident * (uint64_t)sysconf(_SC_PAGESIZE) / 1024;
+  return estimate_kb > resident_kb ? estimate_kb - resident_kb : 0;
+}
+
+/**
+ * @brief Sums the memory that running background jobs are expected to
+ *        allocate before they finish.
+ *
+ * @return The estimate in kilobytes.
+ */
+uint64_t JobsPendingGrowth(void) {
+  uint64_t total_kb = 0;
+  Job *jobs = job_table ? (Job *)job_table->data : NULL;
+  for (size_t i = 0; jobs && i < job_table->len; i++) {
+    for (size_t j = 0; j < jobs[i].npids; j++) {
+      if (!jobs[i].queued && jobs[i].pids[j] > 0) {
+        total_kb += PendingGrowth(jobs[i].pids[j], jobs[i].names[j]);
+      }
+    }
+  }
+  return total_kb;
+}
+
+/**
+ * @brief Shows or saves the captured output of a job, for `jobs -o` and
+ *        `jobs -w`.
+ *
+ * @return 0 on success, 1 if the job has no captured output or the file
+ *         could not be written, or 2 on a usage error.
+ */
+int ShowJobOutput(int argc, char **argv) {
+  int write = strcmp(argv[1], "-w") == 0;
+  const char *spec = write ? (argc == 4 ? argv[3] : NULL)
+                           : (argc == 3 || argc == 4 ? argv[2] : NULL);
+  size_t lines = kCaptureTailLines;
+  char *end = NULL;
+  if (!write && argc == 4) {
+    lines = strtoul(argv[3], &end, 10);
+  }
+  if (!spec || (end && (*end != '\0' || end == argv[3]))) {
+    fprintf(stderr, "usage: jobs -o %%N [LINES] | jobs -w FILE %%N\n");
+    return 2;
+  }
+
+  Job *job = FindJob(spec);
+  if (!job) {
+    fprintf(stderr, "jobs: %s: no such job\n", spec);
+    return 1;
+  }
+  if (!job->output) {
+    fprintf(stderr, "jobs: %s: output not captured\n", spec);
+    return 1;
+  }
+
+  DrainOutputRing(job->output);
+  if (write) {
+    if (DumpOutputRing(job->output, argv[2]) < 0) {
+      fprintf(stderr, "jobs: %s: %s\n", argv[2], strerror(errno));
+      return 1;
+    }
+  } else {
+    PrintOutputTail(job->output, lines);
+  }
+
+  if (job->reported) {
+    RemoveJob((size_t)(job - (Job *)job_table->data));
+  }
+  return 0;
+}
+
+/**
+ * @brief Creates a ring buffer capturing the output of a background job.
+ *
+ * The buffer lives in a memory file mapped twice back to back, so that the
+ * latest `size` bytes are always contiguous and reads from the pipe never
+ * have to be split at the end of the buffer. Nothing touches the disk. The
+ * read end of the pipe is watched by the event loop of `WaitForInput()`.
+ *
+ * @param size     Capacity of the buffer, a multiple of the page size.
+ * @param write_fd Receives the write end of the capture pipe, to be passed to
+ *                 the job and closed by the caller.
+ *
+ * @return A pointer to the new ring, or NULL on error with errno set
+ *         accordingly.
+ */
+OutputRing *CreateOutputRing(size_t size, int *write_fd) {
+  OutputRing *ring = calloc(1, sizeof(OutputRing));
+  int fds[2] = {-1, -1};
+  int mem_fd = -1;
+  if (!ring || pipe2(fds, O_CLOEXEC) < 0 ||
+      (mem_fd = memfd_create("job-output", MFD_CLOEXEC)) < 0 ||
+      ftruncate(mem_fd, (off_t)size) < 0) {
+    goto ring_failed;
+  }
+
+  // Reserve room for both views first, then map the file over each half
+  char *data = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1, 0);
+  if (data == MAP_FAILED) {
+    goto ring_failed;
+  }
+  if (mmap(data, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, mem_fd,
+           0) == MAP_FAILED ||
+      mmap(data + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+           mem_fd, 0) == MAP_FAILED) {
+    munmap(data, 2 * size);
+    goto ring_failed;
+  }
+  close(mem_fd);
+
+  // A pipe as large as the ring lets a job run ahead while the shell is busy.
+  // The read end stays blocking so that io_uring reads wait for data.
+  fcntl(fds[0], F_SETPIPE_SZ, (int)size);
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = ring};
+  if (GetEventLoop() < 0 ||
+      epoll_ctl(GetEventLoop(), EPOLL_CTL_ADD, fds[0], &event) < 0) {
+    munmap(data, 2 * size);
+    mem_fd = -1;
+    goto ring_failed;
+  }
+
+  ring->data = data;
+  ring->size = size;
+  ring->fd = fds[0];
+  *write_fd = fds[1];
+  return ring;
+
+ring_failed:
+  PrintError("cannot capture output: %s\n", strerror(errno));
+  if (mem_fd >= 0) {
+    close(mem_fd);
+  }
+  if (fds[0] >= 0) {
+    close(fds[0]);
+    close(fds[1]);
+  }
+  free(ring);
+  return NULL;
+}
+
+/**
+ * @brief Releases a ring buffer and closes its pipe.
+ */
+void FreeOutputRing(OutputRing *ring) {
+  if (!ring) {
+    return;
+  }
+  CloseOutputPipe(ring);
+  munmap(ring->data, 2 * ring->size);
+  free(ring);
+}
+
+/**
+ * @brief Moves whatever is in the capture pipe into the ring, overwriting the
+ *        oldest output. Closes the pipe once every writer is gone.
+ */
+void DrainOutputRing(OutputRing *ring) {
+  struct pollfd pfd = {.fd = ring->fd, .events = POLLIN};
+  while (ring->fd >= 0 && poll(&pfd, 1, 0) > 0) {
+    ssize_t nread = read(ring->fd, ring->data + ring->head % ring->size,
+                         ring->size);
+    if (nread > 0) {
+      ring->head += (uint64_t)nread;
+    } else if (nread == 0 || errno != EINTR) {
+      CloseOutputPipe(ring);
+    }
+  }
+}
+
+/**
+ * @brief Closes the capture pipe of a ring once its writers are gone.
+ */
+void CloseOutputPipe(OutputRing *ring) {
+  if (ring->fd >= 0) {
+    epoll_ctl(GetEventLoop(), EPOLL_CTL_DEL, ring->fd, NULL);
+    close(ring->fd);
+    ring->fd = -1;
+  }
+}
+
+/**
+ * @brief Writes the last lines held in a ring to standard output.
+ *
+ * @param ring  Pointer to the ring.
+ * @param lines Number of lines to show.
+ */
+void PrintOutputTail(const OutputRing *ring, size_t lines) {
+  size_t len = ring->head < ring->size ? (size_t)ring->head : ring->size;
+  const char *start = ring->data + (ring->head - len) % ring->size;
+
+  if (lines == 0) {
+    return;
+  }
+
+  // Walk back to the start of the requested line, ignoring a final break
+  size_t pos = len;
+  size_t breaks = 0;
+  if (pos > 0 && start[pos - 1] == '\n') {
+    pos--;
+  }
+  while (pos > 0 && !(start[pos - 1] == '\n' && ++breaks == lines)) {
+    pos--;
+  }
+
+  fwrite(start + pos, 1, len - pos, stdout);
+  if (len > pos && start[len - 1] != '\n') {
+    putchar('\n');
+  }
+}
+
+/**
+ * @brief Writes all output held in a ring to a file.
+ *
+ * @return 0 on success, or -1 on error with errno set accordingly.
+ */
+int DumpOutputRing(const OutputRing *ring, const char *path) {
+  size_t len = ring->head < ring->size ? (size_t)ring->head : ring->size;
+  const char *start = ring->data + (ring->head - len) % ring->size;
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    return -1;
+  }
+  while (len > 0) {
+    ssize_t written = write(fd, start, len);
+    if (written < 0 && errno != EINTR) {
+      int saved_errno = errno;
+      close(fd);
+      errno = saved_errno;
+      return -1;
+    }
+    if (written > 0) {
+      start += written;
+      len -= (size_t)written;
+    }
+  }
+  return close(fd);
+}
+
+/**
+ * @brief Returns the epoll instance of the event loop, creating it on first
+ *        use.
+ *
+ * @return The epoll file descriptor, or -1 on error with errno set
+ *         accordingly.
+ */
+int GetEventLoop(void) {
+  static int epoll_fd = -1;
+  if (epoll_fd < 0) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  }
+  return epoll_fd;
+}
+
+/**
+ * @brief Waits until a file descriptor is readable, storing the output of
+ *        background jobs in the meantime.
+ *
+ * @param fd         File descriptor to wait for, or -1 to wait for the
+ *                   timeout only.
+ * @param timeout_ms Longest wait in milliseconds, or -1 for no limit.
+ *
+ * @return 1 if the descriptor is readable, 0 on timeout, or -1 on error with
+ *         errno set accordingly (EINTR when interrupted by a signal).
+ */
+int WaitForInput(int fd, int timeout_ms) {
+  int epoll_fd = GetEventLoop();
+  if (epoll_fd < 0) {
+    return -1;
+  }
+
+  // Registration fails for regular files, which are always readable
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+  if (fd >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0 &&
+      errno != EEXIST) {
+    return 1;
+  }
+
+  int ready = 0;
+  struct epoll_event events[8];
+  do {
+    int nevents = epoll_wait(epoll_fd, events, 8, timeout_ms);
+    if (nevents < 0) {
+      ready = -1;
+      break;
+    }
+    for (int i = 0; i < nevents; i++) {
+      if (events[i].data.ptr) {
+        DrainOutputRing(events[i].data.ptr);
+      } else {
+        ready = 1;
+      }
+    }
+  } while (!ready && timeout_ms < 0);
+
+  if (fd >= 0) {
+    int saved_errno = errno;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    errno = saved_errno;
+  }
+  return ready;
+}
+
+/**
+ * @brief Adds a line of input to the command being read, which continues
+ *        on the next line if this one ends with `|` or a backslash.
+ *
+ * Only the new line is looked at: whether the command continues depends on
+ * its last word alone, and is kept in the buffer until the next line. The
+ * text grows geometrically, so a command of many lines is read in linear
+ * time. A backslash joins the lines without a space, as in other shells;
+ * after `|`, the next line starts a new word. Blank lines after `|` are
+ * skipped.
+ *
+ * @param cb   The command being read.
+ * @param line The new line, without its newline.
+ *
+ * @return 1 if the command is complete, 0 if it continues on the next
+ *         line, or -1 if memory runs out, with errno set accordingly.
+ */
+int AppendCommandLine(CommandBuffer *cb, const char *line) {
+  size_t len = strlen(line);
+  size_t end = len;
+  while (end > 0 && line[end - 1] == ' ') {
+    end--;
+  }
+  size_t start = end;
+  while (start > 0 && line[start - 1] != ' ') {
+    start--;
+  }
+
+  ContinueReason reason = kContinueNone;
+  if (len > 0 && line[len - 1] == '\\') {
+    reason = kContinueBackslash;
+    len--;
+  } else if ((end - start == strlen(kWordPipe) &&
+              strncmp(line + start, kWordPipe, end - start) == 0) ||
+             (end == 0 && cb->pending == kContinuePipe)) {
+    reason = kContinuePipe;
+  }
+
+  size_t need = cb->len + len + 2;  // a space and the terminator at most
+  if (need > cb->size) {
+    size_t size = cb->size * 2 > need ? cb->size * 2 : need;
+    char *text = realloc(cb->text, size);
+    if (!text) {
+      return -1;
+    }
+    cb->text = text;
+    cb->size = size;
+  }
+  if (cb->pending == kContinuePipe) {
+    cb->text[cb->len++] = ' ';
+  }
+  memcpy(cb->text + cb->len, line, len);
+  cb->len += len;
+  cb->text[cb->len] = '\0';
+  cb->pending = reason;
+  return reason == kContinueNone;
+}
+
+/**
+ * @brief Empties the command being read, keeping its buffer.
+ */
+void ResetCommandBuffer(CommandBuffer *cb) {
+  cb->len = 0;
+  cb->pending = kContinueNone;
+  if (cb->text) {
+    cb->text[0] = '\0';
+  }
+}
+
+/**
+ * @brief Reads a command line from standard input, without the newline.
+ *
+ * Input is read through the event loop, so the output of background jobs is
+ * captured while the shell waits at the prompt. Lines longer than the buffer
+ * are split, as `fgets` would. With the `highlight` option, a terminal is
+ * read through the line editor instead (see ReadEditedLine()).
+ *
+ * Commands may read the rest of standard input themselves, as `dag` does,
+ * so unless it is a terminal no input is kept past the line returned: a
+ * file is read ahead and then seeked back to the end of the line, and a
+ * pipe is read a byte at a time.
+ *
+ * @param buf  Buffer receiving the line.
+ * @param size Size of the buffer.
+ *
+ * @return 1 if a line was read, 0 at end of input, or -1 on error with errno
+ *         set accordingly.
+ */
+int ReadCommandLine(char *buf, size_t size) {
+  static char input[kLineBufferSize];
+  static size_t input_len;
+  static int at_eof;
+  static int input_checked, input_tty, input_seekable;
+
+  if (!input_checked) {
+    input_checked = 1;
+    input_tty = isatty(STDIN_FILENO);
+    input_seekable = lseek(STDIN_FILENO, 0, SEEK_CUR) >= 0;
+  }
+
+  if (shell_options[kOptionHighlight] && input_len == 0 && !at_eof &&
+      isatty(STDIN_FILENO) && isatty(STDOUT_FILENO)) {
+    return ReadEditedLine(buf, size);
+  }
+  for (;;) {
+    char *newline = memchr(input, '\n', input_len);
+    size_t len = newline ? (size_t)(newline - input) : input_len;
+    if (len >= size) {
+      len = size - 1;
+      newline = NULL;
+    }
+    if (newline || len == size - 1 || input_len == sizeof(input) ||
+        (at_eof && input_len > 0)) {
+      memcpy(buf, input, len);
+      buf[len] = '\0';
+      size_t consumed = len + (newline != NULL);
+      memmove(input, input + consumed, input_len - consumed);
+      input_len -= consumed;
+      if (!input_tty && input_seekable && input_len > 0 &&
+          lseek(STDIN_FILENO, -(off_t)input_len, SEEK_CUR) >= 0) {
+        input_len = 0;
+      }
+      return 1;
+    }
+    if (at_eof) {
+      return 0;
+    }
+
+    size_t want = (input_tty || input_seekable) ? sizeof(input) - input_len : 1;
+    ssize_t nread = ReadInput(STDIN_FILENO, input + input_len, want);
+    if (nread < 0) {
+      return -1;
+    }
+    at_eof = nread == 0;
+    input_len += (size_t)nread;
+  }
+}
+
+/**
+ * @brief Returns whether two lexer states are the same.
+ *
+ * LexState is made of bytes only, so it has no padding to compare.
+ */
+int LexStateEqual(const LexState *a, const LexState *b) {
+  return memcmp(a, b, sizeof(LexState)) == 0;
+}
+
+/**
+ * @brief Classifies the bytes of one word of a command line for
+ *        highlighting.
+ *
+ * Words are told apart as TokenizeCommandLine() does: `|` and `&` are
+ * operators that start a new command, redirection operators are followed
+ * by their target, and the first other word of a command is its name.
+ * Expansions inside a word are marked as ExpandVariables() finds them.
+ *
+ * @param word    The word, not terminated.
+ * @param len     Length of the word.
+ * @param state   Lexer state before the word, updated to the one after it.
+ * @param classes Receives the LexClass of each byte of the word.
+ */
+void LexWord(const char *word, size_t len, LexState *state,
+             unsigned char *classes) {
+  char op[3] = "";
+  const char *interned = NULL;
+  if (len < sizeof(op)) {
+    memcpy(op, word, len);
+    interned = InternString(op, 0);
+  }
+
+  LexClass class = kLexText;
+  if (interned && (interned == kWordPipe || interned == kWordBackground)) {
+    class = kLexOperator;
+    *state = (LexState){0, 0, 0};
+  } else if (state->conditional) {
+    state->conditional = !(len == 2 && memcmp(word, "]]", 2) == 0);
+  } else if (interned && GetRedirectType(interned) != kNone) {
+    class = kLexRedirect;
+    state->expect_target = 1;
+  } else if (state->expect_target) {
+    class = kLexTarget;
+    state->expect_target = 0;
+  } else if (!state->command_seen) {
+    class = kLexCommand;
+    state->command_seen = 1;
+    state->conditional = len == 2 && memcmp(word, "[[", 2) == 0;
+  }
+  memset(classes, class, len);
+  if (class == kLexOperator || class == kLexRedirect) {
+    return;
+  }
+
+  for (size_t i = 0; i + 1 < len; i++) {
+    if (word[i] != '$') {
+      continue;
+    }
+    size_t end = i + 2;
+    if (word[i + 1] != '?') {
+      int braced = word[i + 1] == '{';
+      size_t name = i + 1 + braced;
+      if (name >= len ||
+          !(isalpha((unsigned char)word[name]) || word[name] == '_')) {
+        continue;
+      }
+      for (end = name; end < len && (isalnum((unsigned char)word[end]) ||
+                                     word[end] == '_');
+           end++) {
+      }
+      if (braced && (end >= len || word[end] != '}')) {
+        continue;
+      }
+      end += braced;
+    }
+    memset(classes + i, kLexVariable, end - i);
+    i = end - 1;
+  }
+}
+
+/**
+ * @brief Updates the classes of an edited line, lexing only from the last
+ *        checkpoint before the edit until the lexer state converges.
+ *
+ * Checkpoints hold the lexer state at the start of a word, one at least
+ * every kLexCheckpointBytes bytes. Those before the edit stay valid, those
+ * inside it are dropped and those after it are shifted. Lexing restarts at
+ * the last valid one, and stops at the first shifted one past the edit
+ * whose state it reproduces: from there on, the classes of the previous
+ * pass still hold.
+ *
+ * @param ed   The line editor, whose text and classes already reflect the
+ *             edit, with the classes of untouched bytes moved along.
+ * @param pos  Offset of the edit.
+ * @param nold Number of bytes the edit removed at `pos`.
+ * @param nnew Number of bytes it inserted there.
+ *
+ * @return The number of bytes lexed again.
+ */
+size_t RelexLine(LineEditor *ed, size_t pos, size_t nold, size_t nnew) {
+  LexCheckpoint *cps = (LexCheckpoint *)ed->checkpoints->data;
+  size_t ncps = ed->checkpoints->len;
+  size_t keep = 1;  // the one at offset 0 is always valid
+  while (keep < ncps && cps[keep].offset <= pos) {
+    keep++;
+  }
+  size_t next = keep;  // first old checkpoint after the edit
+  while (next < ncps && cps[next].offset < pos + nold) {
+    next++;
+  }
+  for (size_t i = next; i < ncps; i++) {
+    cps[i].offset = cps[i].offset - nold + nnew;
+  }
+
+  LexState state = cps[keep - 1].state;
+  size_t start = cps[keep - 1].offset;
+  size_t p = start;
+  size_t last = start;  // offset of the last checkpoint
+  size_t tail = next;   // first old checkpoint not passed yet
+  ed->fresh->len = 0;
+  for (;;) {
+    while (p < ed->len && ed->buf[p] == ' ') {
+      ed->classes[p++] = kLexText;
+    }
+    while (tail < ncps && cps[tail].offset < p) {
+      tail++;
+    }
+    if (p >= pos + nnew && tail < ncps && cps[tail].offset == p &&
+        LexStateEqual(&cps[tail].state, &state)) {
+      break;  // converged: keep the old checkpoints from here
+    }
+    if (p >= ed->len) {
+      tail = ncps;
+      break;
+    }
+    LexCheckpoint cp = {p, state};
+    if (p - last >= kLexCheckpointBytes && AppendElement(ed->fresh, &cp) == 0) {
+      last = p;
+    }
+
+    size_t end = p;
+    while (end < ed->len && ed->buf[end] != ' ') {
+      end++;
+    }
+    LexWord(ed->buf + p, end - p, &state, ed->classes + p);
+    p = end;
+  }
+
+  // Without room for the new checkpoints, they are left out: lexing then
+  // restarts further back, with the same result
+  size_t nfresh = ed->fresh->len;
+  size_t ntail = ncps - tail;
+  if (keep + nfresh + ntail > ed->checkpoints->size &&
+      ResizeDynamicArray(ed->checkpoints, keep + nfresh + ntail) < 0) {
+    nfresh = 0;
+  }
+  cps = (LexCheckpoint *)ed->checkpoints->data;
+  memmove(cps + keep + nfresh, cps + tail, ntail * sizeof(LexCheckpoint));
+  memcpy(cps + keep, ed->fresh->data, nfresh * sizeof(LexCheckpoint));
+  ed->checkpoints->len = keep + nfresh + ntail;
+  return p - start;
+}
+
+/**
+ * @brief Replaces part of the line being edited and lexes it again.
+ *
+ * @param ed   The line editor.
+ * @param pos  Offset of the text to replace.
+ * @param nold Number of bytes to remove at `pos`.
+ * @param text The bytes to insert there.
+ * @param nnew Number of bytes to insert.
+ *
+ * @return 0 on success, or -1 if the line would not fit in its buffer.
+ */
+int ReplaceText(LineEditor *ed, size_t pos, size_t nold, const char *text,
+                size_t nnew) {
+  if (ed->len - nold + nnew >= ed->size) {
+    errno = ENOBUFS;
+    return -1;
+  }
+  size_t rest = ed->len - pos - nold;
+  memmove(ed->buf + pos + nnew, ed->buf + pos + nold, rest);
+  memmove(ed->classes + pos + nnew, ed->classes + pos + nold, rest);
+  memcpy(ed->buf + pos, text, nnew);
+  ed->len = ed->len - nold + nnew;
+  ed->buf[ed->len] = '\0';
+  RelexLine(ed, pos, nold, nnew);
+  return 0;
+}
+
+/**
+ * @brief Writes part of the line being edited, colored by class.
+ *
+ * @param out   The writer to the terminal.
+ * @param ed    The line editor.
+ * @param start Offset of the first byte to write.
+ * @param end   Offset after the last one.
+ */
+void WriteHighlighted(TextWriter *out, const LineEditor *ed, size_t start,
+                      size_t end) {
+  size_t run = start;
+  for (size_t i = start + 1; i <= end; i++) {
+    if (i == end || ed->classes[i] != ed->classes[run]) {
+      const char *color = kLexColors[ed->classes[run]];
+      WriteText(out, color, strlen(color));
+      WriteText(out, ed->buf + run, i - run);
+      run = i;
+    }
+  }
+  WriteText(out, kLexColors[kLexText], strlen(kLexColors[kLexText]));
+}
+
+/**
+ * @brief Counts the terminal columns taken by text, one per UTF-8
+ *        character.
+ */
+size_t TextColumns(const char *text, size_t len) {
+  size_t columns = 0;
+  for (size_t i = 0; i < len; i++) {
+    columns += (text[i] & 0xc0) != 0x80;
+  }
+  return columns;
+}
+
+/**
+ * @brief Moves the terminal cursor to an offset of the line as drawn.
+ *
+ * Moves are relative to where the cursor is, in rows and columns worked
+ * out from the width of the terminal, so that they stay right when a long
+ * line wraps and scrolls the screen.
+ *
+ * @param ed  The line editor.
+ * @param out The writer to the terminal.
+ * @param pos Offset in the drawn text.
+ */
+void MoveEditorCursor(LineEditor *ed, TextWriter *out, size_t pos) {
+  size_t from = ed->start_column + TextColumns(ed->shown, ed->shown_cursor);
+  size_t to = ed->start_column + TextColumns(ed->shown, pos);
+  size_t from_row = from / ed->columns, to_row = to / ed->columns;
+  char seq[32];
+  if (to_row != from_row) {
+    int n = snprintf(seq, sizeof(seq), "\033[%zu%c",
+                     to_row > from_row ? to_row - from_row : from_row - to_row,
+                     to_row > from_row ? 'B' : 'A');
+    WriteText(out, seq, (size_t)n);
+  }
+  if (to % ed->columns != from % ed->columns || to_row != from_row) {
+    WriteText(out, "\r", 1);
+    if (to % ed->columns > 0) {
+      int n = snprintf(seq, sizeof(seq), "\033[%zuC", to % ed->columns);
+      WriteText(out, seq, (size_t)n);
+    }
+  }
+  ed->shown_cursor = pos;
+}
+
+/**
+ * @brief Asks the terminal which column its cursor is at.
+ *
+ * The report comes on standard input, possibly after keys typed ahead,
+ * which are kept in `edit_keys` for the line editor.
+ *
+ * @param out The writer to the terminal.
+ *
+ * @return The column, counting from 0, or 0 if the terminal does not
+ *         report it within kCursorReportMs.
+ */
+size_t QueryCursorColumn(TextWriter *out) {
+  WriteText(out, "\033[6n", 4);
+  FlushText(out);
+  memmove(edit_keys, edit_keys + edit_applied, edit_nkeys - edit_applied);
+  edit_nkeys -= edit_applied;
+  edit_applied = 0;
+
+  size_t scanned = edit_nkeys;  // the report follows the keys read already
+  while (edit_nkeys < sizeof(edit_keys)) {
+    int ready = WaitForInput(STDIN_FILENO, kCursorReportMs);
+    if (ready < 0 && errno == EINTR) {
+      continue;
+    }
+    ssize_t nread = ready > 0 ? read(STDIN_FILENO, edit_keys + edit_nkeys,
+                                     sizeof(edit_keys) - edit_nkeys)
+                              : -1;
+    if (nread <= 0) {
+      break;
+    }
+    edit_nkeys += (size_t)nread;
+
+    // The report is ESC [ row ; column R
+    for (size_t i = scanned; i + 1 < edit_nkeys; i++) {
+      if (edit_keys[i] != '\033' || edit_keys[i + 1] != '[') {
+        continue;
+      }
+      size_t j = i + 2, column = 0;
+      int semicolons = 0;
+      for (; j < edit_nkeys && (isdigit(edit_keys[j]) || edit_keys[j] == ';');
+           j++) {
+        semicolons += edit_keys[j] == ';';
+        column = edit_keys[j] == ';' ? 0 : column * 10 + (edit_keys[j] - '0');
+      }
+      if (j < edit_nkeys && edit_keys[j] == 'R' && semicolons == 1) {
+        memmove(edit_keys + i, edit_keys + j + 1, edit_nkeys - j - 1);
+        edit_nkeys -= j + 1 - i;
+        return column > 0 ? column - 1 : 0;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Starts drawing the line being edited where the cursor is, after
+ *        the prompt.
+ *
+ * @param ed  The line editor.
+ * @param out The writer to the terminal.
+ */
+void StartEditedLine(LineEditor *ed, TextWriter *out) {
+  struct winsize ws;
+  ed->columns = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0
+                    ? ws.ws_col
+                    : kDefaultColumns;
+  ed->start_column = QueryCursorColumn(out) % ed->columns;
+  ed->shown_len = ed->shown_cursor = 0;
+}
+
+/**
+ * @brief Draws the changes to the line being edited and places the cursor.
+ *
+ * Only the text from the first byte whose character or class differs from
+ * what was drawn is written again.
+ */
+void RedrawLine(LineEditor *ed, TextWriter *out) {
+  size_t first = 0;
+  while (first < ed->len && first < ed->shown_len &&
+         ed->buf[first] == ed->shown[first] &&
+         ed->classes[first] == ed->shown_classes[first]) {
+    first++;
+  }
+  while (first > 0 &&
+         ((first < ed->len && (ed->buf[first] & 0xc0) == 0x80) ||
+          (first < ed->shown_len && (ed->shown[first] & 0xc0) == 0x80))) {
+    first--;  // to the start of the character
+  }
+
+  if (first < ed->len || first < ed->shown_len) {
+    MoveEditorCursor(ed, out, first);
+    WriteText(out, "\033[J", 3);
+    WriteHighlighted(out, ed, first, ed->len);
+    memcpy(ed->shown + first, ed->buf + first, ed->len - first);
+    memcpy(ed->shown_classes + first, ed->classes + first, ed->len - first);
+    ed->shown_len = ed->shown_cursor = ed->len;
+    // Past the last column, the terminal only wraps at the next character
+    if (ed->len > first &&
+        (ed->start_column + TextColumns(ed->shown, ed->len)) % ed->columns ==
+            0) {
+      WriteText(out, "\r\n", 2);
+    }
+  }
+  MoveEditorCursor(ed, out, ed->cursor);
+  FlushText(out);
+}
+
+/**
+ * @brief Reads a command line from a terminal with a line editor that
+ *        highlights it as it is typed.
+ *
+ * The terminal is put in raw mode while editing. The editor moves with the
+ * arrow keys, Home, End, ^A, ^E, ^B and ^F, deletes with Backspace, Delete
+ * and ^D, and kills the text before and after the cursor with ^U and ^K.
+ * Tab completes the word before the cursor (see CompleteWord()). ^C
+ * discards the line and fails with EINTR, and ^D on an empty line ends
+ * input. Each edit is
+ * lexed by RelexLine() from the nearest checkpoint, and all the keys read
+ * at once are applied before the line is drawn, so pasted text is lexed and
+ * drawn once.
+ *
+ * @param buf  Buffer receiving the line.
+ * @param size Size of the buffer.
+ *
+ * @return 1 if a line was read, 0 at end of input, or -1 on error with errno
+ *         set accordingly.
+ */
+int ReadEditedLine(char *buf, size_t size) {
+  struct termios saved;
+  if (tcgetattr(STDIN_FILENO, &saved) < 0) {
+    return -1;
+  }
+  struct termios raw = saved;
+  raw.c_iflag &= ~(tcflag_t)(ICRNL | IXON);
+  raw.c_lflag &= ~(tcflag_t)(ECHO | ICANON | ISIG | IEXTEN);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+
+  int ret = -2;  // until a line is read
+  LexCheckpoint origin = {0, {0, 0, 0}};
+  LineEditor ed = {buf,
+                   calloc(size, 1),
+                   0,
+                   size,
+                   0,
+                   InitDynamicArray(kDefaultArraySize, sizeof(LexCheckpoint)),
+                   InitDynamicArray(kDefaultArraySize, sizeof(LexCheckpoint)),
+                   malloc(size),
+                   malloc(size),
+                   0,
+                   0,
+                   0,
+                   kDefaultColumns};
+  TextWriter *out = malloc(sizeof(TextWriter));
+  if (!ed.classes || !ed.checkpoints || !ed.fresh || !ed.shown ||
+      !ed.shown_classes || !out ||
+      AppendElement(ed.checkpoints, &origin) < 0 ||
+      tcsetattr(STDIN_FILENO, TCSADRAIN, &raw) < 0) {
+    ret = -1;
+    goto edit_cleanup;
+  }
+  out->fd = STDOUT_FILENO;
+  out->len = 0;
+  buf[0] = '\0';
+  StartEditedLine(&ed, out);
+
+  int escape = 0;  // 1 after ESC, 2 within a control sequence
+  unsigned param = 0;
+  while (ret == -2) {
+    if (edit_applied == edit_nkeys) {
+      RedrawLine(&ed, out);
+      ssize_t nread = ReadInput(STDIN_FILENO, edit_keys, sizeof(edit_keys));
+      if (nread < 0 && errno == EINTR) {
+        continue;
+      }
+      if (nread <= 0) {
+        ret = nread == 0 ? 0 : -1;
+        break;
+      }
+      edit_nkeys = (size_t)nread;
+      edit_applied = 0;
+    }
+
+    unsigned char key = edit_keys[edit_applied++];
+    if (escape == 1) {
+      escape = (key == '[' || key == 'O') ? 2 : 0;
+      param = 0;
+      continue;
+    }
+    if (escape == 2) {
+      if (isdigit(key)) {
+        param = param * 10 + (key - '0');
+        continue;
+      }
+      escape = 0;
+      if (key == 'C' || key == 'D') {
+        key = key == 'C' ? 0x06 : 0x02;
+      } else if (key == 'H' || (key == '~' && (param == 1 || param == 7))) {
+        key = 0x01;
+      } else if (key == 'F' || (key == '~' && (param == 4 || param == 8))) {
+        key = 0x05;
+      } else if (key == '~' && param == 3) {
+        key = 0x04;
+        if (ed.len == 0) {
+          continue;  // Delete does not end input
+        }
+      } else {
+        continue;
+      }
+    }
+
+    if (key >= 0x20 && key != 0x7f) {
+      // Insert the whole run of text read at once
+      size_t end = edit_applied;
+      while (end < edit_nkeys && edit_keys[end] >= 0x20 &&
+             edit_keys[end] != 0x7f) {
+        end++;
+      }
+      size_t n = end - edit_applied + 1;
+      char *text = (char *)edit_keys + edit_applied - 1;
+      if (ReplaceText(&ed, ed.cursor, 0, text, n) < 0) {
+        WriteText(out, "\a", 1);
+      } else {
+        ed.cursor += n;
+      }
+      edit_applied = end;
+      continue;
+    }
+
+    switch (key) {
+      case 0x01:  // ^A
+        ed.cursor = 0;
+        break;
+      case 0x02:  // ^B
+        while (ed.cursor > 0 && (buf[--ed.cursor] & 0xc0) == 0x80) {
+        }
+        break;
+      case 0x03:  // ^C
+        ed.len = ed.cursor = 0;
+        buf[0] = '\0';
+        WriteText(out, "^C", 2);
+        errno = EINTR;  // as a SIGINT interrupting a plain read would
+        ret = -1;
+        edit_nkeys = edit_applied = 0;
+        break;
+      case 0x04:  // ^D
+        if (ed.len == 0) {
+          ret = 0;
+        } else if (ed.cursor < ed.len) {
+          size_t end = ed.cursor + 1;
+          while (end < ed.len && (buf[end] & 0xc0) == 0x80) {
+            end++;
+          }
+          ReplaceText(&ed, ed.cursor, end - ed.cursor, "", 0);
+        }
+        break;
+      case 0x05:  // ^E
+        ed.cursor = ed.len;
+        break;
+      case 0x06:  // ^F
+        while (ed.cursor < ed.len && (buf[++ed.cursor] & 0xc0) == 0x80) {
+        }
+        break;
+      case 0x08:  // ^H
+      case 0x7f:  // Backspace
+        if (ed.cursor > 0) {
+          size_t end = ed.cursor;
+          while (ed.cursor > 0 && (buf[--ed.cursor] & 0xc0) == 0x80) {
+          }
+          ReplaceText(&ed, ed.cursor, end - ed.cursor, "", 0);
+        }
+        break;
+      case '\t':
+        CompleteWord(&ed, out);
+        break;
+      case 0x0b:  // ^K
+        ReplaceText(&ed, ed.cursor, ed.len - ed.cursor, "", 0);
+        break;
+      case 0x15:  // ^U
+        ReplaceText(&ed, 0, ed.cursor, "", 0);
+        ed.cursor = 0;
+        break;
+      case 0x1b:  // ESC
+        escape = 1;
+        break;
+      case '\r':
+      case '\n':
+        ed.cursor = ed.len;
+        RedrawLine(&ed, out);
+        ret = 1;
+        break;
+      default:
+        break;
+    }
+  }
+  int saved_errno = errno;
+  // A line filling its last row has left the cursor on the next one
+  if (ret != 1 || ed.len == 0 ||
+      (ed.start_column + TextColumns(ed.shown, ed.shown_len)) % ed.columns !=
+          0) {
+    WriteText(out, "\n", 1);
+  }
+  FlushText(out);
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &saved);
+  errno = saved_errno;
+
+edit_cleanup:
+  free(out);
+  free(ed.classes);
+  FreeDynamicArray(ed.checkpoints);
+  FreeDynamicArray(ed.fresh);
+  free(ed.shown);
+  free(ed.shown_classes);
+  return ret;
+}
+
+/**
+ * @brief Built-in `complete`: defines how arguments of commands are
+ *        completed in the line editor.
+ *
+ * Usage:
+ * - `complete -F GENERATOR NAME...`: arguments of the commands NAME are
+ *   completed by GENERATOR (see RunCompletionGenerator()).
+ * - `complete -r NAME...`: removes the specs of the commands.
+ * - `complete [-p] [NAME...]`: lists specs, with the file each was loaded
+ *   from and how long loading it took, and how often and how long its
+ *   generator ran.
+ *
+ * Specs are also loaded on demand from the completion directory (see
+ * LoadCompletionSpec()).
+ *
+ * @return 0 on success, 1 if a spec to list or remove does not exist, or 2
+ *         on a usage error.
+ */
+int BuiltinComplete(int argc, char **argv, int status __attribute__((unused))) {
+  const char *usage =
+      "usage: complete [-p] [NAME...] | -F GENERATOR NAME... | -r NAME...\n";
+  if (argc >= 2 && strcmp(argv[1], "-F") == 0) {
+    if (argc < 4) {
+      fputs(usage, stderr);
+      return 2;
+    }
+    for (int i = 3; i < argc; i++) {
+      CompletionSpec *spec = AddCompletionSpec(argv[i]);
+      char *generator = strdup(argv[2]);
+      char *source = loading_spec_file ? strdup(loading_spec_file) : NULL;
+      if (!spec || !generator || (loading_spec_file && !source)) {
+        fprintf(stderr, "complete: %s\n", strerror(errno));
+        free(generator);
+        free(source);
+        return 1;
+      }
+      free(spec->generator);
+      free(spec->source);
+      spec->generator = generator;
+      spec->source = source;
+    }
+    return 0;
+  }
+
+  int remove = argc >= 2 && strcmp(argv[1], "-r") == 0;
+  int first = (argc >= 2 && (remove || strcmp(argv[1], "-p") == 0)) ? 2 : 1;
+  if ((remove && argc < 3) || (first < argc && argv[first][0] == '-')) {
+    fputs(usage, stderr);
+    return 2;
+  }
+
+  int ret = 0;
+  for (int i = first; i < argc; i++) {
+    CompletionSpec *spec = FindCompletionSpec(argv[i], 0);
+    if (!spec || !spec->generator) {
+      fprintf(stderr, "complete: %s: no completion specification\n", argv[i]);
+      ret = 1;
+    } else if (remove) {
+      free(spec->generator);
+      free(spec->source);
+      spec->generator = spec->source = NULL;  // and not loaded again
+    }
+  }
+  if (remove) {
+    return ret;
+  }
+
+  CompletionSpec *specs =
+      completion_specs ? (CompletionSpec *)completion_specs->data : NULL;
+  for (size_t i = 0; specs && i < completion_specs->len; i++) {
+    const CompletionSpec *spec = &specs[i];
+    int listed = first == argc;
+    for (int j = first; j < argc && !listed; j++) {
+      listed = strcmp(argv[j], spec->name) == 0;
+    }
+    if (!listed || !spec->generator) {
+      continue;
+    }
+
+    char avg[32], last[32], load[32];
+    FormatMicroseconds(
+        avg, sizeof(avg),
+        spec->calls ? (uint64_t)(spec->total_time * 1e6 / spec->calls) : 0);
+    FormatMicroseconds(last, sizeof(last), (uint64_t)(spec->last_time * 1e6));
+    FormatMicroseconds(load, sizeof(load), (uint64_t)(spec->load_time * 1e6));
+    printf("complete -F %s %s  # %u runs, avg %s, last %s", spec->generator,
+           spec->name, spec->calls, avg, last);
+    if (spec->source) {
+      printf(", loaded from %s in %s", spec->source, load);
+    }
+    printf("\n");
+  }
+  return ret;
+}
+
+/**
+ * @brief Returns the completion spec of a command, adding an empty one if
+ *        there is none.
+ *
+ * @return The spec, or NULL if memory runs out.
+ */
+CompletionSpec *AddCompletionSpec(const char *name) {
+  CompletionSpec *spec = FindCompletionSpec(name, 0);
+  if (spec) {
+    return spec;
+  }
+  if (!completion_specs &&
+      !(completion_specs =
+            InitDynamicArray(kDefaultArraySize, sizeof(CompletionSpec)))) {
+    return NULL;
+  }
+  CompletionSpec created = {strdup(name), NULL, NULL, 0, 0, 0, 0};
+  if (!created.name || AppendElement(completion_specs, &created) < 0) {
+    free(created.name);
+    return NULL;
+  }
+  return &((CompletionSpec *)completion_specs->data)[completion_specs->len -
+                                                     1];
+}
+
+/**
+ * @brief Returns the completion spec of a command.
+ *
+ * @param name The command name.
+ * @param load Whether to look for a spec in the completion directory if
+ *             none was looked for yet.
+ *
+ * @return The spec, whose generator is NULL if the command has none, or
+ *         NULL if none was looked for.
+ */
+CompletionSpec *FindCompletionSpec(const char *name, int load) {
+  CompletionSpec *specs =
+      completion_specs ? (CompletionSpec *)completion_specs->data : NULL;
+  for (size_t i = 0; specs && i < completion_specs->len; i++) {
+    if (strcmp(specs[i].name, name) == 0) {
+      return &specs[i];
+    }
+  }
+  if (!load) {
+    return NULL;
+  }
+  LoadCompletionSpec(name);
+  return AddCompletionSpec(name);  // without a generator if none was found
+}
+
+/**
+ * @brief Loads the completion spec of a command from the completion
+ *        directory.
+ *
+ * The directory is `$SHELL_COMPLETION_DIR`, or
+ * `~/.local/share/shell-completions`. Its files are scripts of `complete`
+ * commands, sourced only when a command they define is first completed.
+ * The file is found through the index of the directory (see
+ * MapCompletionIndex()), so the other files are not read.
+ */
+void LoadCompletionSpec(const char *name) {
+  const CompletionIndexHeader *index = MapCompletionIndex();
+  const CompletionIndexEntry *entries =
+      index ? (const CompletionIndexEntry *)(index + 1) : NULL;
+  const char *strings =
+      entries ? (const char *)(entries + index->count) : NULL;
+  const char *file = NULL;
+  size_t lo = 0;
+  size_t hi = index ? index->count : 0;
+  while (lo < hi && !file) {
+    size_t mid = lo + (hi - lo) / 2;
+    int cmp = strcmp(name, strings + entries[mid].name);
+    if (cmp == 0) {
+      file = strings + entries[mid].file;
+    } else if (cmp < 0) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+
+  char dir[kPathMax], path[kPathMax];
+  if (!file || GetCompletionDir(dir, sizeof(dir)) < 0) {
+    return;
+  }
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  char *argv[] = {"source", path, NULL};
+  double start = MonotonicSeconds();
+  loading_spec_file = path;
+  BuiltinSource(2, argv, 0);
+  loading_spec_file = NULL;
+
+  CompletionSpec *specs =
+      completion_specs ? (CompletionSpec *)completion_specs->data : NULL;
+  for (size_t i = 0; specs && i < completion_specs->len; i++) {
+    if (specs[i].source && strcmp(specs[i].source, path) == 0) {
+      specs[i].load_time = MonotonicSeconds() - start;
+    }
+  }
+}
+
+/**
+ * @brief Builds the path of the completion directory.
+ *
+ * @return 0 on success, or -1 if neither `$SHELL_COMPLETION_DIR` nor
+ *         `$HOME` is set.
+ */
+int GetCompletionDir(char *buf, size_t size) {
+  const char *dir = getenv(kCompletionDirVariable);
+  const char *home = getenv("HOME");
+  if (dir && *dir) {
+    snprintf(buf, size, "%s", dir);
+  } else if (home && *home) {
+    snprintf(buf, size, "%s/.local/share/shell-completions", home);
+  } else {
+    errno = ENOENT;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Maps the index of the completion directory, rebuilding it if the
+ *        directory changed since it was written.
+ *
+ * The index lives in the cache directory. It holds a header, the entries
+ * sorted by command name, and the table of names and file names they point
+ * into. Adding, removing or renaming a file changes the modification time
+ * of the directory, and so rebuilds the index; a file edited in place is
+ * indexed again once the directory is touched.
+ *
+ * @return The header of the mapped index, or NULL if there is none.
+ */
+const CompletionIndexHeader *MapCompletionIndex(void) {
+  char dir[kPathMax], path[kPathMax];
+  struct stat st;
+  if (GetCompletionDir(dir, sizeof(dir)) < 0 || stat(dir, &st) < 0) {
+    return NULL;
+  }
+  int64_t mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  if (completion_index && completion_index->dir_mtime == mtime) {
+    return completion_index;
+  }
+  if (completion_index) {
+    munmap((void *)completion_index, completion_index_size);
+    completion_index = NULL;
+  }
+  if (GetCachePath("shell-complete", path, sizeof(path)) < 0) {
+    return NULL;
+  }
+
+  for (int attempt = 0; attempt < 2; attempt++) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    void *map = MAP_FAILED;
+    if (fd >= 0 && fstat(fd, &st) == 0 &&
+        (size_t)st.st_size > sizeof(CompletionIndexHeader)) {
+      map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (map != MAP_FAILED) {
+      const CompletionIndexHeader *header = map;
+      size_t size = (size_t)st.st_size;
+      if (CheckCompletionIndex(header, size, mtime)) {
+        completion_index = header;
+        completion_index_size = size;
+        return header;
+      }
+      munmap(map, size);
+    }
+    if (attempt == 0 && BuildCompletionIndex(dir, path, mtime) < 0) {
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Checks that a mapped index of the completion directory is current
+ *        and well formed.
+ *
+ * The index may be stale, truncated or written by another version of the
+ * shell, so every offset LoadCompletionSpec() follows must fall in the
+ * string table, which must end with a NUL for the strings to end in it.
+ *
+ * @param header The mapped index.
+ * @param size   Size of the mapping, at least that of the header.
+ * @param mtime  Modification time of the directory, in nanoseconds.
+ *
+ * @return 1 if the index can be used, 0 otherwise.
+ */
+int CheckCompletionIndex(const CompletionIndexHeader *header, size_t size,
+                         int64_t mtime) {
+  if (header->magic != kCompletionIndexMagic ||
+      header->version != kCompletionIndexVersion ||
+      header->dir_mtime != mtime || header->strings == 0 ||
+      size != sizeof(*header) +
+                  (size_t)header->count * sizeof(CompletionIndexEntry) +
+                  header->strings ||
+      ((const char *)header)[size - 1] != '\0') {
+    return 0;
+  }
+  const CompletionIndexEntry *entries =
+      (const CompletionIndexEntry *)(header + 1);
+  for (uint32_t i = 0; i < header->count; i++) {
+    if (entries[i].name >= header->strings ||
+        entries[i].file >= header->strings) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * @brief Appends a "NAME\0FILE" pair to the list an index is built from.
+ *
+ * Sorting such strings sorts them by name.
+ *
+ * @return 0 on success, or -1 if memory runs out.
+ */
+int AppendIndexPair(DynamicArray *da_pairs, const char *name,
+                    const char *file) {
+  size_t len = strlen(name) + 1;
+  char *pair = malloc(len + strlen(file) + 1);
+  if (!pair) {
+    return -1;
+  }
+  memcpy(pair, name, len);
+  strcpy(pair + len, file);
+  if (AppendElement(da_pairs, &pair) < 0) {
+    free(pair);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Writes the index of the completion directory.
+ *
+ * Each file is indexed under its own name and under the names its
+ * `complete -F` lines define. The index is written to a temporary file and
+ * renamed into place, so other shells never map a partial one.
+ *
+ * @param dir   The completion directory.
+ * @param path  Path of the index.
+ * @param mtime Modification time of the directory, in nanoseconds.
+ *
+ * @return 0 on success, or -1 on error with errno set accordingly.
+ */
+int BuildCompletionIndex(const char *dir, const char *path, int64_t mtime) {
+  DynamicArray *da_pairs = InitDynamicArray(kDefaultArraySize, sizeof(char *));
+  DIR *dp = opendir(dir);
+  char *line = NULL;
+  size_t linecap = 0;
+  char tmp[kPathMax];
+  int ret = -1;
+  if (!da_pairs || !dp) {
+    goto index_done;
+  }
+
+  struct dirent *de;
+  while ((de = readdir(dp))) {
+    char file[kPathMax];
+    struct stat st;
+    snprintf(file, sizeof(file), "%s/%s", dir, de->d_name);
+    FILE *fp = NULL;
+    if (de->d_name[0] != '.' && stat(file, &st) == 0 && S_ISREG(st.st_mode)) {
+      fp = fopen(file, "r");
+    }
+    if (!fp) {
+      continue;
+    }
+
+    int failed = AppendIndexPair(da_pairs, de->d_name, de->d_name) < 0;
+    while (!failed && getline(&line, &linecap, fp) >= 0) {
+      line[strcspn(line, "\n")] = '\0';
+      char *save = NULL;
+      char *word = strtok_r(line, " ", &save);
+      if (!word || strcmp(word, "complete") != 0 ||
+          !(word = strtok_r(NULL, " ", &save)) || strcmp(word, "-F") != 0 ||
+          !strtok_r(NULL, " ", &save)) {
+        continue;
+      }
+      while (!failed && (word = strtok_r(NULL, " ", &save))) {
+        failed = AppendIndexPair(da_pairs, word, de->d_name) < 0;
+      }
+    }
+    fclose(fp);
+    if (failed) {
+      goto index_done;
+    }
+  }
+
+  // Names defined twice keep one file
+  char **pairs = (char **)da_pairs->data;
+  qsort(pairs, da_pairs->len, sizeof(char *), CompareStrings);
+  size_t count = 0;
+  for (size_t i = 0; i < da_pairs->len; i++) {
+    if (count == 0 || strcmp(pairs[i], pairs[count - 1]) != 0) {
+      char *kept = pairs[count];
+      pairs[count++] = pairs[i];
+      pairs[i] = kept;
+    }
+  }
+
+  CompletionIndexHeader header = {kCompletionIndexMagic,
+                                  kCompletionIndexVersion, (uint32_t)count, 1,
+                                  mtime};
+  for (size_t i = 0; i < count; i++) {
+    size_t len = strlen(pairs[i]) + 1;
+    header.strings += (uint32_t)(len + strlen(pairs[i] + len) + 1);
+  }
+
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  FILE *out = fopen(tmp, "w");
+  if (!out) {
+    goto index_done;
+  }
+  fwrite(&header, sizeof(header), 1, out);
+  uint32_t offset = 1;  // an empty string first, so the table ends with one
+  for (size_t i = 0; i < count; i++) {
+    size_t len = strlen(pairs[i]) + 1;
+    CompletionIndexEntry entry = {offset, offset + (uint32_t)len};
+    fwrite(&entry, sizeof(entry), 1, out);
+    offset += (uint32_t)(len + strlen(pairs[i] + len) + 1);
+  }
+  fputc('\0', out);
+  for (size_t i = 0; i < count; i++) {
+    size_t len = strlen(pairs[i]) + 1;
+    fwrite(pairs[i], 1, len + strlen(pairs[i] + len) + 1, out);
+  }
+  int failed = ferror(out);
+  if (fclose(out) == 0 && !failed && rename(tmp, path) == 0) {
+    ret = 0;
+  } else {
+    unlink(tmp);
+  }
+
+index_done:
+  if (dp) {
+    closedir(dp);
+  }
+  free(line);
+  FreePathList(da_pairs);
+  return ret;
+}
+
+/**
+ * @brief Orders strings, given pointers to them, with `strcmp`.
+ */
+int CompareStrings(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * @brief Collects the candidates a completion generator prints.
+ *
+ * The generator runs with the command name, the word being completed and
+ * the word before it as arguments, as `complete -F` functions do in bash,
+ * and with `COMP_LINE` and `COMP_POINT` set to the line up to the cursor
+ * and its length. Each line of its output that starts with the word is a
+ * candidate. The time the generator took is added to the spec.
+ *
+ * @param spec       The spec of the command.
+ * @param args       The command name, the word and the previous word.
+ * @param line       The line up to the cursor.
+ * @param candidates Receives the candidates.
+ *
+ * @return 0 on success, or -1 if the generator could not be run.
+ */
+int RunCompletionGenerator(CompletionSpec *spec, char *const args[3],
+                           const char *line, DynamicArray *candidates) {
+  char point[24];
+  snprintf(point, sizeof(point), "%zu", strlen(line));
+  SetShellVariable("COMP_LINE", line);
+  SetShellVariable("COMP_POINT", point);
+
+  double start = MonotonicSeconds();
+  int fds[2] = {-1, -1};
+  DynamicArray *da_args = InitDynamicArray(kDefaultArraySize, sizeof(char *));
+  char *words[] = {spec->generator, args[0], args[1], args[2]};
+  int ret = -1;
+  pid_t pid = -1;
+  for (size_t i = 0; da_args && i < 4; i++) {
+    if (AppendElement(da_args, &words[i]) < 0) {
+      goto generator_done;
+    }
+  }
+  if (!da_args || pipe2(fds, O_CLOEXEC) < 0) {
+    goto generator_done;
+  }
+
+  SpawnAttributes attrs = kDefaultSpawnAttributes;
+  attrs.stdout_fd = fds[1];
+  pid = LaunchProcess(da_args, 0, &attrs);
+  close(fds[1]);
+  FILE *fp = pid > 0 ? fdopen(fds[0], "r") : NULL;
+  if (!fp) {
+    goto generator_done;
+  }
+  fds[0] = -1;
+
+  char *candidate = NULL;
+  size_t cap = 0;
+  size_t len = strlen(args[1]);
+  while (getline(&candidate, &cap, fp) >= 0) {
+    candidate[strcspn(candidate, "\n")] = '\0';
+    char *copy = strncmp(candidate, args[1], len) == 0 ? strdup(candidate)
+                                                       : NULL;
+    if (copy && AppendElement(candidates, &copy) < 0) {
+      free(copy);
+    }
+  }
+  free(candidate);
+  fclose(fp);
+  ret = 0;
+
+generator_done:
+  if (fds[0] >= 0) {
+    close(fds[0]);
+  }
+  if (pid > 0) {
+    waitpid(pid, NULL, 0);
+  }
+  FreeDynamicArray(da_args);
+  UnsetShellVariable("COMP_LINE");
+  UnsetShellVariable("COMP_POINT");
+  spec->last_time = MonotonicSeconds() - start;
+  spec->total_time += spec->last_time;
+  spec->calls++;
+  return ret;
+}
+
+/**
+ * @brief Collects the commands whose names start with a prefix: built-ins
+ *        and executables in the absolute directories of `PATH`.
+ */
+void CollectCommandNames(const char *prefix, DynamicArray *candidates) {
+  size_t len = strlen(prefix);
+  for (const Builtin *b = kBuiltins; b->name; b++) {
+    char *copy = strncmp(b->name, prefix, len) == 0 ? strdup(b->name) : NULL;
+    if (copy && AppendElement(candidates, &copy) < 0) {
+      free(copy);
+    }
+  }
+  LoadedBuiltin *loaded =
+      loaded_builtins ? (LoadedBuiltin *)loaded_builtins->data : NULL;
+  for (size_t i = 0; loaded && i < loaded_builtins->len; i++) {
+    const char *name = loaded[i].builtin.name;
+    char *copy = strncmp(name, prefix, len) == 0 ? strdup(name) : NULL;
+    if (copy && AppendElement(candidates, &copy) < 0) {
+      free(copy);
+    }
+  }
+
+  const char *path = getenv("PATH");
+  char *dirs = path ? strdup(path) : NULL;
+  char *save = NULL;
+  for (char *dir = dirs ? strtok_r(dirs, ":", &save) : NULL; dir;
+       dir = strtok_r(NULL, ":", &save)) {
+    DIR *dp = dir[0] == '/' ? opendir(dir) : NULL;
+    struct dirent *de;
+    while (dp && (de = readdir(dp))) {
+      if (de->d_name[0] == '.' || strncmp(de->d_name, prefix, len) != 0 ||
+          faccessat(dirfd(dp), de->d_name, X_OK, 0) < 0) {
+        continue;
+      }
+      char *copy = strdup(de->d_name);
+      if (copy && AppendElement(candidates, &copy) < 0) {
+        free(copy);
+      }
+    }
+    if (dp) {
+      closedir(dp);
+    }
+  }
+  free(dirs);
+}
+
+/**
+ * @brief Collects the paths starting with a prefix, directories marked
+ *        with a trailing slash.
+ */
+void CollectFileNames(const char *prefix, DynamicArray *candidates) {
+  size_t len = strlen(prefix);
+  char *pattern = malloc(len + 2);
+  glob_t matches;
+  if (!pattern) {
+    return;
+  }
+  memcpy(pattern, prefix, len);
+  strcpy(pattern + len, "*");
+  if (glob(pattern, GLOB_MARK, NULL, &matches) == 0) {
+    for (size_t i = 0; i < matches.gl_pathc; i++) {
+      char *copy = strdup(matches.gl_pathv[i]);
+      if (copy && AppendElement(candidates, &copy) < 0) {
+        free(copy);
+      }
+    }
+    globfree(&matches);
+  }
+  free(pattern);
+}
+
+/**
+ * @brief Completes the word before the cursor of the line being edited.
+ *
+ * A word in command position completes to the names of commands, the
+ * target of a redirection to file names, and arguments of a command with a
+ * completion spec to what its generator prints, file names otherwise. A
+ * single candidate replaces the word, followed by a space unless it is a
+ * directory. Several candidates extend the word by their common prefix
+ * or, if there is none, are listed below the line.
+ *
+ * @param ed  The line editor.
+ * @param out The writer to the terminal.
+ */
+void CompleteWord(LineEditor *ed, TextWriter *out) {
+  size_t start = ed->cursor;
+  while (start > 0 && ed->buf[start - 1] != ' ') {
+    start--;
+  }
+
+  // Find the command of the stage and the word before the cursor's
+  size_t command = SIZE_MAX, prev = SIZE_MAX;
+  for (size_t i = 0; i < start; i++) {
+    if (ed->buf[i] == ' ' || (i > 0 && ed->buf[i - 1] != ' ')) {
+      continue;
+    }
+    prev = i;
+    if (ed->classes[i] == kLexOperator) {
+      command = SIZE_MAX;
+    } else if (ed->classes[i] == kLexCommand) {
+      command = i;
+    }
+  }
+
+  char *word = strndup(ed->buf + start, ed->cursor - start);
+  char *command_name =
+      command != SIZE_MAX
+          ? strndup(ed->buf + command, strcspn(ed->buf + command, " "))
+          : NULL;
+  char *prev_word =
+      prev != SIZE_MAX ? strndup(ed->buf + prev, strcspn(ed->buf + prev, " "))
+                       : strdup("");
+  char *line = strndup(ed->buf, ed->cursor);
+  DynamicArray *candidates = InitDynamicArray(kDefaultArraySize,
+                                              sizeof(char *));
+  if (!word || !prev_word || !line || !candidates ||
+      (command != SIZE_MAX && !command_name)) {
+    goto complete_done;
+  }
+
+  int redirect = prev != SIZE_MAX && ed->classes[prev] == kLexRedirect;
+  CompletionSpec *spec =
+      command_name && !redirect ? FindCompletionSpec(command_name, 1) : NULL;
+  if (!command_name && !redirect && !strchr(word, '/')) {
+    CollectCommandNames(word, candidates);
+  } else if (spec && spec->generator) {
+    char *args[3] = {command_name, word, prev_word};
+    RunCompletionGenerator(spec, args, line, candidates);
+  } else {
+    CollectFileNames(word, candidates);
+  }
+
+  char **names = (char **)candidates->data;
+  qsort(names, candidates->len, sizeof(char *), CompareStrings);
+  size_t unique = 0;
+  for (size_t i = 0; i < candidates->len; i++) {
+    if (unique > 0 && strcmp(names[i], names[unique - 1]) == 0) {
+      free(names[i]);
+    } else {
+      names[unique++] = names[i];
+    }
+  }
+  candidates->len = unique;
+  size_t common = candidates->len > 0 ? strlen(names[0]) : 0;
+  for (size_t i = 1; i < candidates->len; i++) {
+    size_t j = 0;
+    while (j < common && names[i][j] == names[0][j]) {
+      j++;
+    }
+    common = j;
+  }
+
+  size_t len = ed->cursor - start;
+  if (candidates->len == 0) {
+    WriteText(out, "\a", 1);
+  } else if (common > len || candidates->len == 1) {
+    int space = candidates->len == 1 && common > 0 &&
+                names[0][common - 1] != '/';
+    names[0][common] = '\0';
+    if (ReplaceText(ed, start, len, names[0], common) == 0) {
+      ed->cursor = start + common;
+      if (space && ReplaceText(ed, ed->cursor, 0, " ", 1) == 0) {
+        ed->cursor++;
+      }
+    }
+  } else {
+    // List the candidates under the line and draw the prompt again
+    ed->cursor = ed->len;
+    RedrawLine(ed, out);
+    for (size_t i = 0; i < candidates->len; i++) {
+      WriteText(out, i == 0 ? "\n" : "  ", i == 0 ? 1 : 2);
+      WriteText(out, names[i], strlen(names[i]));
+    }
+    WriteText(out, "\n", 1);
+    FlushText(out);
+    PrintPrompt();
+    StartEditedLine(ed, out);
+  }
+
+complete_done:
+  free(word);
+  free(command_name);
+  free(prev_word);
+  free(line);
+  FreePathList(candidates);
+}
+
+/**
+ * @brief Returns the io_uring of the shell, setting it up on first use.
+ *
+ * @return A pointer to the ring, or NULL if the `uring` option is off or the
+ *         kernel does not allow io_uring, in which case epoll and plain
+ *         system calls are used.
+ */
+IoUring *GetIoUring(void) {
+  static IoUring ring = {.fd = -1};
+  static int failed;
+  if (!shell_options[kOptionUring] || failed) {
+    return NULL;
+  }
+  if (ring.fd >= 0) {
+    return ring.owner == getpid() ? &ring : NULL;
+  }
+
+  if (InitIoUring(&ring, kIoUringEntries) < 0) {
+    PrintError("io_uring unavailable, using epoll: %s\n", strerror(errno));
+    failed = 1;
+    return NULL;
+  }
+  return &ring;
+}
+
+/**
+ * @brief Sets up an io_uring with raw system calls and probes whether it
+ *        supports `IORING_OP_WAITID`.
+ *
+ * @return 0 on success, or -1 on error with errno set accordingly.
+ */
+int InitIoUring(IoUring *ring, unsigned entries) {
+  struct io_uring_params params = {0};
+  int fd = (int)syscall(SYS_io_uring_setup, entries, &params);
+  if (fd < 0) {
+    return -1;
+  }
+
+  ring->sq_ring_size =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  int single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    if (ring->cq_ring_size > ring->sq_ring_size) {
+      ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  ring->cq_ring = single_mmap ? ring->sq_ring
+                              : mmap(NULL, ring->cq_ring_size,
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, fd,
+                                     IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+      ring->sqes == MAP_FAILED) {
+    int saved_errno = errno;
+    close(fd);  // The mappings of a failed setup are left to exit
+    errno = saved_errno;
+    return -1;
+  }
+
+  char *sq = ring->sq_ring;
+  char *cq = ring->cq_ring;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  ring->sq_entries = params.sq_entries;
+  ring->queued = ring->in_flight = 0;
+  ring->owner = getpid();
+  ring->fd = fd;
+
+  size_t probe_size = sizeof(struct io_uring_probe) +
+                      256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, probe_size);
+  ring->has_waitid =
+      probe &&
+      syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) ==
+          0 &&
+      probe->last_op >= kIoUringOpWaitid &&
+      (probe->ops[kIoUringOpWaitid].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  return 0;
+}
+
+/**
+ * @brief Claims the next submission queue entry, submitting the queued ones
+ *        first if the queue is full.
+ *
+ * @return A pointer to a zeroed entry, or NULL if the queue stays full.
+ */
+struct io_uring_sqe *GetSqe(IoUring *ring) {
+  unsigned tail = *ring->sq_tail;
+  if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+      ring->sq_entries) {
+    if (SubmitIoUring(ring, 0) < 0 ||
+        tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+            ring->sq_entries) {
+      return NULL;
+    }
+  }
+
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->queued++;
+  ring->in_flight++;
+  return sqe;
+}
+
+/**
+ * @brief Submits the queued entries and waits for completions.
+ *
+ * @param ring    Pointer to the ring.
+ * @param wait_nr Number of completions to wait for, 0 to return at once.
+ *
+ * @return 0 on success, or -1 on error with errno set accordingly.
+ */
+int SubmitIoUring(IoUring *ring, unsigned wait_nr) {
+  int ret = (int)syscall(SYS_io_uring_enter, ring->fd, ring->queued, wait_nr,
+                         wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  if (ret < 0) {
+    return -1;
+  }
+  ring->queued -= (unsigned)ret;
+  return 0;
+}
+
+/**
+ * @brief Processes the available completions. Data read into capture rings
+ *        is accounted for, and reads are queued again until end of file.
+ *
+ * @param ring   Pointer to the ring.
+ * @param until  Tag of the request the caller waits for.
+ * @param result Receives the result of that request.
+ *
+ * @return 1 if that request completed, 0 otherwise.
+ */
+int ReapIoUring(IoUring *ring, uint64_t until, int *result) {
+  int done = 0;
+  unsigned head = *ring->cq_head;
+  while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    uint64_t tag = cqe->user_data;
+    int res = cqe->res;
+    __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+    if (tag == kIoUringTagCancel) {
+      continue;
+    }
+
+    ring->in_flight--;
+    if (tag == until) {
+      *result = res;
+      done = 1;
+    } else if ((tag & kIoUringTagMask) == kIoUringTagPreopen) {
+      if (res >= 0) {
+        close(res);  // opened after PreopenRedirections() gave up on it
+      }
+    } else if (tag > kIoUringTagCancel) {
+      OutputRing *output = (OutputRing *)(uintptr_t)tag;
+      output->reading = 0;
+      if (res > 0) {
+        output->head += (uint64_t)res;
+      } else if (res != -ECANCELED && res != -EINTR) {
+        CloseOutputPipe(output);  // End of file
+      }
+    }
+  }
+  return done;
+}
+
+/**
+ * @brief Queues a read for every capture pipe that has none in flight.
+ */
+void QueueCaptureReads(IoUring *ring) {
+  Job *jobs = job_table ? (Job *)job_table->data : NULL;
+  for (size_t i = 0; jobs && i < job_table->len; i++) {
+    OutputRing *output = jobs[i].output;
+    if (!output || output->fd < 0 || output->reading) {
+      continue;
+    }
+    struct io_uring_sqe *sqe = GetSqe(ring);
+    if (!sqe) {
+      return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = output->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(output->data +
+                                      output->head % output->size);
+    sqe->len = (unsigned)output->size;
+    sqe->off = (uint64_t)-1;  // Current position, as pipes require
+    sqe->user_data = (uint64_t)(uintptr_t)output;
+    output->reading = 1;
+  }
+}
+
+/**
+ * @brief Runs the event loop on the io_uring until a queued request
+ *        completes, reading the output of background jobs meanwhile.
+ *
+ * No request is left in flight on return, so capture rings may be read or
+ * freed afterwards.
+ *
+ * @param ring   Pointer to the ring, with the awaited request queued.
+ * @param until  Tag of the awaited request.
+ * @param result Receives the result of the request.
+ *
+ * @return 0 once the request completed, or -1 on error with errno set
+ *         accordingly (EINTR when interrupted by a signal first).
+ */
+int RunIoUring(IoUring *ring, uint64_t until, int *result) {
+  int done = 0;
+  int error = 0;
+  QueueCaptureReads(ring);
+  while (!done && !error) {
+    if (SubmitIoUring(ring, 1) < 0) {
+      error = errno;
+    }
+    done = ReapIoUring(ring, until, result);
+    QueueCaptureReads(ring);
+  }
+
+  // The awaited request may still complete while being cancelled
+  CancelIoUring(ring, done ? 0 : until);
+  done |= ReapIoUring(ring, until, result);
+  while (ring->in_flight > 0) {
+    if (SubmitIoUring(ring, 1) < 0 && errno != EINTR) {
+      break;
+    }
+    done |= ReapIoUring(ring, until, result);
+  }
+
+  if (!done) {
+    errno = error ? error : EINTR;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Cancels every request in flight. Their completions still have to
+ *        be reaped.
+ *
+ * Requests are cancelled one by one by their `user_data`, since cancelling
+ * any request at once needs Linux 5.19.
+ *
+ * @param ring  Pointer to the ring.
+ * @param until Tag of the awaited request if it is still in flight, or 0.
+ */
+void CancelIoUring(IoUring *ring, uint64_t until) {
+  if (until) {
+    QueueCancel(ring, until);
+  }
+  Job *jobs = job_table ? (Job *)job_table->data : NULL;
+  for (size_t i = 0; jobs && i < job_table->len; i++) {
+    if (jobs[i].output && jobs[i].output->reading) {
+      QueueCancel(ring, (uint64_t)(uintptr_t)jobs[i].output);
+    }
+  }
+  SubmitIoUring(ring, 0);
+}
+
+/**
+ * @brief Queues the cancellation of the request tagged `tag`.
+ */
+void QueueCancel(IoUring *ring, uint64_t tag) {
+  struct io_uring_sqe *sqe = GetSqe(ring);
+  if (!sqe) {
+    return;
+  }
+  ring->in_flight--;  // Cancels are not counted
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = tag;
+  sqe->user_data = kIoUringTagCancel;
+}
+
+/**
+ * @brief Reads from a file descriptor, storing the output of background
+ *        jobs while waiting, through the io_uring or epoll.
+ *
+ * @return The number of bytes read, or -1 on error with errno set
+ *         accordingly.
+ */
+ssize_t ReadInput(int fd, void *buf, size_t len) {
+  IoUring *ring = GetIoUring();
+  struct io_uring_sqe *sqe = ring ? GetSqe(ring) : NULL;
+  if (!sqe) {
+    if (WaitForInput(fd, -1) < 0) {
+      return -1;
+    }
+    return read(fd, buf, len);
+  }
+
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = (unsigned)len;
+  sqe->off = (uint64_t)-1;
+  sqe->user_data = kIoUringTagInput;
+  int res;
+  if (RunIoUring(ring, kIoUringTagInput, &res) < 0) {
+    return -1;
+  }
+  if (res < 0) {
+    errno = -res;
+    return -1;
+  }
+  return res;
+}
+
+/**
+ * @brief Waits until a child process has terminated, without reaping it,
+ *        storing the output of background jobs while waiting.
+ *
+ * Uses `IORING_OP_WAITID` when the io_uring supports it, and otherwise
+ * `waitid`, polled alongside the epoll loop while output is captured.
+ *
+ * @param idtype `P_PID`, `P_PGID` or `P_ALL`, as for `waitid`.
+ * @param id     Process or process group ID.
+ *
+ * @return 0 once a matching child has terminated, or -1 on error with errno
+ *         set accordingly.
+ */
+int WaitForChild(idtype_t idtype, id_t id) {
+  siginfo_t info;
+  IoUring *ring = GetIoUring();
+  struct io_uring_sqe *sqe = ring && ring->has_waitid ? GetSqe(ring) : NULL;
+  if (sqe) {
+    sqe->opcode = kIoUringOpWaitid;
+    sqe->fd = (int)id;
+    sqe->len = idtype;
+    sqe->file_index = WEXITED | WNOWAIT;
+    sqe->addr2 = (uint64_t)(uintptr_t)&info;
+    sqe->user_data = kIoUringTagWait;
+    int res;
+    if (RunIoUring(ring, kIoUringTagWait, &res) < 0) {
+      return -1;
+    }
+    if (res < 0) {
+      errno = -res;
+      return -1;
+    }
+    return 0;
+  }
+
+  int capturing = 0;
+  Job *jobs = job_table ? (Job *)job_table->data : NULL;
+  for (size_t i = 0; jobs && i < job_table->len; i++) {
+    capturing |= jobs[i].output && jobs[i].output->fd >= 0;
+  }
+  if (!capturing) {
+    return waitid(idtype, id, &info, WEXITED | WNOWAIT);
+  }
+
+  for (;;) {
+    info.si_pid = 0;
+    if (waitid(idtype, id, &info, WEXITED | WNOWAIT | WNOHANG) < 0) {
+      return -1;
+    }
+    if (info.si_pid != 0) {
+      return 0;
+    }
+    if (WaitForInput(-1, kCapturePollMs) < 0 && errno != EINTR) {
+      return -1;
+    }
+  }
+}
+
+/**
+ * @brief Opens the redirection targets of a command or pipeline ahead of
+ *        time, in a single io_uring submission, so that slow file systems
+ *        serve the opens concurrently.
+ *
+ * The files are opened close-on-exec and taken by `OpenRedirectTarget()`;
+ * `ClosePreopened()` closes those left over. A target named twice is left
+ * to be opened in order, as are all targets when io_uring is not in use.
+ *
+ * @param stages  The tokenized stages.
+ * @param nstages Number of stages.
+ */
+void PreopenRedirections(DynamicArray **stages, size_t nstages) {
+  IoUring *ring = GetIoUring();
+  if (!ring || !(preopened = InitDynamicArray(kDefaultArraySize,
+                                              sizeof(PreopenedFile)))) {
+    return;
+  }
+
+  for (size_t s = 0; s < nstages; s++) {
+    char **args = (char **)stages[s]->data;
+    for (size_t i = SkipConditionalOperands(args, stages[s]->len);
+         i + 1 < stages[s]->len; i++) {
+      if (GetRedirectType(args[i]) == kNone || IsStreamTarget(args[i + 1])) {
+        continue;
+      }
+      PreopenedFile *files = (PreopenedFile *)preopened->data;
+      size_t j = 0;
+      while (j < preopened->len && strcmp(files[j].target, args[i + 1]) != 0) {
+        j++;
+      }
+      PreopenedFile file = {args[i + 1], -1, 0};
+      if (j == preopened->len && AppendElement(preopened, &file) < 0) {
+        break;
+      }
+      i++;
+    }
+  }
+
+  // Each request is tagged with its index, in tags no pointer can take
+  PreopenedFile *files = (PreopenedFile *)preopened->data;
+  size_t submitted = 0;
+  for (; submitted < preopened->len; submitted++) {
+    char **args = NULL;
+    RedirectType rtype = kNone;
+    for (size_t s = 0; s < nstages && rtype == kNone; s++) {
+      args = (char **)stages[s]->data;
+      for (size_t i = 1; i < stages[s]->len && rtype == kNone; i++) {
+        if (args[i] == files[submitted].target) {
+          rtype = GetRedirectType(args[i - 1]);
+        }
+      }
+    }
+    mode_t mode;
+    struct io_uring_sqe *sqe = GetSqe(ring);
+    if (!sqe) {
+      break;
+    }
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)(uintptr_t)files[submitted].target;
+    sqe->open_flags = (unsigned)RedirectOpenFlags(rtype, &mode) | O_CLOEXEC;
+    sqe->len = mode;
+    sqe->user_data = (uint64_t)submitted << 3 | kIoUringTagPreopen;
+  }
+  preopened->len = submitted;
+
+  // Completions are reaped even when entering the ring fails, as it does
+  // with EBUSY until the completion queue has room again. Should the ring
+  // fail for good, ReapIoUring() closes the files opened afterwards.
+  while (ring->in_flight > 0) {
+    int error = SubmitIoUring(ring, ring->in_flight) < 0 ? errno : 0;
+    unsigned head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+      size_t index = (size_t)(cqe->user_data >> 3);
+      files[index].fd = cqe->res >= 0 ? cqe->res : -1;
+      files[index].error = cqe->res >= 0 ? 0 : -cqe->res;
+      __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+      ring->in_flight--;
+    }
+    if (error && error != EINTR && error != EBUSY && error != EAGAIN) {
+      break;
+    }
+  }
+}
+
+/**
+ * @brief Closes the redirection targets opened ahead of time that were not
+ *        taken.
+ */
+void ClosePreopened(void) {
+  if (!preopened) {
+    return;
+  }
+  PreopenedFile *files = (PreopenedFile *)preopened->data;
+  for (size_t i = 0; i < preopened->len; i++) {
+    if (files[i].fd >= 0) {
+      close(files[i].fd);
+    }
+  }
+  FreeDynamicArray(preopened);
+  preopened = NULL;
+}
+
+/**
+ * @brief Built-in `kill`: sends a signal to jobs or processes.
+ *
+ * Usage: `kill [-s SIG | -SIG] %N|PID...`. The default signal is SIGTERM.
+ * A job is signalled as a whole: every process in its cgroup, or its
+ * process group when it has no cgroup. SIGKILL uses `cgroup.kill`, which
+ * also reaches processes forked while the signal is being delivered. A
+ * queued job is simply dropped from the queue.
+ *
+ * @return 0 on success, 1 if a target could not be signalled, or 2 on a
+ *         usage error.
+ */
+int BuiltinKill(int argc, char **argv, int status __attribute__((unused))) {
+  int sig = SIGTERM;
+  int i = 1;
+  if (argc > 2 && strcmp(argv[1], "-s") == 0) {
+    sig = ParseSignal(argv[2]);
+    i = 3;
+  } else if (argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0') {
+    sig = ParseSignal(argv[1] + 1);
+    i = 2;
+  }
+  if (sig < 0) {
+    fprintf(stderr, "kill: %s: invalid signal\n", argv[i - 1]);
+    return 2;
+  }
+  if (i >= argc) {
+    fprintf(stderr, "usage: kill [-s SIG | -SIG] %%N|PID...\n");
+    return 2;
+  }
+
+  int ret = 0;
+  for (; i < argc; i++) {
+    if (argv[i][0] == '%') {
+      Job *job = FindJob(argv[i]);
+      if (!job) {
+        fprintf(stderr, "kill: %s: no such job\n", argv[i]);
+        ret = 1;
+      } else if (SignalJob(job, sig) < 0) {
+        fprintf(stderr, "kill: %s: %s\n", argv[i], strerror(errno));
+        ret = 1;
+      }
+      continue;
+    }
+
+    char *end;
+    long pid = strtol(argv[i], &end, 10);
+    if (*end != '\0' || end == argv[i]) {
+      fprintf(stderr, "kill: %s: invalid process ID\n", argv[i]);
+      ret = 1;
+    } else if (kill((pid_t)pid, sig) < 0) {
+      fprintf(stderr, "kill: %s: %s\n", argv[i], strerror(errno));
+      ret = 1;
+    }
+  }
+  return ret;
+}
+
+/**
+ * @brief Built-in `limit`: sets the cgroup memory and CPU limits of jobs.
+ *
+ * Usage: `limit [-m BYTES|max] [-c CPUS|max] [%N...]`. BYTES may carry a
+ * K, M or G suffix, and CPUS may be fractional. With jobs, the limits are
+ * written to their cgroups at once, or kept until a queued job starts;
+ * otherwise they become the defaults for new background jobs. Without
+ * options, the limits in effect are shown.
+ *
+ * @return 0 on success, 1 if the limits could not be applied, or 2 on a
+ *         usage error.
+ */
+int BuiltinLimit(int argc, char **argv, int status __attribute__((unused))) {
+  JobLimits limits = {0};
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; i += 2) {
+    int ret = -1;
+    if (i + 1 < argc && strcmp(argv[i], "-m") == 0) {
+      ret = ParseMemoryMax(argv[i + 1], limits.memory_max,
+                           sizeof(limits.memory_max));
+    } else if (i + 1 < argc && strcmp(argv[i], "-c") == 0) {
+      ret = ParseCpuMax(argv[i + 1], limits.cpu_max, sizeof(limits.cpu_max));
+    }
+    if (ret < 0) {
+      fprintf(stderr, "usage: limit [-m BYTES|max] [-c CPUS|max] [%%N...]\n");
+      return 2;
+    }
+  }
+  int set = limits.memory_max[0] || limits.cpu_max[0];
+
+  if (OpenCgroupRoot() < 0) {
+    fprintf(stderr, "limit: no delegated cgroup v2 subtree\n");
+    return 1;
+  }
+
+  if (i == argc) {
+    if (limits.memory_max[0]) {
+      strcpy(default_limits.memory_max, limits.memory_max);
+    }
+    if (limits.cpu_max[0]) {
+      strcpy(default_limits.cpu_max, limits.cpu_max);
+    }
+    if (!set) {
+      PrintJobLimits("default", &default_limits);
+    }
+    return 0;
+  }
+
+  int ret = 0;
+  for (; i < argc; i++) {
+    Job *job = FindJob(argv[i]);
+    if (!job) {
+      fprintf(stderr, "limit: %s: no such job\n", argv[i]);
+      ret = 1;
+      continue;
+    }
+    if (!set) {
+      PrintJobLimits(argv[i], &job->limits);
+      continue;
+    }
+
+    if (limits.memory_max[0]) {
+      strcpy(job->limits.memory_max, limits.memory_max);
+    }
+    if (limits.cpu_max[0]) {
+      strcpy(job->limits.cpu_max, limits.cpu_max);
+    }
+    if (!job->queued && job->cgroup_fd < 0) {
+      fprintf(stderr, "limit: %s: job has no cgroup\n", argv[i]);
+      ret = 1;
+    } else if (ApplyJobLimits(job) < 0) {
+      ret = 1;
+    }
+  }
+  return ret;
+}
+
+/**
+ * @brief Prints a set of job limits as `limit` shows them.
+ */
+void PrintJobLimits(const char *label, const JobLimits *limits) {
+  printf("%s: memory.max=%s cpu.max=%s\n", label,
+         limits->memory_max[0] ? limits->memory_max : "max",
+         limits->cpu_max[0] ? limits->cpu_max : "max");
+}
+
+/**
+ * @brief Opens the cgroup v2 directory under which jobs get their cgroups.
+ *
+ * This is the shell's own cgroup, provided the shell may create cgroups
+ * and move processes there, as in a delegated subtree. The available
+ * controllers among `kCgroupControllers` are enabled for the job cgroups.
+ * Since controllers cannot be enabled for the children of a cgroup that
+ * has processes of its own, the shell first moves itself into a leaf
+ * cgroup when needed, which is removed at exit (see RemoveCgroupLeaf()).
+ * Probing happens once.
+ *
+ * @return A directory file descriptor, or -1 if there is no delegation.
+ */
+int OpenCgroupRoot(void) {
+  static int root_fd = -2;
+  if (root_fd != -2) {
+    return root_fd;
+  }
+  root_fd = -1;
+
+  // The cgroup2 mount point, and the shell's cgroup relative to it
+  char line[kInputMax], mount[kPathMax], path[kPathMax];
+  mount[0] = path[0] = '\0';
+  FILE *fp = fopen("/proc/self/mountinfo", "re");
+  while (fp && fgets(line, sizeof(line), fp)) {
+    if (strstr(line, " - cgroup2 ") &&
+        sscanf(line, "%*s %*s %*s %*s %511s", mount) == 1) {
+      break;
+    }
+    mount[0] = '\0';
+  }
+  if (fp) {
+    fclose(fp);
+  }
+  fp = fopen("/proc/self/cgroup", "re");
+  while (fp && fgets(line, sizeof(line), fp)) {
+    if (strncmp(line, "0::", 3) == 0) {
+      line[strcspn(line, "\n")] = '\0';
+      snprintf(path, sizeof(path), "%s", line + 3);
+    }
+  }
+  if (fp) {
+    fclose(fp);
+  }
+  if (mount[0] == '\0' || path[0] != '/') {
+    return -1;
+  }
+
+  char dir[kPathMax * 2];
+  snprintf(dir, sizeof(dir), "%s%s", mount, path);
+  int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  if (faccessat(fd, ".", W_OK, 0) < 0 ||
+      faccessat(fd, "cgroup.procs", W_OK, 0) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  char available[256], control[16];
+  if (ReadFileAt(fd, "cgroup.controllers", available, sizeof(available)) < 0) {
+    available[0] = '\0';
+  }
+  for (size_t i = 0; kCgroupControllers[i]; i++) {
+    char *word = strstr(available, kCgroupControllers[i]);
+    size_t len = strlen(kCgroupControllers[i]);
+    if (!word || (word[len] != '\0' && word[len] != ' ' && word[len] != '\n')) {
+      continue;
+    }
+    snprintf(control, sizeof(control), "+%s", kCgroupControllers[i]);
+    int enabled = WriteFileAt(fd, "cgroup.subtree_control", control) == 0;
+    if (!enabled && errno == EBUSY && !cgroup_leaf[0]) {
+      char leaf[32], procs[48], pid[16];
+      snprintf(leaf, sizeof(leaf), "shell.%d", (int)getpid());
+      snprintf(procs, sizeof(procs), "%s/cgroup.procs", leaf);
+      snprintf(pid, sizeof(pid), "%d", (int)getpid());
+      if (mkdirat(fd, leaf, 0755) < 0 && errno != EEXIST) {
+        break;  // Jobs still get cgroups, only without controllers
+      }
+      if (WriteFileAt(fd, procs, pid) < 0) {
+        unlinkat(fd, leaf, AT_REMOVEDIR);
+        break;
+      }
+      strcpy(cgroup_leaf, leaf);
+      cgroup_owner = getpid();
+      atexit(RemoveCgroupLeaf);
+      enabled = WriteFileAt(fd, "cgroup.subtree_control", control) == 0;
+    }
+    if (enabled) {
+      strcat(cgroup_enabled, control + 1);
+      strcat(cgroup_enabled, " ");
+    }
+  }
+
+  root_fd = fd;
+  return root_fd;
+}
+
+/**
+ * @brief Moves the shell back out of its leaf cgroup and removes the leaf,
+ *        at exit.
+ *
+ * The shell's own cgroup may hold processes again only once the
+ * controllers enabled for jobs are disabled, so this is skipped while jobs
+ * still run in cgroups of their own, which would lose their limits.
+ */
+void RemoveCgroupLeaf(void) {
+  if (getpid() != cgroup_owner) {
+    return;  // a child process calling exit()
+  }
+  Job *jobs = job_table ? (Job *)job_table->data : NULL;
+  for (size_t i = 0; jobs && i < job_table->len; i++) {
+    if (jobs[i].running > 0 && jobs[i].cgroup_fd >= 0) {
+      return;
+    }
+    RemoveJobCgroup(&jobs[i]);
+  }
+
+  int fd = OpenCgroupRoot();
+  char control[16], pid[16];
+  char *saveptr;
+  for (char *name = strtok_r(cgroup_enabled, " ", &saveptr); name;
+       name = strtok_r(NULL, " ", &saveptr)) {
+    snprintf(control, sizeof(control), "-%s", name);
+    WriteFileAt(fd, "cgroup.subtree_control", control);
+  }
+  snprintf(pid, sizeof(pid), "%d", (int)getpid());
+  if (WriteFileAt(fd, "cgroup.procs", pid) == 0) {
+    unlinkat(fd, cgroup_leaf, AT_REMOVEDIR);
+  }
+}
+
+/**
+ * @brief Creates the cgroup of a job and applies its limits.
+ *
+ * @return 0 on success, or -1 if the job gets no cgroup.
+ */
+int CreateJobCgroup(Job *job) {
+  static unsigned int sequence;
+  int root_fd = OpenCgroupRoot();
+  if (root_fd < 0) {
+    return -1;
+  }
+
+  snprintf(job->cgroup, sizeof(job->cgroup), "job.%d.%u", (int)getpid(),
+           ++sequence);
+  if (mkdirat(root_fd, job->cgroup, 0755) < 0) {
+    PrintError("cgroup %s: %s\n", job->cgroup, strerror(errno));
+    return -1;
+  }
+  job->cgroup_fd = openat(root_fd, job->cgroup,
+                          O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (job->cgroup_fd < 0) {
+    unlinkat(root_fd, job->cgroup, AT_REMOVEDIR);
+    return -1;
+  }
+  ApplyJobLimits(job);
+  return 0;
+}
+
+/**
+ * @brief Writes the limits of a started job to its cgroup. Limits of a
+ *        queued job are applied when it starts.
+ *
+ * @return 0 on success, or -1 if a limit could not be written.
+ */
+int ApplyJobLimits(Job *job) {
+  if (job->cgroup_fd < 0) {
+    return 0;
+  }
+
+  const char *files[] = {"memory.max", "cpu.max"};
+  const char *values[] = {job->limits.memory_max, job->limits.cpu_max};
+  int ret = 0;
+  for (size_t i = 0; i < 2; i++) {
+    if (values[i][0] && WriteFileAt(job->cgroup_fd, files[i], values[i]) < 0) {
+      fprintf(stderr, "shell: job %d: %s: %s\n", job->id, files[i],
+              errno == ENOENT ? "controller not available" : strerror(errno));
+      ret = -1;
+    }
+  }
+  return ret;
+}
+
+/**
+ * @brief Removes the cgroup of a finished job.
+ *
+ * The cgroup stays behind if processes that left the job's process group
+ * still run in it.
+ */
+void RemoveJobCgroup(Job *job) {
+  if (job->cgroup_fd < 0) {
+    return;
+  }
+  close(job->cgroup_fd);
+  job->cgroup_fd = -1;
+  unlinkat(OpenCgroupRoot(), job->cgroup, AT_REMOVEDIR);
+}
+
+/**
+ * @brief Sends a signal to every process of a job.
+ *
+ * @return 0 on success, or -1 on error with errno set accordingly.
+ */
+int SignalJob(Job *job, int sig) {
+  if (job->queued) {
+    job->queued = 0;
+    job->status = 128 + sig;
+    return 0;
+  }
+  if (job->cgroup_fd < 0) {
+    return killpg(job->pgid, sig);
+  }
+  if (sig == SIGKILL && WriteFileAt(job->cgroup_fd, "cgroup.kill", "1") == 0) {
+    return 0;
+  }
+
+  int fd = openat(job->cgroup_fd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+  FILE *fp = fd >= 0 ? fdopen(fd, "r") : NULL;
+  if (!fp) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return killpg(job->pgid, sig);
+  }
+  int pid;
+  while (fscanf(fp, "%d", &pid) == 1) {
+    kill(pid, sig);
+  }
+  fclose(fp);
+  return 0;
+}
+
+/**
+ * @brief Reads the CPU time, memory and I/O of a job so far.
+ *
+ * With a cgroup, these cover every process that ever ran in the job.
+ * Otherwise, they cover only the processes of its process group that are
+ * still running, with memory being their resident set size.
+ *
+ * @param job   Pointer to the job.
+ * @param usage Receives the figures; those unavailable are set to -1.
+ */
+void ReadJobUsage(const Job *job, JobUsage *usage) {
+  usage->cpu_us = usage->memory_bytes = usage->io_bytes = -1;
+  if (job->queued) {
+    return;
+  }
+  if (job->cgroup_fd < 0) {
+    ReadGroupUsage(job->pgid, usage);
+    return;
+  }
+
+  char buf[kInputMax];
+  char *line;
+  if (ReadFileAt(job->cgroup_fd, "cpu.stat", buf, sizeof(buf)) == 0 &&
+      (line = strstr(buf, "usage_usec "))) {
+    usage->cpu_us = strtoll(line + 11, NULL, 10);
+  }
+  if (ReadFileAt(job->cgroup_fd, "memory.current", buf, sizeof(buf)) == 0) {
+    usage->memory_bytes = strtoll(buf, NULL, 10);
+  }
+
+  // One line per device: "MAJ:MIN rbytes=N wbytes=N rios=N ..."
+  if (ReadFileAt(job->cgroup_fd, "io.stat", buf, sizeof(buf)) == 0) {
+    usage->io_bytes = 0;
+    for (line = buf; (line = strstr(line, "bytes=")); line += 6) {
+      if (line > buf && (line[-1] == 'r' || line[-1] == 'w')) {
+        usage->io_bytes += strtoll(line + 6, NULL, 10);
+      }
+    }
+  }
+}
+
+/**
+ * @brief Sums the CPU time, resident memory and I/O of the running
+ *        processes of a process group.
+ */
+void ReadGroupUsage(pid_t pgid, JobUsage *usage) {
+  DIR *dir = opendir("/proc");
+  if (!dir) {
+    return;
+  }
+  usage->cpu_us = usage->memory_bytes = usage->io_bytes = 0;
+  long ticks = sysconf(_SC_CLK_TCK);
+  long page_size = sysconf(_SC_PAGESIZE);
+
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (entry->d_name[0] < '1' || entry->d_name[0] > '9') {
+      continue;
+    }
+
+    // The command name may contain spaces, so fields are counted from the
+    // closing parenthesis
+    char path[64], buf[kInputMax];
+    snprintf(path, sizeof(path), "/proc/%.16s/stat", entry->d_name);
+    char *fields = ReadSysfsFile(path, buf, sizeof(buf)) == 0
+                       ? strrchr(buf, ')')
+                       : NULL;
+    int group;
+    unsigned long long utime, stime;
+    long long rss;
+    if (!fields ||
+        sscanf(fields + 1,
+               " %*c %*d %d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %*d %*d "
+               "%*d %*d %*d %*d %*u %*u %lld",
+               &group, &utime, &stime, &rss) != 4 ||
+        group != pgid) {
+      continue;
+    }
+    usage->cpu_us += (long long)((utime + stime) * 1000000ULL / ticks);
+    usage->memory_bytes += rss * page_size;
+
+    snprintf(path, sizeof(path), "/proc/%.16s/io", entry->d_name);
+    if (ReadFileAt(AT_FDCWD, path, buf, sizeof(buf)) == 0) {
+      char *line = strstr(buf, "\nread_bytes: ");
+      usage->io_bytes += line ? strtoll(line + 13, NULL, 10) : 0;
+      line = strstr(buf, "\nwrite_bytes: ");
+      usage->io_bytes += line ? strtoll(line + 14, NULL, 10) : 0;
+    }
+  }
+  closedir(dir);
+}
+
+/**
+ * @brief Validates a memory limit and converts it to a `memory.max` value.
+ *
+ * @return 0 on success, or -1 if the limit is malformed.
+ */
+int ParseMemoryMax(const char *str, char *buf, size_t size) {
+  if (strcmp(str, "max") != 0) {
+    // The kernel itself accepts K, M and G suffixes
+    size_t digits = strspn(str, "0123456789");
+    if (digits == 0 || (str[digits] != '\0' &&
+                        (!strchr("KMGkmg", str[digits]) ||
+                         str[digits + 1] != '\0'))) {
+      return -1;
+    }
+  }
+  snprintf(buf, size, "%s", str);
+  return 0;
+}
+
+/**
+ * @brief Converts a CPU limit, as a possibly fractional number of CPUs, to
+ *        a `cpu.max` value.
+ *
+ * @return 0 on success, or -1 if the limit is malformed.
+ */
+int ParseCpuMax(const char *str, char *buf, size_t size) {
+  if (strcmp(str, "max") == 0) {
+    snprintf(buf, size, "max %lld", kCpuMaxPeriod);
+    return 0;
+  }
+
+  char *end;
+  double cpus = strtod(str, &end);
+  long long quota = (long long)(cpus * kCpuMaxPeriod);
+  if (end == str || *end != '\0' || quota < 1000) {
+    return -1;  // The kernel rejects quotas below 1ms
+  }
+  snprintf(buf, size, "%lld %lld", quota, kCpuMaxPeriod);
+  return 0;
+}
+
+/**
+ * @brief Formats a byte count with a binary unit, or `-` if unknown.
+ */
+void FormatBytes(char *buf, size_t size, long long bytes) {
+  const char *units = "BKMGT";
+  double value = (double)bytes;
+  if (bytes < 0) {
+    snprintf(buf, size, "-");
+    return;
+  }
+  while (value >= 1024 && units[1]) {
+    value /= 1024;
+    units++;
+  }
+  snprintf(buf, size, *units == 'B' ? "%.0f%c" : "%.1f%c", value, *units);
+}
+
+/**
+ * @brief Reads a whole (small) file relative to a directory.
+ *
+ * @return 0 on success, or -1 on error with errno set accordingly.
+ */
+int ReadFileAt(int dir_fd, const char *path, char *buf, size_t size) {
+  int fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  size_t len = 0;
+  ssize_t nread;
+  while (len + 1 < size && (nread = read(fd, buf + len, size - len - 1)) > 0) {
+    len += (size_t)nread;
+  }
+  close(fd);
+  buf[len] = '\0';
+  return 0;
+}
+
+/**
+ * @brief Writes a value to a file relative to a directory, as done for
+ *        cgroup control files. Safe to call in a forked child.
+ *
+ * @return 0 on success, or -1 on error with errno set accordingly.
+ */
+int WriteFileAt(int dir_fd, const char *path, const char *value) {
+  int fd = openat(dir_fd, path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  ssize_t written = write(fd, value, strlen(value));
+  int saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  return written < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Returns the value of a shell variable.
+ *
+ * Local variables are looked up first. Other variables are kept in the
+ * environment, and so are passed on to every command the shell runs. Values
+ * stay valid until the next command line.
+ *
+ * @return The value, or NULL if the variable is unset.
+ */
+const char *GetShellVariable(const char *name) {
+  pthread_mutex_lock(&variables_lock);
+  uint64_t hash = HashBytes(kFnvOffsetBasis, name, strlen(name));
+  Variable *var = LookupVariable(*CurrentScope(), name, hash);
+  const char *value = var ? VariableValue(var) : getenv(name);
+  pthread_mutex_unlock(&variables_lock);
+  return value;
+}
+
+/**
+ * @brief Sets a shell variable.
+ *
+ * A local variable is changed where it was declared. Like those of a
+ * subshell, assignments made by the stages of an in-process pipeline other
+ * than the last one only bind the variable in their own snapshot, which is
+ * discarded with them.
+ *
+ * @return 0 on success, or -1 on error with errno set accordingly (EINVAL
+ *         if the name is empty or contains `=`).
+ */
+int SetShellVariable(const char *name, const char *value) {
+  if (!name || !*name || strchr(name, '=') || !value) {
+    errno = EINVAL;
+    return -1;
+  }
+  pthread_mutex_lock(&variables_lock);
+  int ret = ChangeVariable(name, value);
+  pthread_mutex_unlock(&variables_lock);
+  return ret;
+}
+
+/**
+ * @brief Unsets a shell variable.
+ *
+ * @return 0 on success, or -1 on error with errno set accordingly.
+ */
+int UnsetShellVariable(const char *name) {
+  if (!name || !*name || strchr(name, '=')) {
+    errno = EINVAL;
+    return -1;
+  }
+  pthread_mutex_lock(&variables_lock);
+  int ret = ChangeVariable(name, NULL);
+  pthread_mutex_unlock(&variables_lock);
+  return ret;
+}
+
+/**
+ * @brief Assigns or unsets a variable for the calling thread.
+ *
+ * A binding of the thread's scope that the thread made itself is changed
+ * in place. One made by another thread, or any variable on a pipeline
+ * stage thread, is bound anew in the thread's snapshot. Anything else is an
+ * environment variable. The caller holds `variables_lock`.
+ *
+ * @param value New value, or NULL to unset the variable.
+ *
+ * @return 0 on success, or -1 on error with errno set accordingly.
+ */
+int ChangeVariable(const char *name, const char *value) {
+  uint64_t hash = HashBytes(kFnvOffsetBasis, name, strlen(name));
+  Variable *var = LookupVariable(*CurrentScope(), name, hash);
+  if (var && var->owner == scope_owner) {
+    return AssignVariable(var, value);
+  }
+  if (var || in_pipeline_thread) {
+    return BindVariable(name, value);
+  }
+  if (strcmp(name, "PATH") == 0) {
+    path_generation++;
+  }
+  return value ? setenv(name, value, 1) : unsetenv(name);
+}
+
+/**
+ * @brief Returns the root of the local variables seen by the calling thread.
+ *
+ * Stages of in-process pipelines other than the last one work on their own
+ * snapshot, as a subshell would.
+ */
+ScopeNode **CurrentScope(void) {
+  return in_pipeline_thread ? &stage_scope : &shell_scope;
+}
+
+/**
+ * @brief Takes a reference to a scope map.
+ *
+ * @return The node, which may be NULL for an empty map.
+ */
+ScopeNode *RetainScope(ScopeNode *node) {
+  if (node) {
+    __atomic_fetch_add(&node->refs, 1, __ATOMIC_RELAXED);
+  }
+  return node;
+}
+
+/**
+ * @brief Drops a reference to a scope map, freeing the nodes and bindings
+ *        no other map shares.
+ */
+void ReleaseScope(ScopeNode *node) {
+  if (!node || __atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+    return;
+  }
+  size_t i = 0;
+  for (uint32_t bits = node->bitmap; bits; bits &= bits - 1, i++) {
+    if (node->leaves & bits & -bits) {
+      ReleaseVariable(node->slots[i]);
+    } else {
+      ReleaseScope(node->slots[i]);
+    }
+  }
+  free(node);
+}
+
+/**
+ * @brief Drops a reference to a binding, freeing it with the last one.
+ */
+void ReleaseVariable(Variable *var) {
+  if (var && __atomic_sub_fetch(&var->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(var->value);
+    free(var->snapshot_value);
+    free(var);
+  }
+}
+
+/**
+ * @brief Finds the binding of a name in a scope map.
+ *
+ * Each level of the trie is indexed by the next kScopeHashBits bits of the
+ * hash. Below the last level, names whose hashes are equal throughout are
+ * kept in a plain list.
+ *
+ * @return The binding, or NULL if the name is not bound.
+ */
+Variable *LookupVariable(const ScopeNode *node, const char *name,
+                         uint64_t hash) {
+  for (unsigned shift = 0; node; shift += kScopeHashBits) {
+    if (shift >= 64) {
+      for (int i = 0; i < __builtin_popcount(node->bitmap); i++) {
+        Variable *var = node->slots[i];
+        if (strcmp(var->name, name) == 0) {
+          return var;
+        }
+      }
+      return NULL;
+    }
+
+    uint32_t bit = 1u << ((hash >> shift) & 31);
+    if (!(node->bitmap & bit)) {
+      return NULL;
+    }
+    void *slot = node->slots[__builtin_popcount(node->bitmap & (bit - 1))];
+    if (node->leaves & bit) {
+      Variable *var = slot;
+      return var->hash == hash && strcmp(var->name, name) == 0 ? var : NULL;
+    }
+    node = slot;
+  }
+  return NULL;
+}
+
+/**
+ * @brief Returns a scope map with a binding added or replaced.
+ *
+ * Only the nodes on the path to the binding are copied; the rest, and the
+ * given map, are shared with the result.
+ *
+ * @param node  Root of the map, or NULL for an empty one.
+ * @param var   Binding to add. The result takes its own reference.
+ * @param shift Number of hash bits used by the levels above, 0 for a root.
+ *
+ * @return The root of the new map, with a reference owned by the caller, or
+ *         NULL on error with errno set accordingly.
+ */
+ScopeNode *InsertVariable(const ScopeNode *node, Variable *var,
+                          unsigned shift) {
+  uint32_t bitmap = node ? node->bitmap : 0;
+  uint32_t bit;
+  void *slot = var;
+  int leaf = 1;
+  if (shift >= 64) {
+    int n = __builtin_popcount(bitmap), i = 0;
+    while (i < n && strcmp(((Variable *)node->slots[i])->name, var->name)) {
+      i++;
+    }
+    if (i == 32) {
+      errno = ENOSPC;
+      return NULL;
+    }
+    bit = 1u << i;
+  } else {
+    bit = 1u << ((var->hash >> shift) & 31);
+  }
+
+  size_t at = (size_t)__builtin_popcount(bitmap & (bit - 1));
+  int replace = (bitmap & bit) != 0;
+  if (replace && shift < 64) {
+    if (!(node->leaves & bit)) {
+      slot = InsertVariable(node->slots[at], var, shift + kScopeHashBits);
+      leaf = 0;
+    } else {
+      Variable *old = node->slots[at];
+      if (old->hash != var->hash || strcmp(old->name, var->name) != 0) {
+        // Both move down a level, where their hashes may differ
+        ScopeNode *pair = InsertVariable(NULL, old, shift + kScopeHashBits);
+        slot = pair ? InsertVariable(pair, var, shift + kScopeHashBits) : NULL;
+        ReleaseScope(pair);
+        leaf = 0;
+      }
+    }
+    if (!slot) {
+      return NULL;
+    }
+  }
+
+  size_t count = (size_t)__builtin_popcount(bitmap) + !replace;
+  ScopeNode *copy = malloc(sizeof(ScopeNode) + count * sizeof(void *));
+  if (!copy) {
+    if (!leaf) {
+      ReleaseScope(slot);
+    }
+    return NULL;
+  }
+  copy->refs = 1;
+  copy->bitmap = bitmap | bit;
+  copy->leaves = node ? node->leaves : 0;
+  copy->leaves = leaf ? copy->leaves | bit : copy->leaves & ~bit;
+
+  size_t i = 0;
+  for (uint32_t bits = bitmap; bits; bits &= bits - 1, i++) {
+    uint32_t b = bits & -bits;
+    if (b == bit) {
+      continue;
+    }
+    copy->slots[i + (!replace && b > bit)] = node->slots[i];
+    if (node->leaves & b) {
+      __atomic_fetch_add(&((Variable *)node->slots[i])->refs, 1,
+                         __ATOMIC_RELAXED);
+    } else {
+      RetainScope(node->slots[i]);
+    }
+  }
+  copy->slots[at] = slot;
+  if (leaf) {
+    __atomic_fetch_add(&var->refs, 1, __ATOMIC_RELAXED);
+  }
+  return copy;
+}
+
+/**
+ * @brief Binds a name in the scope of the calling thread, hiding any
+ *        binding it had there or in the environment.
+ *
+ * The caller holds `variables_lock`.
+ *
+ * @param value Initial value, or NULL to leave the variable unset.
+ *
+ * @return 0 on success, or -1 on error with errno set accordingly.
+ */
+int BindVariable(const char *name, const char *value) {
+  size_t len = strlen(name);
+  Variable *var = malloc(sizeof(Variable) + len + 1);
+  if (!var) {
+    return -1;
+  }
+  var->refs = 1;
+  var->hash = HashBytes(kFnvOffsetBasis, name, len);
+  var->owner = scope_owner;
+  var->value = value ? strdup(value) : NULL;
+  var->snapshot_value = NULL;
+  var->changed_in = 0;
+  memcpy(var->name, name, len + 1);
+
+  ScopeNode **scope = CurrentScope();
+  ScopeNode *root =
+      value && !var->value ? NULL : InsertVariable(*scope, var, 0);
+  ReleaseVariable(var);
+  if (!root) {
+    return -1;
+  }
+  ReleaseScope(*scope);
+  *scope = root;
+  return 0;
+}
+
+/**
+ * @brief Changes the value of a binding in place.
+ *
+ * The previous value stays valid until the next command line, as built-ins
+ * may still hold it. The binding may also be shared with the snapshots of
+ * the stages of a running in-process pipeline: the shell thread then keeps
+ * the value they were taken with, which is what those stages go on seeing
+ * (see VariableValue()). The caller holds `variables_lock`.
+ *
+ * @param value New value, or NULL to unset the variable.
+ *
+ * @return 0 on success, or -1 on error with errno set accordingly.
+ */
+int AssignVariable(Variable *var, const char *value) {
+  char *copy = NULL;
+  if (value && !(copy = strdup(value))) {
+    return -1;
+  }
+
+  int keep = !in_pipeline_thread && snapshot_generation &&
+             var->changed_in != snapshot_generation;
+  char *retired = keep ? var->snapshot_value : var->value;
+  if (retired &&
+      ((!retired_values &&
+        !(retired_values = InitDynamicArray(kDefaultArraySize,
+                                            sizeof(char *)))) ||
+       AppendElement(retired_values, &retired) < 0)) {
+    free(copy);
+    return -1;
+  }
+  if (keep) {
+    var->snapshot_value = var->value;
+    var->changed_in = snapshot_generation;
+  }
+  var->value = copy;
+  return 0;
+}
+
+/**
+ * @brief Returns the value of a binding as the calling thread sees it.
+ *
+ * Stages of a running in-process pipeline see the value their snapshot was
+ * taken with, even if the shell thread has changed it since.
+ */
+const char *VariableValue(const Variable *var) {
+  if (in_pipeline_thread && snapshot_generation &&
+      var->changed_in == snapshot_generation) {
+    return var->snapshot_value;
+  }
+  return var->value;
+}
+
+/**
+ * @brief Frees the values replaced or unset since the last command line.
+ *
+ * Called between command lines, when no built-in holds a value.
+ */
+void FreeRetiredValues(void) {
+  for (size_t i = 0; retired_values && i < retired_values->len; i++) {
+    free(((char **)retired_values->data)[i]);
+  }
+  if (retired_values) {
+    retired_values->len = 0;
+  }
+}
+
+/**
+ * @brief Declares a local variable in the current scope.
+ *
+ * @param value Initial value, or NULL to declare it unset.
+ *
+ * @return 0 on success, or -1 on error with errno set accordingly.
+ */
+int DeclareLocal(const char *name, const char *value) {
+  pthread_mutex_lock(&variables_lock);
+  int ret = BindVariable(name, value);
+  pthread_mutex_unlock(&variables_lock);
+  return ret;
+}
+
+/**
+ * @brief Enters a new scope for local variables, as `source` does.
+ *
+ * Nothing is copied: the new scope starts as the map of the current one,
+ * and diverges from it only as variables are declared.
+ *
+ * @return The map to restore with PopScope().
+ */
+ScopeNode *PushScope(void) {
+  pthread_mutex_lock(&variables_lock);
+  ScopeNode *saved = RetainScope(shell_scope);
+  scope_depth++;
+  pthread_mutex_unlock(&variables_lock);
+  return saved;
+}
+
+/**
+ * @brief Leaves the current scope, dropping the variables it declared.
+ *
+ * @param saved Map returned by the matching PushScope().
+ */
+void PopScope(ScopeNode *saved) {
+  pthread_mutex_lock(&variables_lock);
+  ReleaseScope(shell_scope);
+  shell_scope = saved;
+  scope_depth--;
+  pthread_mutex_unlock(&variables_lock);
+}
+
+/**
+ * @brief Prints the local variables of a scope map, one `NAME=VALUE` per
+ *        line, or just `NAME` for those declared unset.
+ */
+void PrintVariables(const ScopeNode *node) {
+  size_t i = 0;
+  for (uint32_t bits = node ? node->bitmap : 0; bits; bits &= bits - 1, i++) {
+    if (!(node->leaves & bits & -bits)) {
+      PrintVariables(node->slots[i]);
+      continue;
+    }
+    const Variable *var = node->slots[i];
+    if (var->value) {
+      printf("%s=%s\n", var->name, var->value);
+    } else {
+      printf("%s\n", var->name);
+    }
+  }
+}
+
+/**
+ * @brief Built-in `local`: declares variables local to a sourced file.
+ *
+ * Usage: `local NAME[=VALUE]...`. The variables hide those of the same name
+ * until the file being sourced ends; files it sources in turn see them, and
+ * assignments there change them. Local variables are not passed to the
+ * commands the shell runs. Without operands, lists the local variables
+ * currently visible.
+ *
+ * @return 0 on success, 1 if used outside a sourced file or a variable
+ *         could not be declared, or 2 if a name is invalid.
+ */
+int BuiltinLocal(int argc, char **argv, int status __attribute__((unused))) {
+  if (argc == 1) {
+    pthread_mutex_lock(&variables_lock);
+    PrintVariables(shell_scope);
+    pthread_mutex_unlock(&variables_lock);
+    return 0;
+  }
+  if (scope_depth == 0) {
+    fprintf(stderr, "local: can only be used in a sourced file\n");
+    return 1;
+  }
+
+  int ret = 0;
+  for (int i = 1; i < argc; i++) {
+    const char *value = strchr(argv[i], '=');
+    char *name = strndup(argv[i], value ? (size_t)(value - argv[i])
+                                        : strlen(argv[i]));
+    if (!name) {
+      fprintf(stderr, "local: %s\n", strerror(errno));
+      return 1;
+    }
+    if (!*name) {
+      fprintf(stderr, "local: `%s': not a valid name\n", argv[i]);
+      ret = 2;
+    } else if (DeclareLocal(name, value ? value + 1 : NULL) < 0) {
+      fprintf(stderr, "local: %s: %s\n", name, strerror(errno));
+      ret = ret ? ret : 1;
+    }
+    free(name);
+  }
+  return ret;
+}
+
+/**
+ * @brief Loads a built-in from a shared object and adds it to the loaded
+ *        built-ins, replacing a previously loaded one of the same name.
+ *
+ * The object must export a `ShellBuiltinDef` named `<name>_builtin`, built
+ * for the ABI version of this shell. Errors are reported on stderr. A
+ * built-in being replaced stays until its replacement has loaded, and
+ * loading again the object it comes from changes nothing.
+ *
+ * @param path Path of the shared object, searched for as by `dlopen` if it
+ *             contains no slash.
+ * @param name Name of the built-in.
+ *
+ * @return 0 on success, or -1 on error.
+ */
+int LoadBuiltin(const char *path, const char *name) {
+  LoadedBuiltin *existing = FindLoadedBuiltin(name);
+  if (!existing && FindBuiltin(name)) {
+    fprintf(stderr, "enable: %s: is a shell built-in\n", name);
+    return -1;
+  }
+
+  char symbol[256];
+  if (snprintf(symbol, sizeof(symbol), "%s_builtin", name) >=
+      (int)sizeof(symbol)) {
+    fprintf(stderr, "enable: %s: name too long\n", name);
+    return -1;
+  }
+
+  void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (!handle) {
+    fprintf(stderr, "enable: %s\n", dlerror());
+    return -1;
+  }
+
+  if (existing && existing->handle == handle) {
+    dlclose(handle);  // dlopen() only took another reference to it
+    return 0;
+  }
+
+  LoadedBuiltin entry = {{NULL, NULL, NULL}, NULL, handle, NULL};
+  const ShellBuiltinDef *def = dlsym(handle, symbol);
+  if (!def) {
+    fprintf(stderr, "enable: %s: no %s in %s\n", name, symbol, path);
+    goto error;
+  }
+  if (def->abi_version != SHELL_BUILTIN_ABI_VERSION) {
+    fprintf(stderr, "enable: %s: built for ABI version %u, not %d\n", name,
+            def->abi_version, SHELL_BUILTIN_ABI_VERSION);
+    goto error;
+  }
+  if (!def->func) {
+    fprintf(stderr, "enable: %s: no function\n", name);
+    goto error;
+  }
+
+  if (def->load && def->load(&kShellApi) != 0) {
+    fprintf(stderr, "enable: %s: refused to load\n", name);
+    goto error;
+  }
+  entry.def = def;
+  entry.builtin.stream_func = def->func;
+
+  // Kept absolute for child shells, which may start in another directory
+  entry.path = strchr(path, '/') ? realpath(path, NULL) : strdup(path);
+  if (!(entry.builtin.name = strdup(name)) || !entry.path ||
+      (!loaded_builtins &&
+       !(loaded_builtins = InitDynamicArray(kDefaultArraySize,
+                                            sizeof(LoadedBuiltin))))) {
+    fprintf(stderr, "enable: %s\n", strerror(errno));
+    goto error;
+  }
+
+  // Removing the old built-in also leaves room for the new one
+  if (existing) {
+    UnloadBuiltin(name);
+  }
+  if (AppendElement(loaded_builtins, &entry) < 0) {
+    fprintf(stderr, "enable: %s\n", strerror(errno));
+    goto error;
+  }
+  snapshot_stale = 1;
+  builtin_generation++;
+  return 0;
+
+error:
+  if (entry.def && entry.def->unload) {
+    entry.def->unload();
+  }
+  free((char *)entry.builtin.name);
+  free(entry.path);
+  dlclose(handle);
+  return -1;
+}
+
+/**
+ * @brief Removes a loaded built-in and unloads its shared object.
+ *
+ * @return 0 on success, or -1 if no built-in of that name was loaded.
+ */
+int UnloadBuiltin(const char *name) {
+  LoadedBuiltin *loaded =
+      loaded_builtins ? (LoadedBuiltin *)loaded_builtins->data : NULL;
+  for (size_t i = 0; loaded && i < loaded_builtins->len; i++) {
+    if (strcmp(name, loaded[i].builtin.name) != 0) {
+      continue;
+    }
+    if (loaded[i].def->unload) {
+      loaded[i].def->unload();
+    }
+    dlclose(loaded[i].handle);
+    free((char *)loaded[i].builtin.name);
+    free(loaded[i].path);
+    memmove(&loaded[i], &loaded[i + 1],
+            (loaded_builtins->len - i - 1) * sizeof(LoadedBuiltin));
+    loaded_builtins->len--;
+    snapshot_stale = 1;
+    builtin_generation++;
+    return 0;
+  }
+  return -1;
+}
+
+/**
+ * @brief Looks up a loaded built-in by name.
+ *
+ * @return A pointer to the entry, or NULL if no such built-in is loaded.
+ */
+LoadedBuiltin *FindLoadedBuiltin(const char *name) {
+  LoadedBuiltin *loaded =
+      loaded_builtins ? (LoadedBuiltin *)loaded_builtins->data : NULL;
+  for (size_t i = 0; loaded && i < loaded_builtins->len; i++) {
+    if (strcmp(name, loaded[i].builtin.name) == 0) {
+      return &loaded[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Writes the state a child shell inherits into a sealed memfd.
+ *
+ * The snapshot holds the options set with `set -o` and the loaded
+ * built-ins, as a SnapshotHeader followed by one byte per option and a
+ * NUL-terminated name and path per built-in. It is only rebuilt after that
+ * state changed. Child shells receive the descriptor through the variable
+ * named by kSnapshotVariable, so that they start with the same state
+ * without running `set` and `enable` again. Other commands receive neither
+ * the descriptor nor the variable.
+ *
+ * @return 0 on success, or -1 on error with errno set accordingly, in which
+ *         case commands receive no snapshot.
+ */
+int PrepareSnapshot(void) {
+  if (!snapshot_stale) {
+    return 0;
+  }
+
+  char *data = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&data, &size);
+  if (!out) {
+    return -1;
+  }
+  LoadedBuiltin *loaded =
+      loaded_builtins ? (LoadedBuiltin *)loaded_builtins->data : NULL;
+  SnapshotHeader header = {kSnapshotMagic, kSnapshotVersion, 0, kOptionCount,
+                           loaded ? (uint32_t)loaded_builtins->len : 0};
+  fwrite(&header, sizeof(header), 1, out);
+  for (int i = 0; i < kOptionCount; i++) {
+    fputc(shell_options[i], out);
+  }
+  for (uint32_t i = 0; i < header.nbuiltins; i++) {
+    fwrite(loaded[i].builtin.name, strlen(loaded[i].builtin.name) + 1, 1,
+           out);
+    fwrite(loaded[i].path, strlen(loaded[i].path) + 1, 1, out);
+  }
+  int ret = -1;
+  int fd = -1;
+  if (fclose(out) != 0 || size > UINT32_MAX) {
+    goto cleanup;
+  }
+  ((SnapshotHeader *)data)->size = (uint32_t)size;
+
+  fd = memfd_create("shell-snapshot", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0 || write(fd, data, size) != (ssize_t)size ||
+      fcntl(fd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+    goto cleanup;
+  }
+  if (snapshot_fd >= 0) {
+    close(snapshot_fd);
+  }
+  snapshot_fd = fd;
+  fd = -1;
+  snapshot_stale = 0;
+  ret = 0;
+
+cleanup:
+  if (fd >= 0) {
+    close(fd);
+  }
+  free(data);
+  return ret;
+}
+
+/**
+ * @brief Tells whether a path names the executable of this shell.
+ */
+int IsShellExecutable(const char *path) {
+  struct stat self, st;
+  return stat("/proc/self/exe", &self) == 0 && stat(path, &st) == 0 &&
+         self.st_dev == st.st_dev && self.st_ino == st.st_ino;
+}
+
+/**
+ * @brief Restores the state passed down by a parent shell, if any.
+ *
+ * The snapshot is mapped read-only and checked before anything is applied.
+ * A descriptor that holds no snapshot of this version is left alone, as
+ * commands between the two shells may have reused its number. A valid
+ * snapshot is kept to pass on to the commands of this shell.
+ *
+ * @return 0 if there was no snapshot or it was applied, or -1 if it was
+ *         ignored.
+ */
+int LoadSnapshot(void) {
+  const char *value = getenv(kSnapshotVariable);
+  if (!value) {
+    return 0;
+  }
+  char *end;
+  long fd = strtol(value, &end, 10);
+  int valid = *value && !*end && fd >= 0 && fd <= INT_MAX;
+  unsetenv(kSnapshotVariable);
+
+  struct stat st;
+  if (!valid || fstat((int)fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+      st.st_size < (off_t)sizeof(SnapshotHeader) || st.st_size > UINT32_MAX) {
+    return -1;
+  }
+  size_t size = (size_t)st.st_size;
+  const char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, (int)fd, 0);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+
+  SnapshotHeader header;
+  memcpy(&header, map, sizeof(header));
+  if (header.magic != kSnapshotMagic || header.version != kSnapshotVersion ||
+      header.size != size || header.noptions != kOptionCount ||
+      size - sizeof(header) < header.noptions) {
+    munmap((void *)map, size);
+    return -1;
+  }
+
+  // Check every option and string before applying any of them
+  const uint8_t *options = (const uint8_t *)map + sizeof(header);
+  for (int i = 0; valid && i < kOptionCount; i++) {
+    int nvalues = 0;
+    while (kOptionValues[i] && kOptionValues[i][nvalues]) {
+      nvalues++;
+    }
+    valid = options[i] < (kOptionValues[i] ? nvalues : 2);
+  }
+  const char *strings = (const char *)options + header.noptions;
+  const char *p = strings;
+  for (uint32_t i = 0; valid && i < header.nbuiltins * 2; i++) {
+    const char *nul = memchr(p, '\0', (size_t)(map + size - p));
+    valid = nul != NULL;
+    p = nul ? nul + 1 : p;
+  }
+  if (!valid) {
+    munmap((void *)map, size);
+    close((int)fd);
+    return -1;
+  }
+
+  for (int i = 0; i < kOptionCount; i++) {
+    shell_options[i] = options[i];
+  }
+  int failed = 0;
+  for (uint32_t i = 0; i < header.nbuiltins; i++) {
+    const char *name = strings;
+    const char *path = name + strlen(name) + 1;
+    strings = path + strlen(path) + 1;
+    failed |= LoadBuiltin(path, name) < 0;
+  }
+  munmap((void *)map, size);
+
+  fcntl((int)fd, F_SETFD, FD_CLOEXEC);
+  snapshot_fd = (int)fd;
+  snapshot_stale = failed;
+  return 0;
+}
+
+/**
+ * @brief Built-in `enable`: loads built-ins from shared objects.
+ *
+ * Usage: `enable -f FILE NAME...` loads each built-in from FILE, which
+ * exports it as `NAME_builtin` (see shell_builtin.h); `enable -d NAME...`
+ * unloads them; `enable` alone lists every built-in.
+ *
+ * @return 0 on success, 1 if a built-in could not be loaded or unloaded, or
+ *         2 on a usage error.
+ */
+int BuiltinEnable(int argc, char **argv, int status __attribute__((unused))) {
+  if (argc == 1) {
+    for (const Builtin *b = kBuiltins; b->name; b++) {
+      printf("enable %s\n", b->name);
+    }
+    LoadedBuiltin *loaded =
+        loaded_builtins ? (LoadedBuiltin *)loaded_builtins->data : NULL;
+    for (size_t i = 0; loaded && i < loaded_builtins->len; i++) {
+      printf("enable -f %s %s", loaded[i].path, loaded[i].builtin.name);
+      if (loaded[i].def->usage) {
+        printf("\t# %s", loaded[i].def->usage);
+      }
+      printf("\n");
+    }
+    return 0;
+  }
+
+  int ret = 0;
+  if (argc >= 4 && strcmp(argv[1], "-f") == 0) {
+    for (int i = 3; i < argc; i++) {
+      if (LoadBuiltin(argv[2], argv[i]) < 0) {
+        ret = 1;
+      }
+    }
+  } else if (argc >= 3 && strcmp(argv[1], "-d") == 0) {
+    for (int i = 2; i < argc; i++) {
+      if (UnloadBuiltin(argv[i]) < 0) {
+        fprintf(stderr, "enable: %s: not a loaded built-in\n", argv[i]);
+        ret = 1;
+      }
+    }
+  } else {
+    fprintf(stderr, "usage: enable [-f FILE NAME... | -d NAME...]\n");
+    return 2;
+  }
+  return ret;
+}
+
+/**
+ * @brief Built-in `read`: reads a line and splits it into variables.
+ *
+ * Usage: `read [NAME...]`. The line is split at blanks; each NAME is
+ * assigned one field and the last one the rest of the line. Without NAME,
+ * the whole line goes to `REPLY`. The input is read one byte at a time, so
+ * that the rest of it is left to the next reader.
+ *
+ * @return 0 on success, or 1 at end of file, on error or when interrupted.
+ */
+int BuiltinRead(int argc, char **argv, const ShellBuiltinContext *ctx) {
+  DynamicArray *line = InitDynamicArray(kDefaultArraySize, sizeof(char));
+  if (!line) {
+    fprintf(stderr, "read: %s\n", strerror(errno));
+    return 1;
+  }
+
+  ssize_t n;
+  char c;
+  while ((n = read(ctx->stdin_fd, &c, 1)) > 0 && c != '\n') {
+    if (AppendElement(line, &c) < 0) {
+      break;
+    }
+  }
+  int failed = n < 0 || (n == 0 && line->len == 0);
+  c = '\0';
+  if (AppendElement(line, &c) < 0) {
+    fprintf(stderr, "read: %s\n", strerror(errno));
+    FreeDynamicArray(line);
+    return 1;
+  }
+
+  char *field = (char *)line->data;
+  if (argc == 1) {
+    ctx->api->set_variable("REPLY", field);
+  }
+  for (int i = 1; i < argc; i++) {
+    field += strspn(field, " \t");
+    char *end = field + (i + 1 < argc ? strcspn(field, " \t") : strlen(field));
+    if (i + 1 == argc) {
+      while (end > field && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+      }
+    }
+    char saved = *end;
+    *end = '\0';
+    if (ctx->api->set_variable(argv[i], field) < 0) {
+      fprintf(stderr, "read: %s: %s\n", argv[i], strerror(errno));
+    }
+    *end = saved;
+    field = end;
+  }
+
+  FreeDynamicArray(line);
+  return failed;
+}
+
+/**
+ * @brief Tells whether a redirection target names a compressed file, as in
+ *        `> gz:FILE` or `< gz:FILE`.
+ */
+int IsStreamTarget(const char *target) {
+  size_t len = strlen(kGzipPrefix);
+  return strncmp(target, kGzipPrefix, len) == 0 && target[len] != '\0';
+}
+
+/**
+ * @brief Opens a compressed file and starts the thread that compresses the
+ *        output of a command into it, or decompresses it for its input.
+ *
+ * @param path  Path of the compressed file.
+ * @param rtype Type of redirection, which gives the flags of the file.
+ * @param fd    Receives the end of the pipe to hand to the command.
+ *
+ * @return The stream, or NULL on error with errno set accordingly.
+ */
+RedirectStream *StartStream(const char *path, RedirectType rtype, int *fd) {
+  mode_t mode;
+  int flags = RedirectOpenFlags(rtype, &mode);
+  int compress = rtype != kRedirectIn;
+  int fds[2] = {-1, -1};
+  int file = -1;
+  RedirectStream *stream = calloc(1, sizeof(RedirectStream));
+  if (!stream || !(stream->path = strdup(path)) ||
+      (file = open(path, flags | O_CLOEXEC, mode)) < 0 ||
+      pipe2(fds, O_CLOEXEC) < 0) {
+    goto error;
+  }
+  stream->in_fd = compress ? fds[0] : file;
+  stream->out_fd = compress ? file : fds[1];
+  pthread_mutex_init(&stream->lock, NULL);
+  pthread_cond_init(&stream->cond, NULL);
+
+  // Writing to a command that has exited must fail with EPIPE rather than
+  // kill the shell, and ^C is left to the main thread
+  sigset_t block, saved_mask;
+  sigemptyset(&block);
+  sigaddset(&block, SIGINT);
+  sigaddset(&block, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &block, &saved_mask);
+  int err = pthread_create(&stream->thread, NULL,
+                           compress ? RunCompressor : RunDecompressor, stream);
+  pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+  if (err != 0) {
+    pthread_cond_destroy(&stream->cond);
+    pthread_mutex_destroy(&stream->lock);
+    errno = err;
+    goto error;
+  }
+
+  *fd = compress ? fds[1] : fds[0];
+  return stream;
+
+error:;
+  int saved_errno = errno;
+  for (int i = 0; i < 2; i++) {
+    if (fds[i] >= 0) {
+      close(fds[i]);
+    }
+  }
+  if (file >= 0) {
+    close(file);
+  }
+  if (stream) {
+    free(stream->path);
+  }
+  free(stream);
+  errno = saved_errno;
+  return NULL;
+}
+
+/**
+ * @brief Starts a stream for every `gz:` redirection of a command or
+ *        pipeline, and hands the command ends of their pipes over to
+ *        `OpenRedirectTarget()` through the table of files opened ahead of
+ *        time.
+ *
+ * The streams belong to the foreground command until tagged with the
+ * process group of a background job.
+ *
+ * @param stages  The tokenized stages.
+ * @param nstages Number of stages.
+ *
+ * @return 0 on success, or -1 if memory runs out. A stream that cannot be
+ *         started is reported when the command opens its target.
+ */
+int StartStreamRedirections(DynamicArray **stages, size_t nstages) {
+  for (size_t s = 0; s < nstages; s++) {
+    char **args = (char **)stages[s]->data;
+    for (size_t i = SkipConditionalOperands(args, stages[s]->len);
+         i + 1 < stages[s]->len; i++) {
+      RedirectType rtype = GetRedirectType(args[i]);
+      if (rtype == kNone || !IsStreamTarget(args[i + 1])) {
+        continue;
+      }
+      if ((!preopened &&
+           !(preopened = InitDynamicArray(kDefaultArraySize,
+                                          sizeof(PreopenedFile)))) ||
+          (!streams &&
+           !(streams = InitDynamicArray(kDefaultArraySize,
+                                        sizeof(RedirectStream *))))) {
+        return -1;
+      }
+
+      PreopenedFile file = {args[i + 1], -1, 0};
+      RedirectStream *stream =
+          StartStream(args[i + 1] + strlen(kGzipPrefix), rtype, &file.fd);
+      if (!stream) {
+        file.error = errno;
+      } else if (AppendElement(streams, &stream) < 0) {
+        // Without the command end, the stream sees end of file and stops
+        close(file.fd);
+        pthread_join(stream->thread, NULL);
+        free(stream->path);
+        free(stream);
+        return -1;
+      }
+      if (AppendElement(preopened, &file) < 0) {
+        close(file.fd);
+        return -1;
+      }
+      i++;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Closes a descriptor of a stream, marking it closed first so that a
+ *        child forked meanwhile does not close it again after reuse.
+ *
+ * @return The result of `close`, or 0 if it was closed already.
+ */
+int CloseStreamEnd(int *fd) {
+  int old = __atomic_exchange_n(fd, -1, __ATOMIC_ACQ_REL);
+  return old >= 0 ? close(old) : 0;
+}
+
+/**
+ * @brief Closes, in a forked child, the descriptors held by the streams and
+ *        pipeline relays of the shell.
+ *
+ * Children running a built-in never exec, and would otherwise keep the
+ * pipes of the streams and relays open and their commands from seeing end
+ * of file. No lock is taken, as the threads that hold them do not exist in
+ * the child.
+ */
+void CloseThreadDescriptors(void) {
+  RedirectStream **list = streams ? (RedirectStream **)streams->data : NULL;
+  for (size_t i = 0; list && i < streams->len; i++) {
+    CloseStreamEnd(&list[i]->in_fd);
+    CloseStreamEnd(&list[i]->out_fd);
+  }
+  for (size_t i = 0; i < nactive_relays; i++) {
+    CloseStreamEnd(&active_relays[i].in_fd);
+    CloseStreamEnd(&active_relays[i].out_fd);
+  }
+}
+
+/**
+ * @brief Joins the threads of finished streams and frees them.
+ *
+ * @param pgid Process group of a job whose streams to wait for, 0 for those
+ *             of foreground commands, or -1 to wait for none. The streams
+ *             are done once the commands have exited and the pipes drained.
+ */
+void FinishStreams(pid_t pgid) {
+  RedirectStream **list = streams ? (RedirectStream **)streams->data : NULL;
+  for (size_t i = 0; list && i < streams->len;) {
+    RedirectStream *stream = list[i];
+    if (stream->pgid != pgid &&
+        !__atomic_load_n(&stream->finished, __ATOMIC_ACQUIRE)) {
+      i++;
+      continue;
+    }
+
+    pthread_join(stream->thread, NULL);
+    pthread_cond_destroy(&stream->cond);
+    pthread_mutex_destroy(&stream->lock);
+    free(stream->path);
+    free(stream);
+    list[i] = list[--streams->len];
+  }
+}
+
+/**
+ * @brief Compresses one block into a complete gzip member.
+ *
+ * Concatenated members form a valid gzip file, so blocks compress
+ * independently of each other.
+ *
+ * @return 0 on success, or -1 on error.
+ */
+int CompressBlock(z_stream *z, GzipBlock *block, size_t out_size) {
+  if (deflateReset(z) != Z_OK) {
+    return -1;
+  }
+  z->next_in = block->in;
+  z->avail_in = (uInt)block->in_len;
+  z->next_out = block->out;
+  z->avail_out = (uInt)out_size;
+  if (deflate(z, Z_FINISH) != Z_STREAM_END) {
+    return -1;
+  }
+  block->out_len = out_size - z->avail_out;
+  return 0;
+}
+
+/**
+ * @brief Worker thread of a compressor: compresses the next block read and
+ *        writes it out once the blocks before it have been.
+ */
+void *RunCompressWorker(void *arg) {
+  RedirectStream *stream = arg;
+  size_t out_size = compressBound(kGzipBlockSize) + 64;  // gzip framing
+  z_stream z = {0};
+  int ready = deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                           Z_DEFAULT_STRATEGY) == Z_OK;
+
+  pthread_mutex_lock(&stream->lock);
+  for (;;) {
+    while (stream->next_compress == stream->next_read && !stream->eof) {
+      pthread_cond_wait(&stream->cond, &stream->lock);
+    }
+    if (stream->next_compress == stream->next_read) {
+      break;
+    }
+    uint64_t seq = stream->next_compress++;
+    GzipBlock *block = &stream->slots[seq % stream->nslots];
+    pthread_mutex_unlock(&stream->lock);
+
+    int error = !ready || CompressBlock(&z, block, out_size) < 0;
+    if (error) {
+      PrintError("%s%s: compression failed\n", kGzipPrefix, stream->path);
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    while (stream->next_write != seq) {
+      pthread_cond_wait(&stream->cond, &stream->lock);
+    }
+    error |= stream->error;
+    pthread_mutex_unlock(&stream->lock);
+
+    // Only this worker writes until `next_write` moves on
+    for (size_t off = 0; !error && off < block->out_len;) {
+      ssize_t written = write(stream->out_fd, block->out + off,
+                              block->out_len - off);
+      if (written < 0 && errno != EINTR) {
+        PrintError("%s%s: %s\n", kGzipPrefix, stream->path, strerror(errno));
+        error = 1;
+      } else if (written > 0) {
+        off += (size_t)written;
+      }
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    stream->error |= error;
+    stream->next_write++;
+    pthread_cond_broadcast(&stream->cond);
+  }
+  pthread_mutex_unlock(&stream->lock);
+
+  if (ready) {
+    deflateEnd(&z);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Thread of a compressor: reads the output of the command in blocks
+ *        and hands them to workers, one per CPU, that compress them in
+ *        parallel, as pigz does.
+ *
+ * After an error, the rest of the output is read and dropped, so that the
+ * command does not block.
+ */
+void *RunCompressor(void *arg) {
+  RedirectStream *stream = arg;
+  cpu_set_t cpus;
+  int nworkers = sched_getaffinity(0, sizeof(cpus), &cpus) == 0
+                     ? CPU_COUNT(&cpus)
+                     : 1;
+  nworkers = nworkers > kGzipMaxWorkers ? kGzipMaxWorkers : nworkers;
+  size_t out_size = compressBound(kGzipBlockSize) + 64;
+  stream->nslots = 2 * (size_t)nworkers;
+  stream->slots = calloc(stream->nslots, sizeof(GzipBlock));
+  pthread_t *workers = calloc((size_t)nworkers, sizeof(pthread_t));
+  for (size_t i = 0; stream->slots && i < stream->nslots; i++) {
+    stream->slots[i].in = malloc(kGzipBlockSize);
+    stream->slots[i].out = malloc(out_size);
+    stream->error |= !stream->slots[i].in || !stream->slots[i].out;
+  }
+  int started = 0;
+  while (workers && stream->slots && !stream->error && started < nworkers &&
+         pthread_create(&workers[started], NULL, RunCompressWorker,
+                        stream) == 0) {
+    started++;
+  }
+  if (started == 0) {
+    PrintError("%s%s: cannot start compression\n", kGzipPrefix,
+               stream->path);
+    stream->error = 1;
+  }
+
+  unsigned char discard[BUFSIZ];
+  for (;;) {
+    pthread_mutex_lock(&stream->lock);
+    while (!stream->error &&
+           stream->next_read - stream->next_write >= stream->nslots) {
+      pthread_cond_wait(&stream->cond, &stream->lock);
+    }
+    int error = stream->error;
+    GzipBlock *block =
+        error ? NULL : &stream->slots[stream->next_read % stream->nslots];
+    pthread_mutex_unlock(&stream->lock);
+
+    unsigned char *buf = block ? block->in : discard;
+    size_t size = block ? kGzipBlockSize : sizeof(discard);
+    size_t len = 0;
+    ssize_t n = 1;
+    while (len < size &&
+           (n = read(stream->in_fd, buf + len, size - len)) != 0) {
+      if (n < 0 && errno != EINTR) {
+        PrintError("%s%s: %s\n", kGzipPrefix, stream->path, strerror(errno));
+        break;
+      }
+      len += n > 0 ? (size_t)n : 0;
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    if (block && len > 0) {
+      block->in_len = len;
+      stream->next_read++;
+    }
+    stream->eof = n <= 0;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+    if (n <= 0) {
+      break;
+    }
+  }
+
+  for (int i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  for (size_t i = 0; stream->slots && i < stream->nslots; i++) {
+    free(stream->slots[i].in);
+    free(stream->slots[i].out);
+  }
+  free(stream->slots);
+  free(workers);
+  CloseStreamEnd(&stream->in_fd);
+  if (CloseStreamEnd(&stream->out_fd) < 0) {
+    PrintError("%s%s: %s\n", kGzipPrefix, stream->path, strerror(errno));
+  }
+  __atomic_store_n(&stream->finished, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/**
+ * @brief Thread of a decompressor: inflates a gzip file, including one of
+ *        several members, into the pipe read by the command.
+ */
+void *RunDecompressor(void *arg) {
+  RedirectStream *stream = arg;
+  unsigned char *in = malloc(kGzipBlockSize);
+  unsigned char *out = malloc(kGzipBlockSize);
+  z_stream z = {0};
+  int ret = Z_OK;
+  int failed = 0;
+  if (!in || !out || inflateInit2(&z, 15 + 32) != Z_OK) {
+    PrintError("%s%s: cannot start decompression\n", kGzipPrefix,
+               stream->path);
+    failed = 1;
+  }
+
+  while (!failed) {
+    ssize_t n = read(stream->in_fd, in, kGzipBlockSize);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      if (n < 0 || ret != Z_STREAM_END) {
+        PrintError("%s%s: %s\n", kGzipPrefix, stream->path,
+                   n < 0 ? strerror(errno) : "unexpected end of file");
+      }
+      break;
+    }
+
+    z.next_in = in;
+    z.avail_in = (uInt)n;
+    do {
+      // Another member may follow the end of the previous one
+      if (ret == Z_STREAM_END &&
+          (z.avail_in == 0 || inflateReset(&z) != Z_OK)) {
+        break;
+      }
+      z.next_out = out;
+      z.avail_out = (uInt)kGzipBlockSize;
+      ret = inflate(&z, Z_NO_FLUSH);
+      if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+        PrintError("%s%s: invalid compressed data\n", kGzipPrefix,
+                   stream->path);
+        failed = 1;
+      }
+      size_t len = kGzipBlockSize - z.avail_out;
+      for (size_t off = 0; !failed && off < len;) {
+        ssize_t written = write(stream->out_fd, out + off, len - off);
+        if (written < 0 && errno != EINTR) {
+          failed = 1;  // The command stopped reading
+        }
+        if (written > 0) {
+          off += (size_t)written;
+        }
+      }
+      // A full output buffer may leave more output pending
+    } while (!failed && (z.avail_in > 0 || z.avail_out == 0));
+  }
+
+  inflateEnd(&z);
+  free(in);
+  free(out);
+  CloseStreamEnd(&stream->in_fd);
+  CloseStreamEnd(&stream->out_fd);
+  __atomic_store_n(&stream->finished, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/**
+ * @brief Counts the occurrences of a byte, a vector of bytes at a time.
+ */
+size_t CountByte(const char *p, size_t n, char c) {
+  size_t count = 0;
+  size_t i = 0;
+  while (i + kVectorBytes <= n) {
+    // Counts per byte lane, summed up before they can wrap around
+    TextVector lanes = {0};
+    for (int k = 0; k < 255 && i + kVectorBytes <= n; k++) {
+      TextVector v;
+      memcpy(&v, p + i, kVectorBytes);
+      lanes -= (TextVector)(v == c);  // all bits set in matching bytes
+      i += kVectorBytes;
+    }
+    unsigned char sums[kVectorBytes];
+    memcpy(sums, &lanes, sizeof(sums));
+    for (size_t b = 0; b < kVectorBytes; b++) {
+      count += sums[b];
+    }
+  }
+  for (; i < n; i++) {
+    count += p[i] == c;
+  }
+  return count;
+}
+
+/**
+ * @brief Finds the first of any of three bytes, a vector of bytes at a time.
+ *
+ * @return A pointer to the first byte equal to `a`, `b` or `c`, or `end` if
+ *         there is none.
+ */
+const char *FindByteSet(const char *p, const char *end, char a, char b,
+                        char c) {
+  for (; end - p >= kVectorBytes; p += kVectorBytes) {
+    TextVector v;
+    memcpy(&v, p, kVectorBytes);
+    TextVector hits = (v == a) | (v == b) | (v == c);
+    uint64_t words[kVectorBytes / 8];
+    memcpy(words, &hits, sizeof(words));
+    for (size_t w = 0; w < kVectorBytes / 8; w++) {
+      if (words[w]) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        return p + w * 8 + __builtin_ctzll(words[w]) / 8;
+#else
+        return p + w * 8 + __builtin_clzll(words[w]) / 8;
+#endif
+      }
+    }
+  }
+  while (p < end && *p != a && *p != b && *p != c) {
+    p++;
+  }
+  return p;
+}
+
+/**
+ * @brief Sets up a reader handing out whole lines from a descriptor.
+ *
+ * @return 0 on success, or -1 on allocation failure with errno set.
+ */
+int InitLineReader(LineReader *r, int fd) {
+  *r = (LineReader){fd, malloc(kTextBufferSize), kTextBufferSize, 0, 0, 0};
+  return r->data ? 0 : -1;
+}
+
+/**
+ * @brief Frees the buffer of a line reader.
+ */
+void FreeLineReader(LineReader *r) {
+  free(r->data);
+  r->data = NULL;
+}
+
+/**
+ * @brief Reads the next block of whole lines.
+ *
+ * The block ends with a newline, except for a last line that lacks one. It
+ * stays valid until the next call.
+ *
+ * @param r     Pointer to the reader.
+ * @param begin Receives the start of the block.
+ * @param end   Receives the end of the block.
+ *
+ * @return 1 if a block was read, 0 at end of input, or -1 on error with errno
+ *         set accordingly (EINTR when interrupted by a signal).
+ */
+int NextLines(LineReader *r, char **begin, char **end) {
+  // What is left over is a partial line, without newline
+  memmove(r->data, r->data + r->done, r->len - r->done);
+  r->len -= r->done;
+  r->done = 0;
+
+  while (r->done == 0) {
+    if (r->eof) {
+      if (r->len == 0) {
+        return 0;
+      }
+      r->done = r->len;
+      break;
+    }
+    if (r->len == r->size) {
+      char *data = realloc(r->data, r->size * 2);
+      if (!data) {
+        return -1;
+      }
+      r->data = data;
+      r->size *= 2;
+    }
+
+    ssize_t n = read(r->fd, r->data + r->len, r->size - r->len);
+    if (n < 0) {
+      return -1;
+    }
+    r->eof = n == 0;
+    char *last = memrchr(r->data + r->len, '\n', (size_t)n);
+    r->len += (size_t)n;
+    if (last) {
+      r->done = (size_t)(last - r->data) + 1;
+    }
+  }
+
+  *begin = r->data;
+  *end = r->data + r->done;
+  return 1;
+}
+
+/**
+ * @brief Writes out the output buffered by a text writer.
+ *
+ * @return 0 on success, or -1 on error with errno set accordingly (EPIPE
+ *         once the reader has gone).
+ */
+int FlushText(TextWriter *w) {
+  for (size_t off = 0; off < w->len;) {
+    ssize_t written = write(w->fd, w->data + off, w->len - off);
+    if (written < 0 && errno != EINTR) {
+      return -1;
+    }
+    if (written > 0) {
+      off += (size_t)written;
+    }
+  }
+  w->len = 0;
+  return 0;
+}
+
+/**
+ * @brief Buffers output of a text built-in, writing it out when the buffer
+ *        fills. Blocks larger than the buffer are written directly.
+ *
+ * @return 0 on success, or -1 on error with errno set accordingly.
+ */
+int WriteText(TextWriter *w, const char *p, size_t n) {
+  if (w->len + n > sizeof(w->data)) {
+    if (FlushText(w) < 0) {
+      return -1;
+    }
+    while (n >= sizeof(w->data)) {
+      ssize_t written = write(w->fd, p, n);
+      if (written < 0 && errno != EINTR) {
+        return -1;
+      }
+      if (written > 0) {
+        p += written;
+        n -= (size_t)written;
+      }
+    }
+  }
+  memcpy(w->data + w->len, p, n);
+  w->len += n;
+  return 0;
+}
+
+/**
+ * @brief Writes one or more lines, adding the newline a last line of input
+ *        may lack.
+ *
+ * @return 0 on success, or -1 on error with errno set accordingly.
+ */
+int WriteLine(TextWriter *w, const char *begin, const char *end) {
+  if (WriteText(w, begin, (size_t)(end - begin)) < 0) {
+    return -1;
+  }
+  return end > begin && end[-1] == '\n' ? 0 : WriteText(w, "\n", 1);
+}
+
+/**
+ * @brief Parses a list of fields such as `2`, `1,3` or `2-4,6-`.
+ *
+ * @param list    The list.
+ * @param ranges  Array of `kMaxFieldRanges` ranges receiving the list.
+ * @param nranges Receives the number of ranges.
+ *
+ * @return 0 on success, or -1 if the list is invalid.
+ */
+int ParseFieldList(const char *list, FieldRange *ranges, size_t *nranges) {
+  *nranges = 0;
+  for (const char *p = list; *nranges < kMaxFieldRanges; p++) {
+    char *end;
+    FieldRange range = {1, SIZE_MAX};
+    if (*p != '-') {
+      range.first = strtoul(p, &end, 10);
+      range.last = range.first;
+      p = end;
+    }
+    if (*p == '-') {
+      p++;
+      if (isdigit((unsigned char)*p)) {
+        range.last = strtoul(p, &end, 10);
+        p = end;
+      } else {
+        range.last = SIZE_MAX;
+      }
+    }
+    if (range.first == 0 || range.last < range.first ||
+        (*p != ',' && *p != '\0')) {
+      return -1;
+    }
+    ranges[(*nranges)++] = range;
+    if (*p == '\0') {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Built-in `count`: counts the lines and bytes of its input.
+ *
+ * Usage: `count [-l] [-c]`. Prints the number of lines (`-l`, the default),
+ * of bytes (`-c`), or both, like `wc -l` and `wc -c`.
+ *
+ * @return 0 on success, 1 on error, or 2 on a usage error.
+ */
+int BuiltinCount(int argc, char **argv, const ShellBuiltinContext *ctx) {
+  int lines = 0;
+  int bytes = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-l") == 0) {
+      lines = 1;
+    } else if (strcmp(argv[i], "-c") == 0) {
+      bytes = 1;
+    } else {
+      dprintf(ctx->stderr_fd, "usage: count [-l] [-c]\n");
+      return 2;
+    }
+  }
+  lines |= !bytes;
+
+  char *buf = malloc(kTextBufferSize);
+  if (!buf) {
+    dprintf(ctx->stderr_fd, "count: %s\n", strerror(errno));
+    return 1;
+  }
+  size_t nlines = 0;
+  size_t nbytes = 0;
+  ssize_t n;
+  while ((n = read(ctx->stdin_fd, buf, kTextBufferSize)) > 0) {
+    nlines += lines ? CountByte(buf, (size_t)n, '\n') : 0;
+    nbytes += (size_t)n;
+  }
+  free(buf);
+  if (n < 0) {
+    dprintf(ctx->stderr_fd, "count: %s\n", strerror(errno));
+    return 1;
+  }
+
+  if (lines && bytes) {
+    dprintf(ctx->stdout_fd, "%zu %zu\n", nlines, nbytes);
+  } else {
+    dprintf(ctx->stdout_fd, "%zu\n", lines ? nlines : nbytes);
+  }
+  return 0;
+}
+
+/**
+ * @brief Built-in `fields`: prints selected fields of each line.
+ *
+ * Usage: `fields [-d CHAR] LIST`. LIST is as for `cut -f`, e.g. `2` or
+ * `1,3-`. Without `-d`, fields are separated by runs of blanks and leading
+ * blanks are ignored, as in awk, and are joined by a space; with `-d`, they
+ * are separated and joined by CHAR, and lines without it are printed whole,
+ * as by `cut`.
+ *
+ * @return 0 on success, 1 on error, or 2 on a usage error.
+ */
+int BuiltinFields(int argc, char **argv, const ShellBuiltinContext *ctx) {
+  FieldRange ranges[kMaxFieldRanges];
+  size_t nranges;
+  char delim = '\0';
+  int i = 1;
+  if (argc == 4 && strcmp(argv[1], "-d") == 0 && strlen(argv[2]) == 1 &&
+      argv[2][0] != '\n') {
+    delim = argv[2][0];
+    i = 3;
+  }
+  if (i + 1 != argc || ParseFieldList(argv[i], ranges, &nranges) < 0) {
+    dprintf(ctx->stderr_fd, "usage: fields [-d CHAR] LIST\n");
+    return 2;
+  }
+  size_t max_field = 0;
+  for (size_t r = 0; r < nranges; r++) {
+    max_field = ranges[r].last > max_field ? ranges[r].last : max_field;
+  }
+
+  // Blanks are a space or a tab; a single delimiter is searched for twice
+  char a = delim ? delim : ' ';
+  char b = delim ? delim : '\t';
+  char sep = delim ? delim : ' ';
+  LineReader reader;
+  TextWriter *writer = malloc(sizeof(TextWriter));
+  if (!writer || InitLineReader(&reader, ctx->stdin_fd) < 0) {
+    dprintf(ctx->stderr_fd, "fields: %s\n", strerror(errno));
+    free(writer);
+    return 1;
+  }
+  writer->fd = ctx->stdout_fd;
+  writer->len = 0;
+
+  int ret = 0;
+  char *begin;
+  char *end;
+  while (ret == 0 && (ret = NextLines(&reader, &begin, &end)) > 0) {
+    ret = 0;
+    for (const char *p = begin; p < end && ret == 0;) {
+      const char *line_end = p;
+      int printed = 0;
+      size_t field = 1;
+      if (!delim) {
+        while (p < end && (*p == ' ' || *p == '\t')) {
+          p++;
+        }
+      }
+      for (;;) {
+        const char *q = FindByteSet(p, end, a, b, '\n');
+        if (delim && field == 1 && (q == end || *q == '\n')) {
+          ret = WriteLine(writer, p, q == end ? q : q + 1);
+          line_end = q == end ? q : q + 1;
+          printed = -1;  // printed whole, newline included
+          break;
+        }
+        int selected = 0;
+        for (size_t r = 0; r < nranges && !selected; r++) {
+          selected = field >= ranges[r].first && field <= ranges[r].last;
+        }
+        if (selected && (q > p || delim)) {
+          if ((printed && WriteText(writer, &sep, 1) < 0) ||
+              WriteText(writer, p, (size_t)(q - p)) < 0) {
+            ret = -1;
+            break;
+          }
+          printed = 1;
+        }
+        if (q == end || *q == '\n') {
+          line_end = q == end ? q : q + 1;
+          break;
+        }
+        p = q + 1;
+        if (!delim) {
+          while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+          }
+        }
+        if (++field > max_field) {
+          const char *nl = memchr(p, '\n', (size_t)(end - p));
+          line_end = nl ? nl + 1 : end;
+          break;
+        }
+      }
+      if (ret == 0 && printed >= 0 && WriteText(writer, "\n", 1) < 0) {
+        ret = -1;
+      }
+      p = line_end;
+    }
+  }
+  if (ret == 0) {
+    ret = FlushText(writer);
+  }
+  if (ret < 0 && errno != EPIPE) {
+    dprintf(ctx->stderr_fd, "fields: %s\n", strerror(errno));
+  }
+
+  FreeLineReader(&reader);
+  free(writer);
+  return ret < 0;
+}
+
+/**
+ * @brief Built-in `match`: prints the lines that contain a fixed string.
+ *
+ * Usage: `match [-v] [-c] STRING`. With `-v`, prints the lines that do not
+ * contain it instead, and with `-c`, only the number of lines, like
+ * `grep -F`. The whole buffered input is searched at once with `memmem`,
+ * and line boundaries are only looked up around matches.
+ *
+ * @return 0 if a line was selected, 1 if none was, or 2 on error.
+ */
+int BuiltinMatch(int argc, char **argv, const ShellBuiltinContext *ctx) {
+  int invert = 0;
+  int count_only = 0;
+  int i = 1;
+  for (; i < argc - 1 && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-v") == 0) {
+      invert = 1;
+    } else if (strcmp(argv[i], "-c") == 0) {
+      count_only = 1;
+    } else {
+      break;
+    }
+  }
+  if (i + 1 != argc || strchr(argv[i], '\n')) {
+    dprintf(ctx->stderr_fd, "usage: match [-v] [-c] STRING\n");
+    return 2;
+  }
+  const char *pattern = argv[i];
+  size_t plen = strlen(pattern);
+
+  LineReader reader;
+  TextWriter *writer = malloc(sizeof(TextWriter));
+  if (!writer || InitLineReader(&reader, ctx->stdin_fd) < 0) {
+    dprintf(ctx->stderr_fd, "match: %s\n", strerror(errno));
+    free(writer);
+    return 2;
+  }
+  writer->fd = ctx->stdout_fd;
+  writer->len = 0;
+
+  size_t selected = 0;
+  int ret = 0;
+  char *begin;
+  char *end;
+  while (ret == 0 && (ret = NextLines(&reader, &begin, &end)) > 0) {
+    ret = 0;
+    const char *p = begin;
+    while (p < end && ret == 0) {
+      const char *hit = memmem(p, (size_t)(end - p), pattern, plen);
+      const char *line = end;
+      const char *next = end;
+      if (hit) {
+        const char *nl = memrchr(p, '\n', (size_t)(hit - p));
+        line = nl ? nl + 1 : p;
+        nl = memchr(hit, '\n', (size_t)(end - hit));
+        next = nl ? nl + 1 : end;
+      }
+      // Lines before `line` do not match; those up to `next` do
+      const char *from = invert ? p : line;
+      const char *to = invert ? line : next;
+      if (to > from) {
+        selected += invert ? CountByte(from, (size_t)(to - from), '\n') +
+                                 (to[-1] != '\n')
+                           : 1;
+        if (!count_only && WriteLine(writer, from, to) < 0) {
+          ret = -1;
+        }
+      }
+      p = next;
+    }
+  }
+  if (ret == 0 && count_only) {
+    char num[24];
+    int len = snprintf(num, sizeof(num), "%zu\n", selected);
+    ret = WriteText(writer, num, (size_t)len);
+  }
+  if (ret == 0) {
+    ret = FlushText(writer);
+  }
+  if (ret < 0 && errno != EPIPE) {
+    dprintf(ctx->stderr_fd, "match: %s\n", strerror(errno));
+  }
+
+  FreeLineReader(&reader);
+  free(writer);
+  return ret < 0 ? 2 : selected == 0;
+}
+
+/**
+ * @brief Returns the compiled form of a regular expression from the regex
+ *        cache, compiling it on a miss.
+ *
+ * The cache keeps the kRegexCacheSize patterns used last, keyed by pattern
+ * and flags, and evicts the least recently used one. Patterns that are
+ * plain text, optionally anchored with `^` and `$`, are not compiled at
+ * all: they are matched with `memmem` or a comparison.
+ *
+ * @param pattern The extended regular expression.
+ * @param cflags  Flags for `regcomp`.
+ *
+ * @return The cache entry, or NULL if the pattern is invalid (reported on
+ *         stderr) or memory runs out.
+ */
+RegexCacheEntry *CompileRegex(const char *pattern, int cflags) {
+  size_t len = strlen(pattern);
+  uint64_t hash = HashBytes(HashBytes(kFnvOffsetBasis, &cflags, sizeof(cflags)),
+                            pattern, len);
+  RegexCacheEntry *victim = &regex_cache[0];
+  for (size_t i = 0; i < kRegexCacheSize; i++) {
+    RegexCacheEntry *entry = &regex_cache[i];
+    if (entry->pattern && entry->hash == hash && entry->cflags == cflags &&
+        strcmp(entry->pattern, pattern) == 0) {
+      entry->last_used = ++regex_clock;
+      return entry;
+    }
+    if (!entry->pattern ||
+        (victim->pattern && entry->last_used < victim->last_used)) {
+      victim = entry;
+    }
+  }
+
+  RegexCacheEntry entry = {strdup(pattern), hash, cflags, 0, 0, 0, {0}, 0};
+  if (!entry.pattern) {
+    fprintf(stderr, "[[: %s\n", strerror(errno));
+    return NULL;
+  }
+  entry.anchor_start = pattern[0] == '^';
+  entry.anchor_end =
+      len > (size_t)entry.anchor_start && pattern[len - 1] == '$';
+  entry.literal = !(cflags & REG_ICASE) &&
+                  strcspn(pattern + entry.anchor_start, kRegexSpecial) ==
+                      len - (size_t)entry.anchor_start - entry.anchor_end;
+  if (!entry.literal) {
+    int err = regcomp(&entry.regex, pattern, cflags);
+    if (err != 0) {
+      char message[256];
+      regerror(err, &entry.regex, message, sizeof(message));
+      fprintf(stderr, "[[: %s: %s\n", pattern, message);
+      free(entry.pattern);
+      return NULL;
+    }
+  }
+
+  if (victim->pattern) {
+    if (!victim->literal) {
+      regfree(&victim->regex);
+    }
+    free(victim->pattern);
+  }
+  *victim = entry;
+  victim->last_used = ++regex_clock;
+  return victim;
+}
+
+/**
+ * @brief Matches a string against a cached regular expression.
+ *
+ * @param entry   The compiled expression.
+ * @param str     The string to match.
+ * @param groups  Receives the whole match and then each subexpression.
+ * @param ngroups Number of elements of `groups`.
+ *
+ * @return The number of elements of `groups` filled in, or 0 if the string
+ *         does not match.
+ */
+size_t MatchRegex(const RegexCacheEntry *entry, const char *str,
+                  regmatch_t *groups, size_t ngroups) {
+  if (!entry->literal) {
+    if (regexec(&entry->regex, str, ngroups, groups, 0) != 0) {
+      return 0;
+    }
+    size_t n = entry->regex.re_nsub + 1;
+    return n < ngroups ? n : ngroups;
+  }
+
+  const char *text = entry->pattern + entry->anchor_start;
+  size_t text_len = strlen(text) - (size_t)entry->anchor_end;
+  size_t len = strlen(str);
+  const char *found = NULL;
+  if (text_len > len) {
+    return 0;
+  }
+  if (entry->anchor_start) {
+    found = memcmp(str, text, text_len) == 0 ? str : NULL;
+  } else if (entry->anchor_end) {
+    found = str + len - text_len;
+    found = memcmp(found, text, text_len) == 0 ? found : NULL;
+  } else {
+    found = memmem(str, len, text, text_len);
+  }
+  if (!found || (entry->anchor_start && entry->anchor_end &&
+                 text_len != len)) {
+    return 0;
+  }
+  groups[0].rm_so = (regoff_t)(found - str);
+  groups[0].rm_eo = (regoff_t)(found - str + text_len);
+  return 1;
+}
+
+/**
+ * @brief Evaluates `STR =~ RE` and records the match in `BASH_REMATCH`.
+ *
+ * On a match, `BASH_REMATCH` holds the matched text and `BASH_REMATCH_N`
+ * the text of the Nth subexpression. Without a match, they are unset.
+ *
+ * @return 1 if the string matches, 0 if not, or -1 if the expression is
+ *         invalid.
+ */
+int MatchConditionalRegex(const char *str, const char *pattern) {
+  static size_t named_groups;  // BASH_REMATCH_N set by the last match
+  RegexCacheEntry *entry = CompileRegex(pattern, REG_EXTENDED);
+  if (!entry) {
+    return -1;
+  }
+
+  regmatch_t groups[kRegexMaxGroups + 1];
+  size_t n = MatchRegex(entry, str, groups, kRegexMaxGroups + 1);
+  char name[48];
+  for (size_t i = 0; i < n; i++) {
+    if (i == 0) {
+      snprintf(name, sizeof(name), "BASH_REMATCH");
+    } else {
+      snprintf(name, sizeof(name), "BASH_REMATCH_%zu", i);
+    }
+    char *text = groups[i].rm_so < 0
+                     ? strdup("")
+                     : strndup(str + groups[i].rm_so,
+                               (size_t)(groups[i].rm_eo - groups[i].rm_so));
+    if (!text || SetShellVariable(name, text) < 0) {
+      fprintf(stderr, "[[: %s: %s\n", name, strerror(errno));
+    }
+    free(text);
+  }
+  if (n == 0) {
+    UnsetShellVariable("BASH_REMATCH");
+  }
+  for (size_t i = n ? n : 1; i <= named_groups; i++) {
+    snprintf(name, sizeof(name), "BASH_REMATCH_%zu", i);
+    UnsetShellVariable(name);
+  }
+  named_groups = n ? n - 1 : 0;
+  return n > 0;
+}
+
+/**
+ * @brief Evaluates the expression of `[[`, `test` or `[`.
+ *
+ * EXPR is `[!] TERM`, where TERM is one of `STR` (true if not empty),
+ * `-n STR`, `-z STR`, `-e PATH`, `-f PATH`, `-d PATH`, `-s PATH` (see
+ * CachedStat()), `STR = STR`, `STR == STR` or `STR != STR`. For `[[`,
+ * the right side of `=`, `==` and `!=` is a glob pattern, `STR < STR`
+ * and `STR > STR` compare the byte order of strings, and `STR =~ RE`
+ * matches an extended regular expression (see MatchConditionalRegex()).
+ *
+ * @param cmd      Name of the built-in, for error messages.
+ * @param expr     The words of the expression.
+ * @param n        Number of words.
+ * @param extended Whether the `[[` forms apply.
+ *
+ * @return 1 if the expression is true, 0 if it is false, or -1 on a syntax
+ *         error or an invalid regular expression.
+ */
+int EvaluateConditional(const char *cmd, char **expr, int n, int extended) {
+  int negate = n > 0 && strcmp(expr[0], "!") == 0;
+  expr += negate;
+  n -= negate;
+
+  int result;
+  struct stat st;
+  if (n == 0) {
+    result = 0;
+  } else if (n == 1) {
+    result = expr[0][0] != '\0';
+  } else if (n == 2 && strcmp(expr[0], "-n") == 0) {
+    result = expr[1][0] != '\0';
+  } else if (n == 2 && strcmp(expr[0], "-z") == 0) {
+    result = expr[1][0] == '\0';
+  } else if (n == 2 && expr[0][0] == '-' && expr[0][1] != '\0' &&
+             strchr("defs", expr[0][1]) && expr[0][2] == '\0') {
+    result = CachedStat(expr[1], &st) == 0 &&
+             (expr[0][1] == 'e' || (expr[0][1] == 'd' && S_ISDIR(st.st_mode)) ||
+              (expr[0][1] == 'f' && S_ISREG(st.st_mode)) ||
+              (expr[0][1] == 's' && st.st_size > 0));
+  } else if (n == 3 &&
+             (strcmp(expr[1], "==") == 0 || strcmp(expr[1], "=") == 0)) {
+    result = extended ? fnmatch(expr[2], expr[0], 0) == 0
+                      : strcmp(expr[0], expr[2]) == 0;
+  } else if (n == 3 && strcmp(expr[1], "!=") == 0) {
+    result = extended ? fnmatch(expr[2], expr[0], 0) != 0
+                      : strcmp(expr[0], expr[2]) != 0;
+  } else if (n == 3 && extended &&
+             (strcmp(expr[1], "<") == 0 || strcmp(expr[1], ">") == 0)) {
+    int order = strcmp(expr[0], expr[2]);
+    result = expr[1][0] == '<' ? order < 0 : order > 0;
+  } else if (n == 3 && extended && strcmp(expr[1], "=~") == 0) {
+    if ((result = MatchConditionalRegex(expr[0], expr[2])) < 0) {
+      return -1;
+    }
+  } else {
+    fprintf(stderr, "%s: syntax error in conditional expression\n", cmd);
+    return -1;
+  }
+  return result != negate;
+}
+
+/**
+ * @brief Built-in `[[`: evaluates a conditional expression.
+ *
+ * Usage: `[[ [!] EXPR ]]`; see EvaluateConditional() for the expressions.
+ * Compiled regular expressions are cached.
+ *
+ * @return 0 if the expression is true, 1 if it is false, or 2 on a syntax
+ *         error or an invalid regular expression.
+ */
+int BuiltinConditional(int argc, char **argv,
+                       int status __attribute__((unused))) {
+  if (strcmp(argv[argc - 1], "]]") != 0) {
+    fprintf(stderr, "[[: missing `]]'\n");
+    return 2;
+  }
+  int result = EvaluateConditional(argv[0], argv + 1, argc - 2, 1);
+  return result < 0 ? 2 : !result;
+}
+
+/**
+ * @brief Built-in `test` (also `[`): evaluates a conditional expression.
+ *
+ * Usage: `test [!] EXPR` or `[ [!] EXPR ]`, where `=`, `==` and `!=`
+ * compare strings; see EvaluateConditional() for the expressions.
+ *
+ * @return 0 if the expression is true, 1 if it is false, or 2 on a syntax
+ *         error.
+ */
+int BuiltinTest(int argc, char **argv, int status __attribute__((unused))) {
+  if (strcmp(argv[0], "[") == 0) {
+    if (strcmp(argv[argc - 1], "]") != 0) {
+      fprintf(stderr, "[: missing `]'\n");
+      return 2;
+    }
+    argc--;
+  }
+  int result = EvaluateConditional(argv[0], argv + 1, argc - 1, 0);
+  return result < 0 ? 2 : !result;
+}
+
+/**
+ * @brief `stat` through the stat cache of the `statcache` option.
+ *
+ * With the option set, the result for a path, failures included, is reused
+ * until the cache is invalidated by bumping `stat_generation`: whenever a
+ * child process is started, and before any command line other than a
+ * single `[[`, `[`, `test`, `local` or `read` without redirections (see
+ * PreservesStatCache()). The cache is bypassed while background jobs or
+ * their compressors run, since they may change files at any time.
+ *
+ * @return 0 on success, or -1 with errno set accordingly.
+ */
+int CachedStat(const char *path, struct stat *st) {
+  Job *jobs = job_table ? (Job *)job_table->data : NULL;
+  int busy = streams && streams->len > 0;
+  for (size_t i = 0; jobs && i < job_table->len && !busy; i++) {
+    busy = jobs[i].running > 0;
+  }
+  if (!shell_options[kOptionStatcache] || busy) {
+    return stat(path, st);
+  }
+
+  uint64_t hash = HashBytes(kFnvOffsetBasis, path, strlen(path));
+  StatCacheEntry *entry = &stat_cache[hash % kStatCacheSize];
+  if (entry->path && entry->generation == stat_generation &&
+      entry->hash == hash && strcmp(entry->path, path) == 0) {
+    *st = entry->st;
+    errno = entry->error;
+    return entry->error ? -1 : 0;
+  }
+
+  int ret = stat(path, st);
+  int error = ret < 0 ? errno : 0;
+  char *copy = strdup(path);
+  if (copy) {
+    free(entry->path);
+    *entry = (StatCacheEntry){copy, hash, stat_generation, error, *st};
+  }
+  errno = error;
+  return ret;
+}
+
+/**
+ * @brief Returns whether a command line leaves the stat cache valid.
+ *
+ * Only a foreground command made of one built-in known to change no file,
+ * without redirections, does.
+ *
+ * @param da_args    Pointer to the DynamicArray containing the tokens.
+ * @param background Whether the command line runs in the background.
+ */
+int PreservesStatCache(DynamicArray *da_args, int background) {
+  char **args = (char **)da_args->data;
+  int known = 0;
+  for (const char *const *name = kStatCachePreserving; *name && !background;
+       name++) {
+    known |= strcmp(args[0], *name) == 0;
+  }
+  for (size_t i = SkipConditionalOperands(args, da_args->len);
+       known && i < da_args->len; i++) {
+    known = args[i] != kWordPipe && GetRedirectType(args[i]) == kNone;
+  }
+  return known;
+}
+
+/**
+ * @brief Built-in `dag`: runs a graph of dependent tasks in parallel.
+ *
+ * Usage: `dag [-j N] [FILE]`. Task definitions are read from FILE, or from
+ * standard input when no file is given (so `dag < tasks` and typing the
+ * definitions followed by ^D both work). Each non-empty line that does not
+ * start with `#` defines one task:
+ *
+ *     name : dep1 dep2 ... : command [args...]
+ *
+ * Up to N tasks (default: number of online CPUs) run at once. Whenever a
+ * worker slot frees up, the ready task with the longest chain of dependents
+ * is started first, so the critical path is never starved by side branches.
+ * A task that fails causes all of its transitive dependents to be skipped.
+ * Once every task has finished, a timing report is printed followed by the
+ * critical path, i.e. the chain of tasks that determined the total run time.
+ *
+ * @return 0 if every task succeeded, 1 if any task failed or was skipped, or
+ *         2 on usage or definition errors.
+ */
+int BuiltinDag(int argc, char **argv, int status) {
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  const char *pathname = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      char *end;
+      jobs = strtol(argv[++i], &end, 10);
+      if (*end != '\0' || jobs <= 0) {
+        fprintf(stderr, "dag: invalid job count: %s\n", argv[i]);
+        return 2;
+      }
+    } else if (!pathname) {
+      pathname = argv[i];
+    } else {
+      fprintf(stderr, "usage: dag [-j N] [FILE]\n");
+      return 2;
+    }
+  }
+  if (jobs <= 0) {
+    jobs = 1;
+  }
+
+  // Standard input is read through a private stream so that the shell's own
+  // buffered input is left untouched
+  FILE *fp = pathname ? fopen(pathname, "r") : fdopen(dup(STDIN_FILENO), "r");
+  if (!fp) {
+    fprintf(stderr, "dag: %s: %s\n", pathname ? pathname : "stdin",
+            strerror(errno));
+    return 2;
+  }
+
+  DynamicArray *da_tasks = InitDynamicArray(kDefaultArraySize, sizeof(DagTask));
+  if (!da_tasks) {
+    PrintError("%s\n", strerror(errno));
+    fclose(fp);
+    return 2;
+  }
+
+  int ret = ReadDagTasks(fp, da_tasks);
+  fclose(fp);
+
+  if (ret == 0) {
+    ret = RunDagTasks(da_tasks, (size_t)jobs, status);
+  }
+  if (ret == 0) {
+    PrintDagReport(da_tasks);
+    DagTask *tasks = (DagTask *)da_tasks->data;
+    for (size_t i = 0; i < da_tasks->len; i++) {
+      if (tasks[i].state != kDagSucceeded) {
+        ret = 1;
+        break;
+      }
+    }
+  }
+
+  FreeDagTasks(da_tasks);
+  return ret;
+}
+
+/**
+ * @brief Parses task definitions and links them into a dependency graph.
+ *
+ * @param fp       Stream to read the definitions from.
+ * @param da_tasks Pointer to an empty DynamicArray of DagTask to fill in.
+ *
+ * @return 0 on success, or 2 if a definition is malformed, refers to an
+ *         unknown task, or the graph contains a cycle.
+ */
+int ReadDagTasks(FILE *fp, DynamicArray *da_tasks) {
+  char *line = NULL;
+  size_t linecap = 0;
+  size_t lineno = 0;
 
-    if (!fgets(cmdline, kInputMax, stdin)) {
-      if (errno = EINTR) {
-        clearerr(stdin);
-        continue;
-      }
-      PrintError("%s\n", strerror(errno));
+  // First pass: collect names, dependency lists and commands
+  while (getline(&line, &linecap, fp) >= 0) {
+    lineno++;
+    line[strcspn(line, "\n")] = '\0';
+
+    char *name = line + strspn(line, " \t");
+    if (*name == '\0' || *name == '#') {
       continue;
     }
 
-    // Remove newline character
-    cmdline[strlen(cmdline) - 1] = '\0';
+    char *deps = strchr(name, ':');
+    char *cmd = deps ? strchr(deps + 1, ':') : NULL;
+    if (!cmd) {
+      fprintf(stderr, "dag: line %zu: expected 'name : deps : command'\n",
+              lineno);
+      free(line);
+      return 2;
+    }
+    *deps++ = '\0';
+    *cmd++ = '\0';
+    name[strcspn(name, " \t")] = '\0';
+    cmd += strspn(cmd, " \t");
+    if (*name == '\0' || *cmd == '\0') {
+      fprintf(stderr, "dag: line %zu: missing task name or command\n", lineno);
+      free(line);
+      return 2;
+    }
 
-    if (*cmdline == '\0') {
-      continue;
+    DagTask task = {0};
+    task.name = strdup(name);
+    task.dep_names = strdup(deps);
+    task.cmdline = strdup(cmd);
+    task.command = strndup(cmd, strcspn(cmd, " \t\n"));
+    task.deps = InitDynamicArray(kDefaultArraySize, sizeof(size_t));
+    task.dependents = InitDynamicArray(kDefaultArraySize, sizeof(size_t));
+    task.gate = kDagNoTask;
+    if (!task.name || !task.dep_names || !task.cmdline || !task.command ||
+        !task.deps || !task.dependents || AppendElement(da_tasks, &task) < 0) {
+      PrintError("%s\n", strerror(errno));
+      free(task.name);
+      free(task.dep_names);
+      free(task.cmdline);
+      free(task.command);
+      FreeDynamicArray(task.deps);
+      FreeDynamicArray(task.dependents);
+      free(line);
+      return 2;
     }
+  }
+  free(line);
 
-    DynamicArray *da_args = TokenizeCommandLine(cmdline);
-    if (!da_args) {
-      PrintError("failed to tokenize command line: %s\n", strerror(errno));
-      continue;
+  // Second pass: resolve dependency names into task indices
+  DagTask *tasks = (DagTask *)da_tasks->data;
+  for (size_t i = 0; i < da_tasks->len; i++) {
+    if (FindDagTask(da_tasks, tasks[i].name) != i) {
+      fprintf(stderr, "dag: duplicate task: %s\n", tasks[i].name);
+      return 2;
     }
 
-    char **args = (char **)da_args->data;
-    if (strcmp(args[0], "cd") == 0) {
-      if (da_args->len < 2) {
-        fprintf(stderr, "cd: missing operand\n");
-        FreeDynamicArray(da_args);
-        status = 1;
-        continue;
+    char *saveptr;
+    for (char *dep = strtok_r(tasks[i].dep_names, " \t", &saveptr); dep;
+         dep = strtok_r(NULL, " \t", &saveptr)) {
+      size_t j = FindDagTask(da_tasks, dep);
+      if (j == kDagNoTask) {
+        fprintf(stderr, "dag: %s: unknown dependency: %s\n", tasks[i].name,
+                dep);
+        return 2;
       }
-
-      char *pathname = args[1];
-      if (chdir(pathname) < 0) {
-        fprintf(stderr, "cd: %s: %s\n", strerror(errno), pathname);
-        FreeDynamicArray(da_args);
-        status = 1;
-        continue;
+      if (AppendElement(tasks[i].deps, &j) < 0 ||
+          AppendElement(tasks[j].dependents, &i) < 0) {
+        PrintError("%s\n", strerror(errno));
+        return 2;
       }
-      goto next_command;
-    } else if (strcmp(args[0], "exit") == 0) {
-      FreeDynamicArray(da_args);
-      exit(status);
+      tasks[i].pending++;
     }
+  }
 
-    pid_t pid = fork();
-    if (pid < 0) {
-      FreeDynamicArray(da_args);
-      PrintError("fork failed: %s\n", strerror(errno));
-      status = 1;
-      continue;
-    } else if (pid == 0) {
-      // Restore original disposition for SIGINT
-      if (sigaction(SIGINT, &oldact, NULL) < 0) {
-        perror("sigaction");
-        exit(EXIT_FAILURE);
+  // Rank tasks by the length of their longest chain of dependents, visiting
+  // them in reverse topological order. Unvisited tasks belong to a cycle.
+  DynamicArray *da_order = TopologicalOrder(da_tasks);
+  if (!da_order) {
+    PrintError("%s\n", strerror(errno));
+    return 2;
+  }
+  if (da_order->len != da_tasks->len) {
+    fprintf(stderr, "dag: dependency cycle detected\n");
+    FreeDynamicArray(da_order);
+    return 2;
+  }
+
+  size_t *order = (size_t *)da_order->data;
+  for (size_t k = da_order->len; k-- > 0;) {
+    DagTask *task = &tasks[order[k]];
+    size_t *dependents = (size_t *)task->dependents->data;
+    task->rank = 1;
+    for (size_t d = 0; d < task->dependents->len; d++) {
+      if (tasks[dependents[d]].rank + 1 > task->rank) {
+        task->rank = tasks[dependents[d]].rank + 1;
       }
+    }
+  }
+  FreeDynamicArray(da_order);
+
+  return 0;
+}
+
+/**
+ * @brief Computes a topological order of the task graph (Kahn's algorithm).
+ *
+ * @param da_tasks Pointer to the DynamicArray of linked DagTask entries.
+ *
+ * @return A DynamicArray of task indices in dependency order, or NULL on
+ *         allocation failure. If the graph has a cycle, the array is shorter
+ *         than the number of tasks.
+ */
+DynamicArray *TopologicalOrder(DynamicArray *da_tasks) {
+  DagTask *tasks = (DagTask *)da_tasks->data;
+  DynamicArray *da_order = InitDynamicArray(da_tasks->len + 1, sizeof(size_t));
+  size_t *indegree = calloc(da_tasks->len + 1, sizeof(size_t));
+  if (!da_order || !indegree) {
+    FreeDynamicArray(da_order);
+    free(indegree);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < da_tasks->len; i++) {
+    indegree[i] = tasks[i].deps->len;
+    if (indegree[i] == 0) {
+      AppendElement(da_order, &i);
+    }
+  }
 
-      Process *proc = InitProcess();
-      if (!proc) {
-        FreeDynamicArray(da_args);
-        PrintError("failed to initialize process: %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
+  // The order array doubles as the queue; its capacity never needs to grow
+  for (size_t head = 0; head < da_order->len; head++) {
+    DagTask *task = &tasks[((size_t *)da_order->data)[head]];
+    size_t *dependents = (size_t *)task->dependents->data;
+    for (size_t d = 0; d < task->dependents->len; d++) {
+      if (--indegree[dependents[d]] == 0) {
+        AppendElement(da_order, &dependents[d]);
       }
+    }
+  }
 
-      if (ParseCommand(proc, da_args, status) < 0) {
-        free(proc);
-        FreeDynamicArray(da_args);
-        exit(EXIT_FAILURE);
+  free(indegree);
+  return da_order;
+}
+
+/**
+ * @brief Executes the task graph with at most `jobs` tasks running at once.
+ *
+ * @param da_tasks Pointer to the DynamicArray of ranked DagTask entries.
+ * @param jobs     Maximum number of tasks running concurrently.
+ * @param status   The exit status of the last executed command, for
+ *                 substitution in task command lines.
+ *
+ * @return 0 once every task has finished or been skipped, or 2 if the
+ *         scheduler itself failed.
+ */
+int RunDagTasks(DynamicArray *da_tasks, size_t jobs, int status) {
+  DagTask *tasks = (DagTask *)da_tasks->data;
+  size_t running = 0;
+  size_t remaining = da_tasks->len;
+  double origin = MonotonicSeconds();
+
+  while (remaining > 0) {
+    // Fill free slots with the ready tasks that head the longest chains
+    while (running < jobs) {
+      size_t next = kDagNoTask;
+      for (size_t i = 0; i < da_tasks->len; i++) {
+        if (tasks[i].state == kDagWaiting && tasks[i].pending == 0 &&
+            (next == kDagNoTask || tasks[i].rank > tasks[next].rank)) {
+          next = i;
+        }
+      }
+      if (next == kDagNoTask) {
+        break;
       }
 
-      execvp(proc->cmd, proc->args);
-      if (errno == ENOENT) {
-        PrintError("unrecognized command: %s\n", proc->cmd);
-      } else {
-        fprintf(stderr, "exec: %s\n", strerror(errno));
+      // With the `admit` option, hold the task back until memory and
+      // capacity allow it; the first task always starts
+      uint64_t committed = JobsPendingGrowth();
+      for (size_t i = 0; i < da_tasks->len; i++) {
+        if (tasks[i].state == kDagRunning) {
+          committed += PendingGrowth(tasks[i].pid, tasks[i].command);
+        }
+      }
+      if (running > 0 && shell_options[kOptionAdmit] &&
+          !AdmitJob(EstimateMemory(tasks[next].command), committed)) {
+        break;
       }
 
-      // exec failed
+      DagTask *task = &tasks[next];
+      task->start = MonotonicSeconds() - origin;
+      task->state = kDagRunning;
+
+      char *cmdline = strdup(task->cmdline);
+      DynamicArray *da_args = cmdline ? TokenizeCommandLine(cmdline) : NULL;
+      DynamicArray *expanded = NULL;
+      task->pid = (da_args && da_args->len > 0 &&
+                   ExpandVariables(da_args, status, &expanded) == 0)
+                      ? LaunchProcess(da_args, status, NULL)
+                      : -1;
+      FreePathList(expanded);
       FreeDynamicArray(da_args);
-      CleanupRedirection(proc);
-      free(proc);
-      exit(EXIT_FAILURE);
-    } else {
-      int wstatus;
-      if (waitpid(pid, &wstatus, 0) < 0) {
-        FreeDynamicArray(da_args);
-        PrintError("wait failed: %s\n", strerror(errno));
+      free(cmdline);
+
+      if (task->pid < 0) {
+        fprintf(stderr, "dag: %s: failed to start: %s\n", task->name,
+                strerror(errno));
+        task->end = task->start;
+        task->status = 1;
+        remaining -= FinishDagTask(da_tasks, next, kDagFailed);
         continue;
       }
+      running++;
+    }
 
-      if (WIFEXITED(wstatus)) {
-        status = WEXITSTATUS(wstatus);
-      } else if (WIFSIGNALED(wstatus)) {
-        status = 128 + WTERMSIG(wstatus);
-      } else {
-        status = wstatus;
+    if (running == 0) {
+      continue;  // Only skipped tasks were left
+    }
+
+    int wstatus;
+    struct rusage ru;
+    pid_t pid = wait4(-1, &wstatus, 0, &ru);
+    if (pid < 0) {
+      if (errno == EINTR) {
+        continue;
       }
+      PrintError("wait failed: %s\n", strerror(errno));
+      return 2;
     }
 
-  next_command:
-    FreeDynamicArray(da_args);
+    size_t i = 0;
+    while (i < da_tasks->len &&
+           !(tasks[i].state == kDagRunning && tasks[i].pid == pid)) {
+      i++;
+    }
+    if (i == da_tasks->len) {
+      NoteJobExit(pid, wstatus, &ru);  // A background job finished meanwhile
+      continue;
+    }
+    RecordStageStats(tasks[i].command, origin + tasks[i].start, &ru);
+    tasks[i].end = MonotonicSeconds() - origin;
+    tasks[i].status = DecodeWaitStatus(wstatus);
+    running--;
+    remaining -= FinishDagTask(
+        da_tasks, i, tasks[i].status == 0 ? kDagSucceeded : kDagFailed);
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Records the outcome of a task and releases or skips its dependents.
+ *
+ * Dependents of a successful task become ready once all of their other
+ * dependencies have succeeded too. Dependents of a failed or skipped task are
+ * skipped, recursively.
+ *
+ * @param da_tasks Pointer to the DynamicArray of DagTask entries.
+ * @param index    Index of the task that finished.
+ * @param state    Final state of the task.
+ *
+ * @return The number of tasks that reached a final state, including `index`.
+ */
+size_t FinishDagTask(DynamicArray *da_tasks, size_t index, DagState state) {
+  DagTask *tasks = (DagTask *)da_tasks->data;
+  DagTask *task = &tasks[index];
+  size_t *dependents = (size_t *)task->dependents->data;
+  size_t finished = 1;
+
+  task->state = state;
+  for (size_t d = 0; d < task->dependents->len; d++) {
+    DagTask *dependent = &tasks[dependents[d]];
+    if (dependent->state != kDagWaiting) {
+      continue;
+    }
+
+    // The last dependency to finish is the one that gated the dependent
+    dependent->pending--;
+    dependent->gate = index;
+    if (state != kDagSucceeded) {
+      dependent->start = dependent->end = task->end;
+      finished += FinishDagTask(da_tasks, dependents[d], kDagSkipped);
+    }
+  }
+  return finished;
+}
+
+/**
+ * @brief Prints the per-task timing table and the critical path.
+ *
+ * @param da_tasks Pointer to the DynamicArray of finished DagTask entries.
+ */
+void PrintDagReport(DynamicArray *da_tasks) {
+  static const char *const kStateNames[] = {"waiting", "running", "ok",
+                                            "failed", "skipped"};
+  DagTask *tasks = (DagTask *)da_tasks->data;
+  size_t last = kDagNoTask;
+
+  printf("%-20s %-8s %6s %10s %10s\n", "TASK", "STATE", "EXIT", "START",
+         "DURATION");
+  for (size_t i = 0; i < da_tasks->len; i++) {
+    DagTask *task = &tasks[i];
+    printf("%-20s %-8s %6d %9.3fs %9.3fs\n", task->name,
+           kStateNames[task->state], task->status, task->start,
+           task->end - task->start);
+    if (last == kDagNoTask || task->end > tasks[last].end) {
+      last = i;
+    }
+  }
+  if (last == kDagNoTask) {
+    return;
+  }
+
+  printf("critical path (%.3fs):", tasks[last].end);
+  DynamicArray *da_path = InitDynamicArray(kDefaultArraySize, sizeof(size_t));
+  if (!da_path) {
+    printf("\n");
+    return;
+  }
+  for (size_t i = last; i != kDagNoTask; i = tasks[i].gate) {
+    AppendElement(da_path, &i);
+  }
+  size_t *path = (size_t *)da_path->data;
+  for (size_t k = da_path->len; k-- > 0;) {
+    DagTask *task = &tasks[path[k]];
+    printf(" %s (%.3fs)%s", task->name, task->end - task->start,
+           k > 0 ? " ->" : "");
+  }
+  printf("\n");
+  FreeDynamicArray(da_path);
+}
+
+/**
+ * @brief Finds a task by name.
+ *
+ * @return The index of the task, or `kDagNoTask` if there is none.
+ */
+size_t FindDagTask(DynamicArray *da_tasks, const char *name) {
+  DagTask *tasks = (DagTask *)da_tasks->data;
+  for (size_t i = 0; i < da_tasks->len; i++) {
+    if (strcmp(tasks[i].name, name) == 0) {
+      return i;
+    }
+  }
+  return kDagNoTask;
+}
+
+/**
+ * @brief Frees a DynamicArray of DagTask along with everything it owns.
+ */
+void FreeDagTasks(DynamicArray *da_tasks) {
+  DagTask *tasks = (DagTask *)da_tasks->data;
+  for (size_t i = 0; i < da_tasks->len; i++) {
+    free(tasks[i].name);
+    free(tasks[i].dep_names);
+    free(tasks[i].cmdline);
+    free(tasks[i].command);
+    FreeDynamicArray(tasks[i].deps);
+    FreeDynamicArray(tasks[i].dependents);
+  }
+  FreeDynamicArray(da_tasks);
+}
+
+/**
+ * @brief Builds the path of a file in the user's cache directory.
+ *
+ * The cache directory is `$XDG_CACHE_HOME`, or `~/.cache` if it is unset,
+ * and is created if it does not exist yet.
+ *
+ * @param name Name of the file inside the cache directory.
+ * @param buf  Buffer receiving the path.
+ * @param size Size of the buffer.
+ *
+ * @return 0 on success, or -1 on error with errno set accordingly.
+ */
+int GetCachePath(const char *name, char *buf, size_t size) {
+  const char *cache = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char dir[kPathMax];
+
+  if (cache && *cache) {
+    snprintf(dir, sizeof(dir), "%s", cache);
+  } else if (home && *home) {
+    snprintf(dir, sizeof(dir), "%s/.cache", home);
+  } else {
+    errno = ENOENT;
+    return -1;
+  }
+
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+    return -1;
+  }
+  snprintf(buf, size, "%s/%s", dir, name);
+  return 0;
+}
+
+/**
+ * @brief Converts a timeval into microseconds.
+ */
+uint64_t TimevalMicroseconds(const struct timeval *tv) {
+  return (uint64_t)tv->tv_sec * 1000000 + (uint64_t)tv->tv_usec;
+}
+
+/**
+ * @brief Returns the current time of the monotonic clock, in seconds.
+ */
+double MonotonicSeconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Prints the prompt: `PS1` followed by a space if it is set, or the
+ *        default prompt string. Lines continuing a command get `PS2`, or
+ *        `> `, instead.
+ */
+void PrintPrompt(void) {
+  const char *ps1 = getenv("PS1");
+  const char *ps2 = getenv("PS2");
+  if (reading_continuation) {
+    printf("%s", ps2 ? ps2 : kContinuationPrompt);
+  } else {
+    ps1 ? printf("%s ", ps1) : ExpandPromptString();
   }
+  fflush(stdout);
 }
 
 /**
@@ -211,6 +9737,87 @@ void ExpandPromptString(void) {
   fflush(stdout);
 }
 
+/**
+ * @brief Returns the canonical copy of a string from the intern table.
+ *
+ * The table starts with the words the shell compares tokens against, such
+ * as operators, whose canonical copies are the `kWord` constants. Command
+ * names are added as they are resolved. Canonical copies live as long as
+ * the shell and must not be modified, so equal interned strings can be
+ * compared as pointers.
+ *
+ * @param str    The string to look up.
+ * @param insert Whether to add the string if it is not in the table yet.
+ *
+ * @return The canonical copy, or NULL if the string is not interned (or
+ *         could not be added, with errno set accordingly).
+ */
+const char *InternString(const char *str, int insert) {
+  if (!intern_slots) {
+    intern_capacity = kInternInitialSlots;
+    intern_slots = calloc(intern_capacity, sizeof(InternSlot));
+    if (!intern_slots) {
+      return NULL;
+    }
+    for (const char *const *word = kInternedWords; *word; word++) {
+      InsertInterned(*word, HashBytes(kFnvOffsetBasis, *word, strlen(*word)));
+    }
+  }
+
+  uint64_t hash = HashBytes(kFnvOffsetBasis, str, strlen(str));
+  for (size_t i = hash & (intern_capacity - 1);; i = (i + 1) &
+                                                     (intern_capacity - 1)) {
+    const InternSlot *slot = &intern_slots[i];
+    if (!slot->str) {
+      break;
+    }
+    if (slot->hash == hash && strcmp(slot->str, str) == 0) {
+      return slot->str;
+    }
+  }
+  if (!insert) {
+    return NULL;
+  }
+
+  // Keep at least half of the slots free, so that probes stay short
+  if (2 * (intern_count + 1) > intern_capacity) {
+    InternSlot *old = intern_slots;
+    size_t old_capacity = intern_capacity;
+    intern_slots = calloc(2 * old_capacity, sizeof(InternSlot));
+    if (!intern_slots) {
+      intern_slots = old;
+      return NULL;
+    }
+    intern_capacity = 2 * old_capacity;
+    intern_count = 0;
+    for (size_t i = 0; i < old_capacity; i++) {
+      if (old[i].str) {
+        InsertInterned(old[i].str, old[i].hash);
+      }
+    }
+    free(old);
+  }
+
+  char *copy = strdup(str);
+  if (copy) {
+    InsertInterned(copy, hash);
+  }
+  return copy;
+}
+
+/**
+ * @brief Adds a string known to be absent to the intern table, which has
+ *        room for it.
+ */
+void InsertInterned(const char *str, uint64_t hash) {
+  size_t i = hash & (intern_capacity - 1);
+  while (intern_slots[i].str) {
+    i = (i + 1) & (intern_capacity - 1);
+  }
+  intern_slots[i] = (InternSlot){str, hash};
+  intern_count++;
+}
+
 /**
  * @brief Tokenizes the command line input.
  *
@@ -218,6 +9825,10 @@ void ExpandPromptString(void) {
  * not treat text within quotes as a single token. The tokens are stored in a
  * dynamic array, which is returned to the caller.
  *
+ * Tokens found in the intern table are replaced by their canonical copy,
+ * so that operators and known command names are recognized by comparing
+ * pointers. Such tokens must not be modified.
+ *
  * @param cmdline The command line input to be tokenized.
  *
  * @return A pointer to a DynamicArray containing the tokens, or NULL if an
@@ -236,6 +9847,10 @@ DynamicArray *TokenizeCommandLine(char *cmdline) {
     if (!token) {
       break;
     }
+    const char *word = InternString(token, 0);
+    if (word) {
+      token = (char *)word;
+    }
 
     if (AppendElement(da_tokens, &token) < 0) {
       FreeDynamicArray(da_tokens);
@@ -243,27 +9858,99 @@ DynamicArray *TokenizeCommandLine(char *cmdline) {
     }
   }
 
+  // Leave room for the NULL terminator of the argument vector
+  if (da_tokens->len >= da_tokens->size &&
+      ResizeDynamicArray(da_tokens, da_tokens->size + 1) < 0) {
+    FreeDynamicArray(da_tokens);
+    return NULL;
+  }
+
   return da_tokens;
 }
 
+/**
+ * @brief Expands variables in the tokens of a command line.
+ *
+ * `$NAME` and `${NAME}` are replaced by the value of the variable, empty if
+ * it is unset, and `$?` by the exit status of the last command. Each token
+ * stays one word, whatever the values contain. A `$` that starts no
+ * expansion is kept as is.
+ *
+ * @param da_args  Pointer to the DynamicArray containing the tokens.
+ * @param status   The exit status of the last executed command.
+ * @param expanded Receives the strings allocated for expanded tokens, to be
+ *                 freed with FreePathList() once the command is done, or
+ *                 NULL if no token changed.
+ *
+ * @return 0 on success, or -1 on error with errno set accordingly.
+ */
+int ExpandVariables(DynamicArray *da_args, int status,
+                    DynamicArray **expanded) {
+  char **args = (char **)da_args->data;
+  *expanded = NULL;
+  for (size_t i = 0; i < da_args->len; i++) {
+    if (!strchr(args[i], '$')) {
+      continue;
+    }
+
+    char *word = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&word, &size);
+    if (!out) {
+      return -1;
+    }
+    for (const char *p = args[i]; *p;) {
+      if (p[0] == '$' && p[1] == '?') {
+        fprintf(out, "%d", status);
+        p += 2;
+        continue;
+      }
+      int braced = p[0] == '$' && p[1] == '{';
+      const char *name = p + 1 + braced;
+      size_t len = 0;
+      if (p[0] == '$' && (isalpha((unsigned char)*name) || *name == '_')) {
+        while (isalnum((unsigned char)name[len]) || name[len] == '_') {
+          len++;
+        }
+      }
+      if (len == 0 || (braced && name[len] != '}')) {
+        fputc(*p++, out);
+        continue;
+      }
+
+      char *key = strndup(name, len);
+      const char *value = key ? GetShellVariable(key) : NULL;
+      fputs(value ? value : "", out);
+      free(key);
+      p = name + len + braced;
+    }
+    if (fclose(out) != 0 ||
+        (!*expanded &&
+         !(*expanded = InitDynamicArray(kDefaultArraySize, sizeof(char *)))) ||
+        AppendElement(*expanded, &word) < 0) {
+      free(word);
+      return -1;
+    }
+    args[i] = word;
+  }
+  return 0;
+}
+
 /**
  * @brief Parses the command and its arguments for execution.
  *
  * Analyzes the tokens from the tokenized command line to set up the command
  * and its arguments for execution. It handles redirections by modifying file
- * descriptors as specified by the command. Also replaces the exit status
- * variable with the actual status.
+ * descriptors as specified by the command.
  *
  * @param proc    Pointer to the Process structure to be filled with the
  *                command and its arguments.
  * @param da_args Pointer to the DynamicArray containing the tokenized command
  *                line.
- * @param status  The exit status of the last executed command, for
- *                substitution in the command line.
  *
  * @return 0 on success, or -1 if an error occurs, with errno set accordingly.
  */
-int ParseCommand(Process *proc, DynamicArray *da_args, int status) {
+int ParseCommand(Process *proc, DynamicArray *da_args) {
   if (da_args->len == 0) {
     proc->cmd = "";
     proc->args = NULL;
@@ -271,7 +9958,8 @@ int ParseCommand(Process *proc, DynamicArray *da_args, int status) {
   }
 
   char **args = (char **)da_args->data;
-  for (size_t i = 0; i < da_args->len; i++) {
+  for (size_t i = SkipConditionalOperands(args, da_args->len);
+       i < da_args->len; i++) {
     RedirectType rtype = GetRedirectType(args[i]);
     if (rtype == kNone) {
       continue;
@@ -286,7 +9974,7 @@ int ParseCommand(Process *proc, DynamicArray *da_args, int status) {
     char *pathname = args[i + 1];
     switch (rtype) {
       case kRedirectIn:
-        if ((newfd = open(pathname, O_RDONLY)) < 0) {
+        if ((newfd = OpenRedirectTarget(pathname, rtype)) < 0) {
           PrintError("failed open: %s: %s", strerror(errno), pathname);
           return -1;
         }
@@ -298,7 +9986,7 @@ int ParseCommand(Process *proc, DynamicArray *da_args, int status) {
         break;
 
       case kRedirectOut:
-        if ((newfd = open(pathname, O_CREAT | O_TRUNC | O_WRONLY, 0664)) < 0) {
+        if ((newfd = OpenRedirectTarget(pathname, rtype)) < 0) {
           PrintError("failed open: %s: %s\n", pathname, strerror(errno));
           return -1;
         }
@@ -310,7 +9998,7 @@ int ParseCommand(Process *proc, DynamicArray *da_args, int status) {
         break;
 
       case kRedirectAppend:
-        if ((newfd = open(pathname, O_CREAT | O_WRONLY | O_APPEND, 0664)) < 0) {
+        if ((newfd = OpenRedirectTarget(pathname, rtype)) < 0) {
           PrintError("failed open: %s: %s\n", pathname, strerror(errno));
           return -1;
         }
@@ -322,7 +10010,7 @@ int ParseCommand(Process *proc, DynamicArray *da_args, int status) {
         break;
 
       case kRedirectErr:
-        if ((newfd = open(pathname, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
+        if ((newfd = OpenRedirectTarget(pathname, rtype)) < 0) {
           PrintError("failed open: %s: %s\n", pathname, strerror(errno));
           return -1;
         }
@@ -334,7 +10022,7 @@ int ParseCommand(Process *proc, DynamicArray *da_args, int status) {
         break;
 
       case kRedirectOutErr:
-        if ((newfd = open(pathname, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
+        if ((newfd = OpenRedirectTarget(pathname, rtype)) < 0) {
           PrintError("failed open: %s: %s\n", pathname, strerror(errno));
           return -1;
         }
@@ -362,10 +10050,6 @@ int ParseCommand(Process *proc, DynamicArray *da_args, int status) {
   }
 
   proc->cmd = args[0];
-  if (strcmp(proc->cmd, "echo") == 0) {
-    ReplaceExitStatusVariable(da_args, status);
-  }
-
   proc->args = args;
   proc->args[da_args->len] = NULL;
 
@@ -500,31 +10184,110 @@ redirect_error:
  * Analyzes the redirection operator provided as input and returns the
  * corresponding redirection type.
  *
- * @param op The redirection operator as a string (e.g., ">", ">>", "<").
+ * @param op The redirection operator (e.g., ">", ">>", "<"), as a token
+ *           from TokenizeCommandLine(), where operators are interned.
  *
  * @return The `RedirectType` enumeration value corresponding to the operator,
  *         or kNone if the operator does not match any known redirection type.
  */
 RedirectType GetRedirectType(const char *op) {
-  if (strcmp(op, "<") == 0) {
+  if (op == kWordRedirectIn) {
     return kRedirectIn;
   }
-  if (strcmp(op, ">") == 0 || strcmp(op, "1>") == 0) {
+  if (op == kWordRedirectOut || op == kWordRedirectStdout ||
+      op == kWordRedirectClobber) {
     return kRedirectOut;
   }
-  if (strcmp(op, ">>") == 0) {
+  if (op == kWordRedirectAppend) {
     return kRedirectAppend;
   }
-  if (strcmp(op, "2>") == 0) {
+  if (op == kWordRedirectErr) {
     return kRedirectErr;
   }
-  if (strcmp(op, "&>") == 0) {
+  if (op == kWordRedirectOutErr) {
     return kRedirectOutErr;
   }
 
   return kNone;
 }
 
+/**
+ * @brief Finds where redirections may start in the words of a command.
+ *
+ * Between `[[` and `]]`, `<` and `>` compare strings (see
+ * EvaluateConditional()), so only the words after `]]` can redirect.
+ *
+ * @param args The words of the command.
+ * @param len  Number of words.
+ *
+ * @return The index of the word after the first `]]` if the command is
+ *         `[[`, the index of the first `|` or `&` if `]]` is missing, or
+ *         0 for any other command.
+ */
+size_t SkipConditionalOperands(char **args, size_t len) {
+  if (len == 0 || strcmp(args[0], "[[") != 0) {
+    return 0;
+  }
+  size_t i = 1;
+  while (i < len && args[i] != kWordPipe && args[i] != kWordBackground &&
+         strcmp(args[i], "]]") != 0) {
+    i++;
+  }
+  return i < len && strcmp(args[i], "]]") == 0 ? i + 1 : i;
+}
+
+/**
+ * @brief Gives the `open` flags and mode for a redirection.
+ *
+ * @return The flags, or -1 if the type is not a redirection.
+ */
+int RedirectOpenFlags(RedirectType rtype, mode_t *mode) {
+  *mode = rtype == kRedirectOut || rtype == kRedirectAppend ? 0664 : 0644;
+  switch (rtype) {
+    case kRedirectIn:
+      return O_RDONLY;
+    case kRedirectAppend:
+      return O_CREAT | O_WRONLY | O_APPEND;
+    case kRedirectOut:
+    case kRedirectErr:
+    case kRedirectOutErr:
+      return O_CREAT | O_TRUNC | O_WRONLY;
+    default:
+      return -1;
+  }
+}
+
+/**
+ * @brief Opens the target of a redirection, unless it was opened ahead of
+ *        time by `PreopenRedirections()`.
+ *
+ * @param pathname The target, as a pointer into the tokenized command line.
+ * @param rtype    The type of redirection.
+ *
+ * @return A file descriptor, or -1 on error with errno set accordingly.
+ */
+int OpenRedirectTarget(const char *pathname, RedirectType rtype) {
+  PreopenedFile *files = preopened ? (PreopenedFile *)preopened->data : NULL;
+  for (size_t i = 0; files && i < preopened->len; i++) {
+    if (files[i].target == pathname && (files[i].fd >= 0 || files[i].error)) {
+      int fd = files[i].fd;
+      errno = files[i].error;
+      files[i].fd = -1;
+      files[i].error = 0;
+      return fd;
+    }
+  }
+
+  // Compressed targets need a stream, started before forking
+  if (IsStreamTarget(pathname)) {
+    errno = ENOTSUP;
+    return -1;
+  }
+  mode_t mode;
+  int flags = RedirectOpenFlags(rtype, &mode);
+  return open(pathname, flags, mode);
+}
+
 /**
  * @brief Cleans up redirections and restores original file descriptors.
  *
@@ -584,37 +10347,23 @@ int CleanupRedirection(Process *proc) {
 }
 
 /**
- * @brief Replaces the exit status variable in the command arguments.
+ * @brief Signal handler for SIGINT.
  *
- * Searches for the exit status variable `$?` in the command arguments and
- * replaces it with the actual exit status of the last executed command.
+ * Prints a newline upon a SIGINT is received, and counts it.
  *
- * @param da_args Pointer to the DynamicArray containing the command arguments.
- * @param status  The exit status of the last executed command to substitute
- *                for `$?`.
+ * @param signum The signal number of the received signal, unused in this
+ *               handler.
  */
-void ReplaceExitStatusVariable(DynamicArray *da_args, int status) {
-  char **args = (char **)da_args->data;
-  char status_str[12];
-
-  sprintf(status_str, "%d", status);
-
-  for (size_t i = 0; i < da_args->len; i++) {
-    if (strcmp(args[i], "$?") == 0) {
-      strcpy(args[i], status_str);
-    }
-  }
+void sigint_handler(int signum __attribute__((unused))) {
+  sigint_count++;
+  printf("\n");
 }
 
 /**
- * @brief Signal handler for SIGINT.
- *
- * Prints a newline upon a SIGINT is received.
- *
- * @param signum The signal number of the received signal, unused in this
- *               handler.
+ * @brief Signal handler for `kStageCancelSignal`, which does nothing but
+ *        interrupt the system call of a pipeline stage thread.
  */
-void sigint_handler(int signum __attribute__((unused))) { printf("\n"); }
+void stage_cancel_handler(int signum __attribute__((unused))) {}
 
 /**
  * @brief Prints a formatted error message to stderr.
@@ -623,14 +10372,16 @@ void sigint_handler(int signum __attribute__((unused))) { printf("\n"); }
  * including the function name and line number from where the error originated,
  * improving debuggability.
  *
+ * @param func   Name of the function reporting the error.
+ * @param line   Line number the error is reported from.
  * @param format The format string for the error message, followed by any
  *               arguments needed for formatting, similar to printf.
  */
-void _PrintError(const char *format, ...) {
+void _PrintError(const char *func, int line, const char *format, ...) {
   va_list args;
   va_start(args, format);
 
-  fprintf(stderr, "shell: ");
+  fprintf(stderr, "shell: %s:%d: ", func, line);
   vfprintf(stderr, format, args);
 
   va_end(args);
@@ -702,7 +10453,6 @@ int AppendElement(DynamicArray *da, void *elem) {
     if (ResizeDynamicArray(da, da->size * 2) < 0) {
       return -1;
     }
-    da->size *= 2;
   }
 
   // Using char* enables copying byte-to-byte
@@ -1,18 +1,46 @@
 #ifndef SHELL_H_
 #define SHELL_H_
 
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <glob.h>
 #include <libgen.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <regex.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
+
+#include "shell_builtin.h"
 
 #define PrintError(format, ...) \
   _PrintError(__func__, __LINE__, format, ##__VA_ARGS__)
@@ -24,6 +52,21 @@ typedef struct {
   size_t type_size;
 } DynamicArray;
 
+// Why the command being read continues on the next line
+typedef enum {
+  kContinueNone,
+  kContinuePipe,
+  kContinueBackslash,
+} ContinueReason;
+
+// Command read so far, over one or more lines
+typedef struct {
+  char *text;
+  size_t len;
+  size_t size;
+  ContinueReason pending;  // of the last line added
+} CommandBuffer;
+
 typedef struct {
   char *cmd;
   char **args;
@@ -40,23 +83,858 @@ typedef enum {
   kNone
 } RedirectType;
 
+#define kCommandCacheSize 256  // slots, each keeping one command name
+#define kGzipPrefix "gz:"
+#define kLineBufferSize 4096
+#define kMaxFieldRanges 16
+#define kMaxSpawnLimits 8
+#define kRegexCacheSize 32  // compiled patterns kept by `[[ =~ ]]`
+#define kRegexMaxGroups 9  // subexpressions stored in BASH_REMATCH_N
+#define kStatCacheSize 64  // slots, each keeping one path
+#define kSysfsCpuRoot "/sys/devices/system/cpu"
+#define kSysfsNodeRoot "/sys/devices/system/node"
+#define kTextBufferSize (64 * 1024)
+#define kVectorBytes 16
+
+typedef struct {
+  int resource;
+  struct rlimit lim;
+} ResourceLimit;
+
+typedef struct {
+  int stdin_fd, stdout_fd, stderr_fd;  // replace the standard streams
+                                       // unless negative
+  pid_t pgid;  // process group to join, 0 for a new one, -1 to inherit
+  int set_nice, nice_inc;    // niceness increment, as with nice(1)
+  int ioprio;                // value for ioprio_set, unless negative
+  int set_affinity;
+  cpu_set_t affinity;
+  int umask;   // file mode creation mask, unless negative
+  int dir_fd;     // working directory, unless negative
+  int cgroup_fd;  // cgroup directory to join, unless negative
+  size_t nlimits;
+  ResourceLimit limits[kMaxSpawnLimits];
+} SpawnAttributes;
+
+typedef enum {
+  kOptionAdmit,
+  kOptionAutopar,
+  kOptionCapture,
+  kOptionHighlight,
+  kOptionLastpipe,
+  kOptionPipeprof,
+  kOptionPlacement,
+  kOptionStatcache,
+  kOptionStatwarn,
+  kOptionUring,
+  kOptionCount
+} ShellOption;
+
+typedef enum {
+  kPlacementNone,
+  kPlacementSpread,
+  kPlacementCompact,
+  kPlacementNuma
+} PlacementPolicy;
+
+typedef struct {
+  char *data;     // mapped twice in a row, so no access ever wraps
+  size_t size;
+  uint64_t head;  // bytes written so far
+  int fd;         // read end of the capture pipe, or -1 after EOF
+  int reading;    // a read into the ring is queued in the io_uring
+} OutputRing;
+
+typedef struct {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  unsigned sq_entries;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+  unsigned queued;     // SQEs not submitted yet
+  unsigned in_flight;  // requests without a completion yet, except cancels
+  int has_waitid;
+  pid_t owner;  // process that set the ring up; forked children must not
+                // share it
+} IoUring;
+
+typedef struct {
+  const char *target;  // redirection target, as a pointer into the tokens
+  int fd;              // opened file, or -1 once taken or if opening failed
+  int error;           // errno value if opening failed
+} PreopenedFile;
+
+typedef struct {
+  char memory_max[32];  // values for the cgroup files, empty if unset
+  char cpu_max[32];
+} JobLimits;
+
+typedef struct {
+  int id;  // job number, as in %N
+  pid_t pgid;
+  pid_t *pids;   // one per pipeline stage, -1 once reaped
+  char **names;  // command of each stage, for statistics
+  size_t npids;
+  size_t running;
+  int queued;       // waiting for admission, not started yet
+  int reported;     // finished and reported, kept for its output
+  int last_status;  // value of $? when the job was submitted
+  int status;       // exit status of the last stage
+  double start;
+  char *cmdline;
+  JobLimits limits;
+  int cgroup_fd;  // directory of the job's cgroup, or -1
+  char cgroup[48];
+  OutputRing *output;  // captured output, or NULL
+} Job;
+
+typedef struct {
+  long long cpu_us, memory_bytes, io_bytes;  // -1 if unknown
+} JobUsage;
+
+typedef struct {
+  uint64_t mem_total_kb, mem_available_kb;
+  double mem_pressure, io_pressure;  // PSI "some avg10", negative if unknown
+  double loadavg;                    // one-minute load average
+  long ncpus;
+} SystemLoad;
+
+typedef struct {
+  int cpu;
+  int node;
+  int llc;        // lowest CPU sharing the last-level cache
+  int core;       // lowest CPU of the same physical core
+  int thread;     // index among the SMT siblings of the core
+  int core_rank;  // index of the core within its last-level cache
+  int llc_rank;   // index of the last-level cache within its node
+} CpuInfo;
+
+typedef struct {
+  CpuInfo *cpus;
+  size_t ncpus;
+  size_t *compact;  // CPU indices, neighbours close together
+  size_t *spread;   // CPU indices, neighbours far apart
+  int *nodes;       // distinct NUMA nodes
+  size_t nnodes;
+  size_t next;  // round-robin position of the next job
+} CpuTopology;
+
+typedef struct {
+  DynamicArray *reads;   // normalized paths the command may read
+  DynamicArray *writes;  // normalized paths the command may write
+} FileEffects;
+
+typedef struct {
+  pid_t pid;
+  char *name;          // command, for admission estimates
+  int out_fd, err_fd;  // memory files capturing the command's output
+  FileEffects effects;
+  double start;
+  int done;
+  int status;
+} ParallelCommand;
+
+typedef struct {
+  DynamicArray *in_flight;  // ParallelCommand entries, in script order
+  FileEffects pending;      // effects annotated for the next command
+  int annotated;
+  size_t max_jobs;
+  int null_fd;  // /dev/null, the input of overlapped commands
+} Autopar;
+
+typedef struct {
+  char *path;  // normalized absolute path
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  uint64_t hash;
+} MemoIndexEntry;
+
+typedef struct {
+  char name[17];  // hexadecimal key
+  off_t size;
+  struct timespec used;
+} MemoEntry;
+
+#define kHistSubBucketBits 4
+#define kHistSubBuckets (1 << kHistSubBucketBits)
+#define kHistBuckets (kHistSubBuckets * 37)  // up to 2^40 us, about 12 days
+#define kStatsSlots 128
+
+// Life of a statistics slot, which shells sharing the file claim with a
+// compare-and-swap before writing its name
+typedef enum {
+  kStatsSlotFree,
+  kStatsSlotClaimed,
+  kStatsSlotReady,
+} StatsSlotState;
+
+typedef struct {
+  char name[32];
+  uint32_t state;  // StatsSlotState
+  uint32_t count;
+  uint64_t wall_max, cpu_max;      // microseconds
+  uint64_t rss_kb;                 // decaying peak of the maximum RSS
+  uint32_t wall_hist[kHistBuckets];
+  uint32_t cpu_hist[kHistBuckets];
+} CommandStats;
+
+typedef struct {
+  uint64_t magic;
+  CommandStats slots[kStatsSlots];  // open-addressed by command name
+} StatsFile;
+
+typedef int (*BuiltinFunc)(int argc, char **argv, int status);
+
+typedef struct {
+  const char *name;
+  BuiltinFunc func;  // uses the standard streams of the shell
+  // Or, for built-ins that take their descriptors from a context and so
+  // may run on a thread of an in-process pipeline
+  ShellBuiltinFunc stream_func;
+} Builtin;
+
+typedef struct {
+  Builtin builtin;  // `stream_func` is the entry point of the object
+  char *path;
+  void *handle;
+  const ShellBuiltinDef *def;
+} LoadedBuiltin;
+
+typedef struct {
+  const char *name;        // interned
+  const Builtin *builtin;  // NULL if the command is no built-in
+  char *path;              // where `PATH` led, or NULL if not searched
+  uint64_t hash;
+  unsigned builtin_generation;
+  unsigned path_generation;  // 0 unless `path` is set
+  unsigned hits;             // resolutions to `path` since it was found
+} CommandCacheEntry;
+
+typedef struct {
+  char *pattern;  // NULL for a free slot
+  uint64_t hash;
+  int cflags;
+  int literal;  // plain text matched without `regex`, which is unset
+  int anchor_start, anchor_end;  // `^` and `$` around a literal
+  regex_t regex;
+  uint64_t last_used;  // value of the cache clock at the last lookup
+} RegexCacheEntry;
+
+typedef struct {
+  char *path;  // NULL for a free slot
+  uint64_t hash;
+  unsigned generation;  // stat_generation the result was cached in
+  int error;            // errno value if `stat` failed, or 0
+  struct stat st;
+} StatCacheEntry;
+
+typedef enum {
+  kLexText,
+  kLexCommand,
+  kLexOperator,
+  kLexRedirect,
+  kLexTarget,
+  kLexVariable,
+  kLexClassCount
+} LexClass;
+
+// Start of the index of the completion directory, followed by the entries
+// and the table of strings they point into
+typedef struct {
+  uint32_t magic;      // kCompletionIndexMagic
+  uint32_t version;    // kCompletionIndexVersion
+  uint32_t count;      // entries, sorted by name
+  uint32_t strings;    // bytes in the string table
+  int64_t dir_mtime;   // of the directory when indexed, in nanoseconds
+} CompletionIndexHeader;
+
+typedef struct {
+  uint32_t name;  // offsets into the string table
+  uint32_t file;
+} CompletionIndexEntry;
+
+typedef struct {
+  char *name;
+  char *generator;    // NULL if the command has no spec
+  char *source;       // spec file it was loaded from, or NULL
+  double load_time;   // seconds taken to source `source`
+  unsigned calls;
+  double total_time;  // seconds the generator ran, over all calls
+  double last_time;
+} CompletionSpec;
+
+// What the highlighting lexer knows between two words; compared whole by
+// LexStateEqual(), so made of bytes only
+typedef struct {
+  unsigned char command_seen;   // the command has its name already
+  unsigned char expect_target;  // the previous word was a redirection
+  unsigned char conditional;    // inside `[[ ]]`, where `<` and `>` compare
+} LexState;
+
+typedef struct {
+  size_t offset;  // start of a word
+  LexState state;
+} LexCheckpoint;
+
+typedef struct {
+  char *buf;
+  unsigned char *classes;  // LexClass of each byte of `buf`
+  size_t len;
+  size_t size;
+  size_t cursor;
+  DynamicArray *checkpoints;  // LexCheckpoint by offset, the first at 0
+  DynamicArray *fresh;        // checkpoints of the pass in progress
+  char *shown;                // the text as last drawn, and its classes
+  unsigned char *shown_classes;
+  size_t shown_len;
+  size_t shown_cursor;  // offset in `shown` the terminal cursor is at
+  size_t start_column;  // terminal column the text starts at
+  size_t columns;       // width of the terminal
+} LineEditor;
+
+typedef struct {
+  const char *str;  // canonical copy, NULL for a free slot
+  uint64_t hash;
+} InternSlot;
+
+// Binding of a variable declared with `local`, shared by every scope map
+// that contains it
+typedef struct {
+  size_t refs;
+  uint64_t hash;
+  unsigned owner;  // thread that may change the value in place
+  char *value;     // NULL while declared but unset
+  // Value seen by the stage snapshots of generation `changed_in`, taken
+  // before the shell thread changed it
+  char *snapshot_value;
+  unsigned changed_in;
+  char name[];
+} Variable;
+
+// Node of a persistent hash array mapped trie from names to Variables.
+// Nodes are never modified once built, so a scope is saved or snapshot by
+// keeping a reference to its root.
+typedef struct {
+  size_t refs;
+  uint32_t bitmap;  // slots present, indexed by 5 bits of the hash
+  uint32_t leaves;  // present slots holding a Variable rather than a node
+  void *slots[];    // one per bit set in `bitmap`
+} ScopeNode;
+
+// Block of bytes compared at once; compilers lower the operations on it to
+// single SSE2 or NEON instructions
+typedef char TextVector __attribute__((vector_size(kVectorBytes)));
+
+typedef struct {
+  int fd;
+  char *data;
+  size_t size;  // capacity, grown for lines longer than it
+  size_t len;   // bytes buffered
+  size_t done;  // bytes handed out by the last call to NextLines()
+  int eof;
+} LineReader;
+
+typedef struct {
+  int fd;
+  size_t len;
+  char data[kTextBufferSize];
+} TextWriter;
+
+typedef struct {
+  size_t first;  // 1-based
+  size_t last;   // SIZE_MAX for open ranges
+} FieldRange;
+
+typedef struct {
+  unsigned char *in;
+  unsigned char *out;
+  size_t in_len;
+  size_t out_len;
+} GzipBlock;
+
+// Compressor or decompressor between a `gz:` redirection target and the
+// pipe the command sees in its place
+typedef struct {
+  char *path;
+  int in_fd;       // pipe from the command, or the compressed file
+  int out_fd;      // the compressed file, or pipe to the command
+  pid_t pgid;      // process group of the job it belongs to, or 0
+  int finished;    // set once all data was written and descriptors closed
+  pthread_t thread;
+
+  // Compression: blocks are read into slots in order, compressed by any
+  // worker and written in order again
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  GzipBlock *slots;
+  size_t nslots;
+  uint64_t next_read, next_compress, next_write;
+  int eof;
+  int error;
+} RedirectStream;
+
+// Relay moving data between two stages of a pipeline profiled with
+// `set -o pipeprof`
+typedef struct {
+  int in_fd;             // read end of the pipe from the upstream stage
+  int out_fd;            // write end of the pipe to the downstream stage
+  uint64_t bytes;
+  double wait_in;        // seconds spent on an empty pipe
+  double wait_out;       // seconds spent on a full pipe
+  double start;
+  DynamicArray *slices;  // uint64_t bytes moved per kProfileSliceSeconds
+  pthread_t thread;
+  int started;
+} PipeRelay;
+
+// Start of the state snapshot a shell passes to its child shells, followed
+// by one byte per option and a name and path per loaded built-in
+typedef struct {
+  uint32_t magic;      // kSnapshotMagic
+  uint32_t version;    // kSnapshotVersion the snapshot was written with
+  uint32_t size;       // of the whole snapshot in bytes
+  uint32_t noptions;
+  uint32_t nbuiltins;
+} SnapshotHeader;
+
+typedef struct {
+  const Builtin *builtin;
+  DynamicArray *args;
+  ShellBuiltinContext ctx;  // owns its descriptors other than 0, 1 and 2
+  ScopeNode *scope;         // snapshot of the local variables
+  pthread_t thread;
+  int started;
+  int done;     // set once the stage has returned and closed its descriptors
+  int done_fd;  // eventfd signalled after `done` is set, or -1
+  int ret;
+} ThreadStage;
+
+typedef enum {
+  kDagWaiting,
+  kDagRunning,
+  kDagSucceeded,
+  kDagFailed,
+  kDagSkipped
+} DagState;
+
+typedef struct {
+  char *name;
+  char *dep_names;
+  char *cmdline;
+  char *command;             // first word of the command line
+  DynamicArray *deps;        // indices of tasks this task depends on
+  DynamicArray *dependents;  // indices of tasks depending on this task
+  size_t pending;            // dependencies that have not finished yet
+  size_t rank;               // length of the longest chain of dependents
+  size_t gate;               // dependency that finished last
+  DagState state;
+  pid_t pid;
+  int status;
+  double start, end;  // seconds since the run started
+} DagTask;
+
 const size_t kDefaultArraySize = 16;
 const size_t kInputMax = 1024;
 const size_t kPathMax = 512;
 const char *kPromptString = "\\u@\\h : \\b\n";
+const char *const kContinuationPrompt = "> ";
 const size_t kHostnameMax = 64;
 const unsigned int kRootUID = 0;
+const size_t kDagNoTask = (size_t)-1;
+const int kExitNotExecutable = 126;
+const int kExitNotFound = 127;
+// Interrupts the system calls of pipeline stage threads after ^C, and how
+// often it is sent until they return
+const int kStageCancelSignal = SIGUSR1;
+const int kStageCancelRetryMs = 50;
+const SpawnAttributes kDefaultSpawnAttributes = {
+    .stdin_fd = -1, .stdout_fd = -1, .stderr_fd = -1, .pgid = -1,
+    .ioprio = -1,   .umask = -1,     .dir_fd = -1,    .cgroup_fd = -1};
+const int kIoPrioClassShift = 13;
+const int kIoPrioWhoProcess = 1;
+const uint64_t kFnvOffsetBasis = 0xcbf29ce484222325ULL;
+const uint64_t kFnvPrime = 0x100000001b3ULL;
+const off_t kMemoMaxBytes = 64 * 1024 * 1024;
+const uint64_t kStatsMagic = 0x3373746174736873ULL;  // "shstats3"
+const int kStatsClaimSpins = 1000;
+const uint32_t kStatsOutlierMinRuns = 20;
+const unsigned kAdmitReservePercent = 10;  // of MemTotal, kept free
+const double kAdmitMaxMemPressure = 10.0;   // percent
+const double kAdmitMaxIoPressure = 40.0;    // percent
+const double kAdmitMaxLoadPerCpu = 1.0;
+const char *const kCgroupControllers[] = {"cpu", "io", "memory", "pids",
+                                          NULL};
+const long long kCpuMaxPeriod = 100000;  // microseconds
+const size_t kCaptureBytes = 256 * 1024;  // per job, a multiple of pages
+const size_t kCaptureTailLines = 10;
+const size_t kGzipBlockSize = 128 * 1024;  // compressed as separate members
+const int kGzipMaxWorkers = 16;
+const size_t kRelayChunk = 1024 * 1024;  // bytes per splice
+const double kProfileSliceSeconds = 0.25;
+const int kProfileGraphWidth = 40;
+const unsigned kScopeHashBits = 5;  // per trie level
+// Canonical copies of the words tokens are compared against
+const char kWordBackground[] = "&";
+const char kWordPipe[] = "|";
+const char kWordRedirectAppend[] = ">>";
+const char kWordRedirectClobber[] = ">|";
+const char kWordRedirectErr[] = "2>";
+const char kWordRedirectIn[] = "<";
+const char kWordRedirectOut[] = ">";
+const char kWordRedirectOutErr[] = "&>";
+const char kWordRedirectStdout[] = "1>";
+const char *const kInternedWords[] = {
+    kWordBackground,     kWordPipe,           kWordRedirectAppend,
+    kWordRedirectClobber, kWordRedirectErr,    kWordRedirectIn,
+    kWordRedirectOut,    kWordRedirectOutErr, kWordRedirectStdout,
+    NULL};
+const size_t kInternInitialSlots = 64;  // a power of two
+const uint32_t kSnapshotMagic = 0x70616e73;  // "snap"
+const uint32_t kSnapshotVersion = 3;  // changed with the options or layout
+const char *const kSnapshotVariable = "SHELL_SNAPSHOT_FD";
+// Characters with a meaning in extended regular expressions
+const char *const kRegexSpecial = "\\^$.[]|()*+?{}";
+const size_t kLexCheckpointBytes = 64;
+const char *const kCompletionDirVariable = "SHELL_COMPLETION_DIR";
+const uint32_t kCompletionIndexMagic = 0x78646963;  // "cidx"
+const uint32_t kCompletionIndexVersion = 1;
+// Colors of the highlighted classes, as SGR sequences
+const char *const kLexColors[kLexClassCount] = {
+    "\033[0m",    "\033[0;1;32m", "\033[0;1;35m",
+    "\033[0;33m", "\033[0;4m",    "\033[0;36m"};
+// Built-ins that change no file, so that the stat cache outlives them
+const char *const kStatCachePreserving[] = {"[", "[[", "local", "read",
+                                            "test", NULL};
+const int kCapturePollMs = 20;
+const int kCursorReportMs = 100;  // wait for the terminal to report
+const size_t kDefaultColumns = 80;
+const unsigned kIoUringEntries = 64;
+const uint8_t kIoUringOpWaitid = 50;  // Linux 6.7, missing from older headers
+const uint64_t kIoUringTagInput = 1;  // user_data values of non-pointer
+const uint64_t kIoUringTagWait = 2;   // requests; pointers are aligned
+const uint64_t kIoUringTagCancel = 3;
+const uint64_t kIoUringTagPreopen = 4;  // low bits of `index << 3 | 4`
+const uint64_t kIoUringTagMask = 7;
+const char *const kOptionNames[kOptionCount] = {
+    "admit",     "autopar",   "capture",  "highlight", "lastpipe",
+    "pipeprof",  "placement", "statcache", "statwarn",  "uring"};
+const char *const kPlacementValues[] = {"none", "spread", "compact", "numa",
+                                        NULL};
+// Values of options set with `set -o NAME=VALUE`, NULL for on/off options
+const char *const *const kOptionValues[kOptionCount] = {
+    NULL, NULL, NULL, NULL, NULL, NULL, kPlacementValues, NULL, NULL, NULL};
 
 // Shell Functions
+int AppendCommandLine(CommandBuffer *cb, const char *line);
+int ApplySpawnAttributes(const SpawnAttributes *attrs);
+int CallBuiltin(const Builtin *builtin, int argc, char **argv, int status);
 int CleanupRedirection(Process *proc);
+int DecodeWaitStatus(int wstatus);
+int ExecuteCommandLine(char *cmdline, int status);
 void ExpandPromptString(void);
+int ExpandVariables(DynamicArray *da_args, int status,
+                    DynamicArray **expanded);
+const Builtin *FindBuiltin(const char *name);
 RedirectType GetRedirectType(const char *op);
+size_t SkipConditionalOperands(char **args, size_t len);
 Process *InitProcess(void);
-int ParseCommand(Process *proc, DynamicArray *da_args, int status);
-void ReplaceExitStatusVariable(DynamicArray* da_args, int status);
+void FreePipeline(DynamicArray *da_stages);
+pid_t LaunchProcess(DynamicArray *da_args, int status,
+                    const SpawnAttributes *attrs);
+const Builtin *LookupBuiltin(const char *name);
+int ParseCommand(Process *proc, DynamicArray *da_args);
+void PrintPrompt(void);
+void RecordStageStats(const char *cmd, double start, const struct rusage *ru);
+void ResetCommandBuffer(CommandBuffer *cb);
+const CommandCacheEntry *ResolveCommand(const char *name, int search);
+char *SearchPath(const char *name);
+size_t LaunchPipeline(DynamicArray *da_stages, int status,
+                      const SpawnAttributes *base, PipeRelay *relays,
+                      pid_t *pids, pid_t *pgid);
+int RunPipeline(DynamicArray *da_stages, int status, int background);
+int IsThreadablePipeline(DynamicArray *da_stages);
+void *RunStageThread(void *arg);
+int RunThreadedPipeline(DynamicArray *da_stages, int status);
+int OpenRedirectTarget(const char *pathname, RedirectType rtype);
+int RedirectOpenFlags(RedirectType rtype, mode_t *mode);
 int SetupRedirection(Process *proc, int newfd, RedirectType rtype);
+DynamicArray *SplitPipeline(DynamicArray *da_args);
 DynamicArray *TokenizeCommandLine(char *cmdline);
 
+// Interned Strings
+void InsertInterned(const char *str, uint64_t hash);
+const char *InternString(const char *str, int insert);
+
+// Built-in Commands
+int BuiltinCd(int argc, char **argv, int status);
+int BuiltinConditional(int argc, char **argv, int status);
+int BuiltinComplete(int argc, char **argv, int status);
+int BuiltinCount(int argc, char **argv, const ShellBuiltinContext *ctx);
+int BuiltinDag(int argc, char **argv, int status);
+int BuiltinEnable(int argc, char **argv, int status);
+int BuiltinExit(int argc, char **argv, int status);
+int BuiltinFields(int argc, char **argv, const ShellBuiltinContext *ctx);
+int BuiltinHash(int argc, char **argv, int status);
+int BuiltinJobs(int argc, char **argv, int status);
+int BuiltinKill(int argc, char **argv, int status);
+int BuiltinLimit(int argc, char **argv, int status);
+int BuiltinLocal(int argc, char **argv, int status);
+int BuiltinMatch(int argc, char **argv, const ShellBuiltinContext *ctx);
+int BuiltinMemo(int argc, char **argv, int status);
+int BuiltinRead(int argc, char **argv, const ShellBuiltinContext *ctx);
+int BuiltinSet(int argc, char **argv, int status);
+int BuiltinSource(int argc, char **argv, int status);
+int BuiltinSpawn(int argc, char **argv, int status);
+int BuiltinStats(int argc, char **argv, int status);
+int BuiltinTest(int argc, char **argv, int status);
+int BuiltinTimeout(int argc, char **argv, int status);
+int BuiltinWait(int argc, char **argv, int status);
+int RunBuiltin(const Builtin *builtin, DynamicArray *da_args, int status);
+
+// Script Parallelization
+int AppendPath(DynamicArray *da_paths, const char *path);
+void CloseCapture(ParallelCommand *cmd);
+int CollectFileEffects(DynamicArray *da_args, FileEffects *effects,
+                       int annotated);
+int DrainParallel(Autopar *ap, int status);
+int EffectsConflict(const FileEffects *a, const FileEffects *b);
+void FreeAutopar(Autopar *ap);
+void FreePathList(DynamicArray *da_paths);
+int InitAutopar(Autopar *ap);
+char *NormalizePath(const char *path);
+void ParseEffectAnnotation(Autopar *ap, char *text);
+int PathListsIntersect(DynamicArray *da_a, DynamicArray *da_b);
+int ScheduleParallel(Autopar *ap, char *cmdline, int status);
+int WaitParallel(Autopar *ap, int *status);
+
+// Command Memoization
+int CompareMemoEntries(const void *a, const void *b);
+void EvictMemoEntries(const char *store, off_t max_bytes);
+void FreeMemoIndex(DynamicArray *da_index);
+int GetMemoStore(char *buf, size_t size);
+uint64_t HashBytes(uint64_t hash, const void *data, size_t len);
+int HashInputFile(DynamicArray *da_index, const char *path, uint64_t *hash);
+void LoadMemoIndex(const char *store, DynamicArray *da_index);
+int RecordMemoEntry(const char *store, const char *entry,
+                    DynamicArray *da_args, int status);
+void RemoveMemoEntry(const char *entry);
+int ReplayMemoEntry(const char *entry);
+void SaveMemoIndex(const char *store, DynamicArray *da_index);
+
+// Command Statistics
+void FormatMicroseconds(char *buf, size_t size, uint64_t us);
+size_t HistogramBucket(uint64_t value);
+uint64_t HistogramBucketValue(size_t index);
+uint64_t HistogramPercentile(const uint32_t *hist, double percentile);
+StatsFile *OpenStatsFile(void);
+CommandStats *LookupCommandStats(StatsFile *sf, const char *cmd, int create);
+int RecordCommandStats(const char *cmd, uint64_t wall_us, uint64_t cpu_us,
+                       uint64_t rss_kb);
+void AtomicMax(uint64_t *target, uint64_t value);
+
+// Spawn Attributes
+int ParseCpuList(const char *str, cpu_set_t *set);
+int ParseIoPriority(const char *str);
+int ParseResourceLimit(const char *str, ResourceLimit *limit);
+
+// Time Limits
+void ArmTimer(int timerfd, double seconds);
+double ParseDuration(const char *str);
+int ParseSignal(const char *str);
+void SetForegroundGroup(pid_t pgid);
+int WaitWithTimeout(pid_t pid, double duration, double kill_after, int sig,
+                    int *timed_out, int *killed);
+
+// Job Control and Placement
+Job *AddJob(DynamicArray *da_stages, int status);
+int CompareCompact(const void *a, const void *b, void *arg);
+int CompareSpread(const void *a, const void *b, void *arg);
+Job *FindJob(const char *spec);
+void FormatJobState(const Job *job, char *buf, size_t size);
+char *JoinPipeline(DynamicArray *da_stages);
+CpuTopology *LoadCpuTopology(void);
+int LowestCpu(const cpu_set_t *set);
+void NoteJobExit(pid_t pid, int wstatus, const struct rusage *ru);
+int PlaceJob(size_t nstages, cpu_set_t *sets);
+void PollJobs(void);
+int ReadSysfsFile(const char *path, char *buf, size_t size);
+void ReapJobs(void);
+void RemoveJob(size_t index);
+size_t RetireJob(size_t index);
+int StartBackgroundJob(DynamicArray *da_stages, int status);
+int StartJob(Job *job);
+void StartQueuedJobs(void);
+
+// Admission Control
+int AdmitJob(uint64_t need_kb, uint64_t committed_kb);
+int AdmitQueuedJob(const Job *job);
+uint64_t EstimateMemory(const char *cmd);
+uint64_t JobsPendingGrowth(void);
+uint64_t PendingGrowth(pid_t pid, const char *cmd);
+int ReadSystemLoad(SystemLoad *load);
+
+// Output Capture
+OutputRing *CreateOutputRing(size_t size, int *write_fd);
+void CloseOutputPipe(OutputRing *ring);
+void DrainOutputRing(OutputRing *ring);
+int DumpOutputRing(const OutputRing *ring, const char *path);
+void FreeOutputRing(OutputRing *ring);
+int GetEventLoop(void);
+void PrintOutputTail(const OutputRing *ring, size_t lines);
+int ReadCommandLine(char *buf, size_t size);
+int ShowJobOutput(int argc, char **argv);
+int WaitForInput(int fd, int timeout_ms);
+
+// Line Editor
+int LexStateEqual(const LexState *a, const LexState *b);
+void LexWord(const char *word, size_t len, LexState *state,
+             unsigned char *classes);
+void MoveEditorCursor(LineEditor *ed, TextWriter *out, size_t pos);
+size_t QueryCursorColumn(TextWriter *out);
+int ReadEditedLine(char *buf, size_t size);
+void RedrawLine(LineEditor *ed, TextWriter *out);
+size_t RelexLine(LineEditor *ed, size_t pos, size_t nold, size_t nnew);
+int ReplaceText(LineEditor *ed, size_t pos, size_t nold, const char *text,
+                size_t nnew);
+void StartEditedLine(LineEditor *ed, TextWriter *out);
+size_t TextColumns(const char *text, size_t len);
+void WriteHighlighted(TextWriter *out, const LineEditor *ed, size_t start,
+                      size_t end);
+
+// Programmable Completion
+CompletionSpec *AddCompletionSpec(const char *name);
+int AppendIndexPair(DynamicArray *da_pairs, const char *name,
+                    const char *file);
+int BuildCompletionIndex(const char *dir, const char *path, int64_t mtime);
+int CheckCompletionIndex(const CompletionIndexHeader *header, size_t size,
+                         int64_t mtime);
+void CollectCommandNames(const char *prefix, DynamicArray *candidates);
+void CollectFileNames(const char *prefix, DynamicArray *candidates);
+int CompareStrings(const void *a, const void *b);
+void CompleteWord(LineEditor *ed, TextWriter *out);
+CompletionSpec *FindCompletionSpec(const char *name, int load);
+int GetCompletionDir(char *buf, size_t size);
+void LoadCompletionSpec(const char *name);
+const CompletionIndexHeader *MapCompletionIndex(void);
+int RunCompletionGenerator(CompletionSpec *spec, char *const args[3],
+                           const char *line, DynamicArray *candidates);
+
+// Pipeline Profiling
+void PrintPipelineProfile(DynamicArray *da_stages, PipeRelay *relays,
+                          const struct rusage *usage, double wall);
+void *RunPipeRelay(void *arg);
+void StartPipeRelays(PipeRelay *relays, size_t nrelays);
+void StopPipeRelays(PipeRelay *relays, size_t nrelays);
+
+// Compressed Redirections
+void CloseThreadDescriptors(void);
+int CloseStreamEnd(int *fd);
+int CompressBlock(z_stream *z, GzipBlock *block, size_t out_size);
+void FinishStreams(pid_t pgid);
+int IsStreamTarget(const char *target);
+void *RunCompressor(void *arg);
+void *RunCompressWorker(void *arg);
+void *RunDecompressor(void *arg);
+RedirectStream *StartStream(const char *path, RedirectType rtype, int *fd);
+int StartStreamRedirections(DynamicArray **stages, size_t nstages);
+
+// Conditional Expressions
+int CachedStat(const char *path, struct stat *st);
+RegexCacheEntry *CompileRegex(const char *pattern, int cflags);
+int EvaluateConditional(const char *cmd, char **expr, int n, int extended);
+int MatchConditionalRegex(const char *str, const char *pattern);
+size_t MatchRegex(const RegexCacheEntry *entry, const char *str,
+                  regmatch_t *groups, size_t ngroups);
+int PreservesStatCache(DynamicArray *da_args, int background);
+
+// Text Built-ins
+size_t CountByte(const char *p, size_t n, char c);
+const char *FindByteSet(const char *p, const char *end, char a, char b,
+                        char c);
+int FlushText(TextWriter *w);
+void FreeLineReader(LineReader *r);
+int InitLineReader(LineReader *r, int fd);
+int NextLines(LineReader *r, char **begin, char **end);
+int ParseFieldList(const char *list, FieldRange *ranges, size_t *nranges);
+int WriteLine(TextWriter *w, const char *begin, const char *end);
+int WriteText(TextWriter *w, const char *p, size_t n);
+
+// Loadable Built-ins
+const char *GetShellVariable(const char *name);
+LoadedBuiltin *FindLoadedBuiltin(const char *name);
+int LoadBuiltin(const char *path, const char *name);
+int SetShellVariable(const char *name, const char *value);
+int UnloadBuiltin(const char *name);
+int UnsetShellVariable(const char *name);
+
+// Variable Scopes
+int AssignVariable(Variable *var, const char *value);
+int BindVariable(const char *name, const char *value);
+int ChangeVariable(const char *name, const char *value);
+int DeclareLocal(const char *name, const char *value);
+void FreeRetiredValues(void);
+ScopeNode **CurrentScope(void);
+ScopeNode *InsertVariable(const ScopeNode *node, Variable *var,
+                          unsigned shift);
+Variable *LookupVariable(const ScopeNode *node, const char *name,
+                         uint64_t hash);
+void PopScope(ScopeNode *saved);
+void PrintVariables(const ScopeNode *node);
+ScopeNode *PushScope(void);
+void ReleaseScope(ScopeNode *node);
+void ReleaseVariable(Variable *var);
+ScopeNode *RetainScope(ScopeNode *node);
+const char *VariableValue(const Variable *var);
+
+// State Snapshots
+int IsShellExecutable(const char *path);
+int LoadSnapshot(void);
+int PrepareSnapshot(void);
+
+// io_uring Backend
+void CancelIoUring(IoUring *ring, uint64_t until);
+void ClosePreopened(void);
+IoUring *GetIoUring(void);
+struct io_uring_sqe *GetSqe(IoUring *ring);
+int InitIoUring(IoUring *ring, unsigned entries);
+void PreopenRedirections(DynamicArray **stages, size_t nstages);
+void QueueCancel(IoUring *ring, uint64_t tag);
+void QueueCaptureReads(IoUring *ring);
+ssize_t ReadInput(int fd, void *buf, size_t len);
+int ReapIoUring(IoUring *ring, uint64_t until, int *result);
+int RunIoUring(IoUring *ring, uint64_t until, int *result);
+int SubmitIoUring(IoUring *ring, unsigned wait_nr);
+int WaitForChild(idtype_t idtype, id_t id);
+
+// Job Cgroups
+int ApplyJobLimits(Job *job);
+int CreateJobCgroup(Job *job);
+void FormatBytes(char *buf, size_t size, long long bytes);
+int OpenCgroupRoot(void);
+int ParseCpuMax(const char *str, char *buf, size_t size);
+int ParseMemoryMax(const char *str, char *buf, size_t size);
+void PrintJobLimits(const char *label, const JobLimits *limits);
+int ReadFileAt(int dir_fd, const char *path, char *buf, size_t size);
+void ReadGroupUsage(pid_t pgid, JobUsage *usage);
+void ReadJobUsage(const Job *job, JobUsage *usage);
+void RemoveCgroupLeaf(void);
+void RemoveJobCgroup(Job *job);
+int SignalJob(Job *job, int sig);
+int WriteFileAt(int dir_fd, const char *path, const char *value);
+
+// DAG Runner
+size_t FindDagTask(DynamicArray *da_tasks, const char *name);
+size_t FinishDagTask(DynamicArray *da_tasks, size_t index, DagState state);
+void FreeDagTasks(DynamicArray *da_tasks);
+void PrintDagReport(DynamicArray *da_tasks);
+int ReadDagTasks(FILE *fp, DynamicArray *da_tasks);
+int RunDagTasks(DynamicArray *da_tasks, size_t jobs, int status);
+DynamicArray *TopologicalOrder(DynamicArray *da_tasks);
+
 // Dynamic Array Methods
 int AppendElement(DynamicArray *da, void *elem);
 void FreeDynamicArray(DynamicArray *da);
@@ -64,7 +942,46 @@ DynamicArray *InitDynamicArray(size_t size, size_t type_size);
 int ResizeDynamicArray(DynamicArray *da, size_t new_size);
 
 // Utility Functions
-void _PrintError(const char *format, ...);
+int CopyFd(int from, int to);
+int GetCachePath(const char *name, char *buf, size_t size);
+double MonotonicSeconds(void);
+uint64_t TimevalMicroseconds(const struct timeval *tv);
+void _PrintError(const char *func, int line, const char *format, ...);
 void sigint_handler(int signum);
+void stage_cancel_handler(int signum);
+
+const Builtin kBuiltins[] = {
+    {".", BuiltinSource, NULL},
+    {"[", BuiltinTest, NULL},
+    {"[[", BuiltinConditional, NULL},
+    {"cd", BuiltinCd, NULL},
+    {"complete", BuiltinComplete, NULL},
+    {"count", NULL, BuiltinCount},
+    {"dag", BuiltinDag, NULL},
+    {"enable", BuiltinEnable, NULL},
+    {"exit", BuiltinExit, NULL},
+    {"fields", NULL, BuiltinFields},
+    {"hash", BuiltinHash, NULL},
+    {"jobs", BuiltinJobs, NULL},
+    {"kill", BuiltinKill, NULL},
+    {"limit", BuiltinLimit, NULL},
+    {"local", BuiltinLocal, NULL},
+    {"match", NULL, BuiltinMatch},
+    {"memo", BuiltinMemo, NULL},
+    {"read", NULL, BuiltinRead},
+    {"set", BuiltinSet, NULL},
+    {"source", BuiltinSource, NULL},
+    {"spawn", BuiltinSpawn, NULL},
+    {"stats", BuiltinStats, NULL},
+    {"test", BuiltinTest, NULL},
+    {"timeout", BuiltinTimeout, NULL},
+    {"wait", BuiltinWait, NULL},
+    {NULL, NULL, NULL},
+};
+
+const ShellApi kShellApi = {
+    SHELL_BUILTIN_ABI_VERSION, sizeof(ShellApi), GetShellVariable,
+    SetShellVariable,          UnsetShellVariable,
+};
 
 #endif  // SHELL_H_
\ No newline at end of file
@@ -0,0 +1,86 @@
+#ifndef SHELL_BUILTIN_H_
+#define SHELL_BUILTIN_H_
+
+/**
+ * @file shell_builtin.h
+ * @brief Stable interface for built-ins loaded with `enable -f`.
+ *
+ * A loadable built-in is a shared object that exports a `ShellBuiltinDef`
+ * named `<name>_builtin`, where `<name>` is the command it provides:
+ *
+ *     #include "shell_builtin.h"
+ *
+ *     static int Hello(int argc, char **argv, const ShellBuiltinContext *ctx) {
+ *       dprintf(ctx->stdout_fd, "hello %s\n", argc > 1 ? argv[1] : "world");
+ *       return 0;
+ *     }
+ *
+ *     ShellBuiltinDef hello_builtin = {
+ *         SHELL_BUILTIN_ABI_VERSION, "hello", Hello, NULL, NULL,
+ *         "hello [NAME]",
+ *     };
+ *
+ * Build it with `gcc -shared -fPIC -o hello.so hello.c` and load it with
+ * `enable -f ./hello.so hello`. The built-in then runs inside the shell
+ * process, or inside the child of a pipeline stage, without a fork of its
+ * own.
+ *
+ * The shell reaches the built-in only through these structures, so it need
+ * not export any symbol. Fields are only ever appended: a built-in compiled
+ * against an older header keeps working, and one that uses a newer field of
+ * `ShellApi` checks `size` first. `SHELL_BUILTIN_ABI_VERSION` changes only
+ * when existing fields change, and the shell refuses other versions.
+ */
+
+#include <stddef.h>
+
+#define SHELL_BUILTIN_ABI_VERSION 1
+
+/**
+ * @brief Services of the shell, available to loaded built-ins.
+ *
+ * Variables are those the shell passes on to the commands it runs.
+ */
+typedef struct ShellApi {
+  unsigned abi_version;  // SHELL_BUILTIN_ABI_VERSION of the shell
+  size_t size;           // sizeof(ShellApi) in the shell
+
+  /** @brief Returns the value of a variable, or NULL if it is unset. */
+  const char *(*get_variable)(const char *name);
+  /** @brief Sets a variable; returns 0, or -1 with errno set. */
+  int (*set_variable)(const char *name, const char *value);
+  /** @brief Unsets a variable; returns 0, or -1 with errno set. */
+  int (*unset_variable)(const char *name);
+} ShellApi;
+
+/**
+ * @brief What a built-in receives besides its arguments on each call.
+ *
+ * The descriptors already reflect the redirections of the command.
+ */
+typedef struct ShellBuiltinContext {
+  const ShellApi *api;
+  int stdin_fd;
+  int stdout_fd;
+  int stderr_fd;
+  int last_status;  // Exit status of the previous command, as in `$?`
+} ShellBuiltinContext;
+
+typedef int (*ShellBuiltinFunc)(int argc, char **argv,
+                                const ShellBuiltinContext *ctx);
+
+/**
+ * @brief Definition exported by a loadable built-in as `<name>_builtin`.
+ */
+typedef struct ShellBuiltinDef {
+  unsigned abi_version;  // SHELL_BUILTIN_ABI_VERSION the object was built for
+  const char *name;
+  ShellBuiltinFunc func;
+  /** @brief Optional; called once after loading. Nonzero refuses the load. */
+  int (*load)(const ShellApi *api);
+  /** @brief Optional; called before the object is unloaded. */
+  void (*unload)(void);
+  const char *usage;  // Optional one-line synopsis
+} ShellBuiltinDef;
+
+#endif  // SHELL_BUILTIN_H_